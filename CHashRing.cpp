@@ -0,0 +1,61 @@
+#include "CHashRing.h"
+#include "CMaglevTable.h"
+#include <algorithm>
+
+// Constructor
+CHashRing::CHashRing()
+{
+}
+
+// Destructor
+CHashRing::~CHashRing()
+{
+}
+
+// Rebuild the ring
+// The points of a backend depend only on its ID, so adding or removing a backend only moves the keys around its own points.
+void CHashRing::Build(const std::vector<unsigned long long>& vecBackendIDs_)
+{
+	std::vector<std::pair<unsigned long long, int> > vecPoints;
+	vecPoints.reserve(vecBackendIDs_.size() * HASH_RING_POINTS_PER_BACKEND);
+	
+	for (size_t i = 0; i < vecBackendIDs_.size(); ++i)
+	{
+		for (unsigned long long j = 0; j < HASH_RING_POINTS_PER_BACKEND; ++j)
+			vecPoints.push_back(std::make_pair(CMaglevTable::Hash(vecBackendIDs_[i] ^ (j * 0xD6E8FEB86659FD93ULL)), (int)i));
+	}
+	
+	// Points with the same hash value are ordered by backend index, so every thread builds the same ring
+	std::sort(vecPoints.begin(), vecPoints.end());
+	
+	m_vecPoints.resize(vecPoints.size());
+	m_vecBackends.resize(vecPoints.size());
+	for (size_t i = 0; i < vecPoints.size(); ++i)
+	{
+		m_vecPoints[i] = vecPoints[i].first;
+		m_vecBackends[i] = vecPoints[i].second;
+	}
+}
+
+// Get the number of points on the ring (0 if there is no backend)
+size_t CHashRing::GetSize() const
+{
+	return m_vecPoints.size();
+}
+
+// Get the position of the first point clockwise from the hash value of a key
+// A key larger than every point belongs to the first point on the ring
+size_t CHashRing::FindFirstPosition(unsigned long long ulKey_) const
+{
+	std::vector<unsigned long long>::const_iterator itor = std::lower_bound(m_vecPoints.begin(), m_vecPoints.end(), CMaglevTable::Hash(ulKey_));
+	if (m_vecPoints.end() == itor)
+		return 0;
+	
+	return itor - m_vecPoints.begin();
+}
+
+// Get the index of the backend (in the vector given to Build()) that owns the point at a position
+int CHashRing::GetBackend(size_t uiPosition_) const
+{
+	return m_vecBackends[uiPosition_ % m_vecBackends.size()];
+}
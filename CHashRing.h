@@ -0,0 +1,37 @@
+#pragma once
+#include <stddef.h>
+#include <vector>
+
+// The number of points that each backend has on a hash ring
+// More points spread the keys more evenly over the backends, but make the ring larger.
+#define HASH_RING_POINTS_PER_BACKEND 64
+
+// Consistent hashing ring
+// Each backend owns several points on a ring of 64-bit hash values, and a key belongs to the first point clockwise from its hash value.
+// Unlike a Maglev lookup table, the points after the first one can be visited in order,
+// so a key can move on to the next backend on the ring when its own backend is too busy.
+class CHashRing
+{
+public:
+	CHashRing(); // Constructor
+	~CHashRing(); // Destructor
+	
+	// Rebuild the ring
+	// Each backend is identified by a 64-bit value that does not change when the ring is rebuilt (ex. a hash value of its address).
+	void Build(const std::vector<unsigned long long>& vecBackendIDs_);
+	
+	// Get the number of points on the ring (0 if there is no backend)
+	size_t GetSize() const;
+	
+	// Get the position of the first point clockwise from the hash value of a key
+	// The ring must not be empty
+	size_t FindFirstPosition(unsigned long long ulKey_) const;
+	
+	// Get the index of the backend (in the vector given to Build()) that owns the point at a position
+	// Positions past the end wrap around to the beginning of the ring
+	int GetBackend(size_t uiPosition_) const;
+
+private:
+	std::vector<unsigned long long> m_vecPoints; // Hash value of each point in ascending order
+	std::vector<int> m_vecBackends; // Backend index of each point
+};
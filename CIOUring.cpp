@@ -0,0 +1,375 @@
+#include "CIOUring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+// The completion queue is larger than the submission queue, because a multishot request completes many times
+#define IO_URING_COMPLETION_QUEUE_FACTOR 8
+
+// Constructor
+CIOUring::CIOUring()
+{
+	m_iRingFD = -1;
+	
+	m_pSQRing = MAP_FAILED;
+	m_uiSQRingSize = 0;
+	m_pSQHead = NULL;
+	m_pSQTail = NULL;
+	m_uiSQMask = 0;
+	m_uiSQEntries = 0;
+	m_pSQArray = NULL;
+	m_pSQEs = (struct io_uring_sqe*)MAP_FAILED;
+	m_uiSQEsSize = 0;
+	m_uiSQLocalTail = 0;
+	
+	m_pCQRing = MAP_FAILED;
+	m_uiCQRingSize = 0;
+	m_pCQHead = NULL;
+	m_pCQTail = NULL;
+	m_uiCQMask = 0;
+	m_pCQEs = NULL;
+	
+	m_uiBufferCounts = 0;
+	m_uiBufferSize = 0;
+	m_pBuffers = NULL;
+}
+
+// Destructor
+CIOUring::~CIOUring()
+{
+	if (-1 != m_iRingFD)
+		close(m_iRingFD);
+	
+	if (MAP_FAILED != (void*)m_pSQEs)
+		munmap(m_pSQEs, m_uiSQEsSize);
+	
+	if (MAP_FAILED != m_pSQRing)
+		munmap(m_pSQRing, m_uiSQRingSize);
+	
+	free(m_pBuffers);
+}
+
+// Check once at startup if the kernel supports every feature that the load balancer uses
+// A ring set up with IORING_SETUP_DEFER_TASKRUN means Linux 6.1 or later, which has multishot accept and multishot recv.
+// The ring is also refused if io_uring is disabled (ex. kernel.io_uring_disabled or a seccomp filter).
+bool CIOUring::IsSupported()
+{
+	CIOUring IOUring;
+	if (-1 == IOUring.SetUp(8, 8, 64))
+		return false;
+	
+	const size_t uiProbeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe* pProbe = (struct io_uring_probe*)calloc(1, uiProbeSize);
+	if (NULL == pProbe)
+		return false;
+	
+	bool bSupported = false;
+	if (0 == syscall(__NR_io_uring_register, IOUring.m_iRingFD, IORING_REGISTER_PROBE, pProbe, 256))
+	{
+		const int iOperations[] = { IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE, IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_ASYNC_CANCEL, IORING_OP_PROVIDE_BUFFERS };
+		bSupported = true;
+		for (size_t i = 0; i < sizeof(iOperations) / sizeof(iOperations[0]); ++i)
+		{
+			if (iOperations[i] > pProbe->last_op || 0 == (IO_URING_OP_SUPPORTED & pProbe->ops[iOperations[i]].flags))
+				bSupported = false;
+		}
+	}
+	
+	free(pProbe);
+	
+	return bSupported;
+}
+
+// Set up the rings and provide the buffers
+// errno tells the reason of a failure.
+// Return -1 on Failure
+// Return 0 on Success
+int CIOUring::SetUp(unsigned int uiEntries_, unsigned int uiBufferCounts_, unsigned int uiBufferSize_)
+{
+	struct io_uring_params stParams;
+	memset(&stParams, 0, sizeof(stParams));
+	stParams.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_CQSIZE;
+	stParams.cq_entries = uiEntries_ * IO_URING_COMPLETION_QUEUE_FACTOR;
+	
+	m_iRingFD = (int)syscall(__NR_io_uring_setup, uiEntries_, &stParams);
+	if (-1 == m_iRingFD)
+		return -1;
+	
+	// Completions are never lost, and a wait can time out without a timeout request
+	const unsigned int uiFeatures = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+	if (uiFeatures != (uiFeatures & stParams.features))
+	{
+		errno = ENOSYS;
+		return -1;
+	}
+	
+	// Both rings are in a single mapping
+	m_uiSQRingSize = stParams.sq_off.array + stParams.sq_entries * sizeof(unsigned int);
+	m_uiCQRingSize = stParams.cq_off.cqes + stParams.cq_entries * sizeof(struct io_uring_cqe);
+	if (m_uiCQRingSize > m_uiSQRingSize)
+		m_uiSQRingSize = m_uiCQRingSize;
+	
+	m_pSQRing = mmap(NULL, m_uiSQRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_iRingFD, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == m_pSQRing)
+		return -1;
+	
+	m_pCQRing = m_pSQRing;
+	
+	m_uiSQEsSize = stParams.sq_entries * sizeof(struct io_uring_sqe);
+	m_pSQEs = (struct io_uring_sqe*)mmap(NULL, m_uiSQEsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_iRingFD, IORING_OFF_SQES);
+	if (MAP_FAILED == (void*)m_pSQEs)
+		return -1;
+	
+	unsigned char* pSQRing = (unsigned char*)m_pSQRing;
+	m_pSQHead = (unsigned int*)(pSQRing + stParams.sq_off.head);
+	m_pSQTail = (unsigned int*)(pSQRing + stParams.sq_off.tail);
+	m_uiSQMask = *(unsigned int*)(pSQRing + stParams.sq_off.ring_mask);
+	m_uiSQEntries = *(unsigned int*)(pSQRing + stParams.sq_off.ring_entries);
+	m_pSQArray = (unsigned int*)(pSQRing + stParams.sq_off.array);
+	m_uiSQLocalTail = *m_pSQTail;
+	
+	// Entry i of the array always points to submission queue entry i
+	for (unsigned int i = 0; i < m_uiSQEntries; ++i)
+		m_pSQArray[i] = i;
+	
+	unsigned char* pCQRing = (unsigned char*)m_pCQRing;
+	m_pCQHead = (unsigned int*)(pCQRing + stParams.cq_off.head);
+	m_pCQTail = (unsigned int*)(pCQRing + stParams.cq_off.tail);
+	m_uiCQMask = *(unsigned int*)(pCQRing + stParams.cq_off.ring_mask);
+	m_pCQEs = (struct io_uring_cqe*)(pCQRing + stParams.cq_off.cqes);
+	
+	// Every buffer is provided at once, and handed to the kernel with the first submission
+	m_uiBufferCounts = uiBufferCounts_;
+	m_uiBufferSize = uiBufferSize_;
+	m_pBuffers = (unsigned char*)malloc((size_t)m_uiBufferCounts * m_uiBufferSize);
+	if (NULL == m_pBuffers)
+		return -1;
+	
+	return PrepareProvideBuffers(0, m_uiBufferCounts);
+}
+
+// Fill a submission queue entry with a one-shot poll
+// It completes once with the events that have occurred, like an epoll event of a level-triggered descriptor.
+// Return -1 on Failure
+// Return 0 on Success
+int CIOUring::PreparePoll(int iSockFD_, unsigned int uiEvents_, unsigned long long ulUserData_)
+{
+	struct io_uring_sqe* pEntry = GetSubmissionEntry();
+	if (NULL == pEntry)
+		return -1;
+	
+	pEntry->opcode = IORING_OP_POLL_ADD;
+	pEntry->fd = iSockFD_;
+	pEntry->poll32_events = uiEvents_;
+	pEntry->user_data = ulUserData_;
+	
+	return 0;
+}
+
+// Fill a submission queue entry that changes the events of a poll in flight
+// The poll keeps its user data. If it has already completed, the update fails and nothing changes.
+// Return -1 on Failure
+// Return 0 on Success
+int CIOUring::PreparePollUpdate(unsigned long long ulTargetUserData_, unsigned int uiEvents_, unsigned long long ulUserData_)
+{
+	struct io_uring_sqe* pEntry = GetSubmissionEntry();
+	if (NULL == pEntry)
+		return -1;
+	
+	pEntry->opcode = IORING_OP_POLL_REMOVE;
+	pEntry->fd = -1;
+	pEntry->addr = ulTargetUserData_;
+	pEntry->len = IORING_POLL_UPDATE_EVENTS;
+	pEntry->poll32_events = uiEvents_;
+	pEntry->user_data = ulUserData_;
+	
+	return 0;
+}
+
+// Fill a submission queue entry with a multishot accept
+// It completes once for every accepted socket until it fails or is cancelled. The address of the peer is not returned.
+// Return -1 on Failure
+// Return 0 on Success
+int CIOUring::PrepareMultishotAccept(int iListenSockFD_, unsigned long long ulUserData_)
+{
+	struct io_uring_sqe* pEntry = GetSubmissionEntry();
+	if (NULL == pEntry)
+		return -1;
+	
+	pEntry->opcode = IORING_OP_ACCEPT;
+	pEntry->fd = iListenSockFD_;
+	pEntry->accept_flags = SOCK_NONBLOCK;
+	pEntry->ioprio = IORING_ACCEPT_MULTISHOT;
+	pEntry->user_data = ulUserData_;
+	
+	return 0;
+}
+
+// Fill a submission queue entry with a multishot recv
+// It completes once for every chunk of data received into a provided buffer until it fails, the peer closes the connection, or it is cancelled.
+// It also fails with -ENOBUFS when no buffer is left, and must be made again after buffers have been given back.
+// Return -1 on Failure
+// Return 0 on Success
+int CIOUring::PrepareMultishotRecv(int iSockFD_, unsigned long long ulUserData_)
+{
+	struct io_uring_sqe* pEntry = GetSubmissionEntry();
+	if (NULL == pEntry)
+		return -1;
+	
+	pEntry->opcode = IORING_OP_RECV;
+	pEntry->fd = iSockFD_;
+	pEntry->flags = IOSQE_BUFFER_SELECT;
+	pEntry->buf_group = IO_URING_BUFFER_GROUP_ID;
+	pEntry->ioprio = IORING_RECV_MULTISHOT;
+	pEntry->user_data = ulUserData_;
+	
+	return 0;
+}
+
+// Fill a submission queue entry that cancels a request in flight
+// The cancelled request completes with -ECANCELED (Or with its last result if it was completing anyway).
+// Return -1 on Failure
+// Return 0 on Success
+int CIOUring::PrepareCancel(unsigned long long ulTargetUserData_, unsigned long long ulUserData_)
+{
+	struct io_uring_sqe* pEntry = GetSubmissionEntry();
+	if (NULL == pEntry)
+		return -1;
+	
+	pEntry->opcode = IORING_OP_ASYNC_CANCEL;
+	pEntry->fd = -1;
+	pEntry->addr = ulTargetUserData_;
+	pEntry->user_data = ulUserData_;
+	
+	return 0;
+}
+
+// Submit every prepared request and wait until a completion arrives or until the timeout
+// Return -1 on Failure
+// Return 0 on Success
+int CIOUring::SubmitAndWait(int iTimeout_)
+{
+	__atomic_store_n(m_pSQTail, m_uiSQLocalTail, __ATOMIC_RELEASE);
+	unsigned int uiSubmitCounts = m_uiSQLocalTail - __atomic_load_n(m_pSQHead, __ATOMIC_ACQUIRE);
+	
+	unsigned int uiFlags = IORING_ENTER_GETEVENTS;
+	struct __kernel_timespec stTimeout;
+	struct io_uring_getevents_arg stArg;
+	memset(&stArg, 0, sizeof(stArg));
+	if (0 <= iTimeout_)
+	{
+		stTimeout.tv_sec = iTimeout_ / 1000;
+		stTimeout.tv_nsec = (iTimeout_ % 1000) * 1000000LL;
+		stArg.ts = (unsigned long long)&stTimeout;
+		uiFlags |= IORING_ENTER_EXT_ARG;
+	}
+	
+	long iResult = syscall(__NR_io_uring_enter, m_iRingFD, uiSubmitCounts, 1, uiFlags, (0 <= iTimeout_) ? &stArg : NULL, sizeof(stArg));
+	if (-1 == iResult)
+	{
+		// The timeout has expired, a signal has arrived, or completions are waiting to be seen
+		if (ETIME == errno || EINTR == errno || EBUSY == errno || EAGAIN == errno)
+			return 0;
+		
+		return -1;
+	}
+	
+	return 0;
+}
+
+// Get the oldest completion that has not been seen yet (NULL if there is none)
+// Only a request that failed to give buffers to the kernel completes (IOSQE_CQE_SKIP_SUCCESS), and its buffers are lost.
+const struct io_uring_cqe* CIOUring::PeekCompletion()
+{
+	unsigned int uiTail = __atomic_load_n(m_pCQTail, __ATOMIC_ACQUIRE);
+	while (*m_pCQHead != uiTail)
+	{
+		const struct io_uring_cqe* pCompletion = &m_pCQEs[*m_pCQHead & m_uiCQMask];
+		if (IO_URING_PROVIDE_BUFFERS_USER_DATA != pCompletion->user_data)
+			return pCompletion;
+		
+		errno = -pCompletion->res;
+		perror("io_uring provide buffers");
+		SeenCompletion();
+	}
+	
+	return NULL;
+}
+
+// Give the slot of the oldest completion back to the kernel
+void CIOUring::SeenCompletion()
+{
+	__atomic_store_n(m_pCQHead, *m_pCQHead + 1, __ATOMIC_RELEASE);
+}
+
+// Get a buffer that the kernel has filled
+unsigned char* CIOUring::GetBuffer(unsigned short usBufferID_)
+{
+	return m_pBuffers + (size_t)usBufferID_ * m_uiBufferSize;
+}
+
+// Give a buffer back to the kernel once its data has been consumed
+// The buffer is handed over with the next submission, so giving it back costs no system call of its own.
+// Return -1 on Failure
+// Return 0 on Success
+int CIOUring::RecycleBuffer(unsigned short usBufferID_)
+{
+	return PrepareProvideBuffers(usBufferID_, 1);
+}
+
+// Fill a submission queue entry that gives consecutive buffers to the kernel
+// Return -1 on Failure
+// Return 0 on Success
+int CIOUring::PrepareProvideBuffers(unsigned short usBufferID_, unsigned int uiCounts_)
+{
+	struct io_uring_sqe* pEntry = GetSubmissionEntry();
+	if (NULL == pEntry)
+		return -1;
+	
+	pEntry->opcode = IORING_OP_PROVIDE_BUFFERS;
+	pEntry->flags = IOSQE_CQE_SKIP_SUCCESS;
+	pEntry->fd = (int)uiCounts_;
+	pEntry->addr = (unsigned long long)GetBuffer(usBufferID_);
+	pEntry->len = m_uiBufferSize;
+	pEntry->off = usBufferID_;
+	pEntry->buf_group = IO_URING_BUFFER_GROUP_ID;
+	pEntry->user_data = IO_URING_PROVIDE_BUFFERS_USER_DATA;
+	
+	return 0;
+}
+
+// Get a free submission queue entry, submitting the entries filled so far if the queue is full
+// Return NULL on Failure
+struct io_uring_sqe* CIOUring::GetSubmissionEntry()
+{
+	if (m_uiSQLocalTail - __atomic_load_n(m_pSQHead, __ATOMIC_ACQUIRE) >= m_uiSQEntries)
+	{
+		if (-1 == Submit() || m_uiSQLocalTail - __atomic_load_n(m_pSQHead, __ATOMIC_ACQUIRE) >= m_uiSQEntries)
+			return NULL;
+	}
+	
+	struct io_uring_sqe* pEntry = &m_pSQEs[m_uiSQLocalTail & m_uiSQMask];
+	memset(pEntry, 0, sizeof(*pEntry));
+	++m_uiSQLocalTail;
+	
+	return pEntry;
+}
+
+// Hand the entries filled so far to the kernel without waiting
+// Return -1 on Failure
+// Return 0 on Success
+int CIOUring::Submit()
+{
+	__atomic_store_n(m_pSQTail, m_uiSQLocalTail, __ATOMIC_RELEASE);
+	unsigned int uiSubmitCounts = m_uiSQLocalTail - __atomic_load_n(m_pSQHead, __ATOMIC_ACQUIRE);
+	
+	if (-1 == syscall(__NR_io_uring_enter, m_iRingFD, uiSubmitCounts, 0, 0, NULL, 0) && EINTR != errno && EBUSY != errno && EAGAIN != errno)
+		return -1;
+	
+	return 0;
+}
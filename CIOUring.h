@@ -0,0 +1,93 @@
+#pragma once
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// The buffer group of the provided buffers (A multishot recv picks its buffers from this group)
+#define IO_URING_BUFFER_GROUP_ID 0
+
+// The user data of the requests that give buffers to the kernel (Their completions are handled by the ring itself)
+#define IO_URING_PROVIDE_BUFFERS_USER_DATA 0xFFFFFFFFFFFFFFFFULL
+
+// Minimal io_uring instance of a thread, set up with the system calls directly (liburing is not required)
+// The submission queue entries are filled by the Prepare functions and handed to the kernel all at once by SubmitAndWait(),
+// so arming many requests costs a single system call.
+// Buffers can be provided, from which the kernel picks a buffer for each chunk of data that a multishot recv receives.
+// Only the thread that set up the ring uses it (IORING_SETUP_SINGLE_ISSUER), so the ring needs no lock.
+class CIOUring
+{
+public:
+	CIOUring(); // Constructor
+	~CIOUring(); // Destructor
+	
+	// Check once at startup if the kernel supports every feature that the load balancer uses
+	static bool IsSupported();
+	
+	// Set up the rings with uiEntries_ submission queue entries (A power of two), and provide uiBufferCounts_ buffers of uiBufferSize_ bytes
+	// Return -1 on Failure
+	// Return 0 on Success
+	int SetUp(unsigned int uiEntries_, unsigned int uiBufferCounts_, unsigned int uiBufferSize_);
+	
+	// Fill a submission queue entry with a request (The request is submitted by the next SubmitAndWait())
+	// Return -1 on Failure
+	// Return 0 on Success
+	int PreparePoll(int iSockFD_, unsigned int uiEvents_, unsigned long long ulUserData_); // One-shot poll
+	int PreparePollUpdate(unsigned long long ulTargetUserData_, unsigned int uiEvents_, unsigned long long ulUserData_); // Change the events of a poll in flight
+	int PrepareMultishotAccept(int iListenSockFD_, unsigned long long ulUserData_); // Accepted sockets are non-blocking
+	int PrepareMultishotRecv(int iSockFD_, unsigned long long ulUserData_); // Into a provided buffer
+	int PrepareCancel(unsigned long long ulTargetUserData_, unsigned long long ulUserData_);
+	
+	// Submit every prepared request and wait until a completion arrives or until the timeout (milliseconds, -1 waits forever)
+	// Return -1 on Failure
+	// Return 0 on Success (Including the timeout and an interrupted wait)
+	int SubmitAndWait(int iTimeout_);
+	
+	// Get the oldest completion that has not been seen yet (NULL if there is none)
+	// The completion must be copied before SeenCompletion() because its slot is reused afterwards.
+	// The completions of the requests that give buffers to the kernel are skipped.
+	const struct io_uring_cqe* PeekCompletion();
+	void SeenCompletion();
+	
+	// Get a buffer that the kernel has filled, and give it back to the kernel once its data has been consumed (With the next submission)
+	unsigned char* GetBuffer(unsigned short usBufferID_);
+	int RecycleBuffer(unsigned short usBufferID_);
+
+private:
+	int m_iRingFD;
+	
+	// Submission queue ring (Shared with the kernel)
+	void* m_pSQRing;
+	size_t m_uiSQRingSize;
+	unsigned int* m_pSQHead;
+	unsigned int* m_pSQTail;
+	unsigned int m_uiSQMask;
+	unsigned int m_uiSQEntries;
+	unsigned int* m_pSQArray;
+	struct io_uring_sqe* m_pSQEs;
+	size_t m_uiSQEsSize;
+	
+	// Entries filled since the last submission (The tail is published to the kernel on submission)
+	unsigned int m_uiSQLocalTail;
+	
+	// Completion queue ring (Shared with the kernel, and in the same mapping as the submission queue ring with IORING_FEAT_SINGLE_MMAP)
+	void* m_pCQRing;
+	size_t m_uiCQRingSize;
+	unsigned int* m_pCQHead;
+	unsigned int* m_pCQTail;
+	unsigned int m_uiCQMask;
+	struct io_uring_cqe* m_pCQEs;
+	
+	// Buffers provided to the kernel
+	unsigned int m_uiBufferCounts;
+	unsigned int m_uiBufferSize;
+	unsigned char* m_pBuffers;
+
+private:
+	// Get a free submission queue entry, submitting the entries filled so far if the queue is full (NULL on Failure)
+	struct io_uring_sqe* GetSubmissionEntry();
+	
+	// Fill a submission queue entry that gives uiCounts_ consecutive buffers to the kernel
+	int PrepareProvideBuffers(unsigned short usBufferID_, unsigned int uiCounts_);
+	
+	// Hand the entries filled so far to the kernel without waiting
+	int Submit();
+};
@@ -1,4 +1,5 @@
 #include "CLoadBalancer.h"
+#include <new>
 
 // Since each thread manages different servers and clients, 
 // the update operation of the server state can be done lockfree.
@@ -6,25 +7,97 @@
 // it acceses the server state information only with read operations.
 // Therefore, load balancing is also done lockfree.
 
-// The number of servers connected to each thread of this Loadbalancer.
-long g_uiServerCounts[MAX_THREAD_COUNTS] = { 0 };
+// Servers, their status, and everything else that each thread publishes about them (See Server_Shard)
+// Each thread writes only on its own shard, and other threads only read it.
+Server_Shard g_stServerShards[MAX_THREAD_COUNTS];
 
-// Information used for load balancing
-// The number of clients currently connected to each server
+// Servers handed off between threads, indexed by [target thread][source thread] (See Server_Handoff_Queue)
+Server_Handoff_Queue g_stServerHandoffQueues[MAX_THREAD_COUNTS][MAX_THREAD_COUNTS];
 
-Simple_List<long int*>* g_pClientCountsList[MAX_THREAD_COUNTS] = { 0 };
+// The eventfd of each thread that tells the thread that servers have been handed off to it
+// Created before the threads start, so every thread reads it without a lock (See CLoadBalancer::SetUpServerHandoff())
+int g_iHandoffEventFDs[MAX_THREAD_COUNTS];
 
-// Other information can be used for load balancing as well.
-// For example, the number of requests that each server has received from clients for a certain time period.
-//Simple_List<long int*>* g_pRequestCountsList[MAX_THREAD_COUNTS] = { 0 };
+// The least busy servers of all the threads, rebuilt by the aggregator thread (See CLoadBalancer::RunAggregator())
+// Each thread reads it with its own thread index as its reader index.
+CServerSnapshot g_ServerSnapshot;
 
-// Server information including each server's IP, port, and socket descriptor.
-Simple_List<Server_Address_Info*>* g_pServerInfoList[MAX_THREAD_COUNTS] = {0};
 
+// Get the chunk of a thread that holds the servers in the list index
+static inline Server_Chunk* GetServerChunk(int iThreadIndex_, int iListIndex_)
+{
+	return g_stServerShards[iThreadIndex_].pChunks.load(std::memory_order_acquire)[iListIndex_];
+}
+
+// Allocate a chunk aligned on a cache line with every server marked as SERVER_NEVER_CONNECTED and everything else set to 0
+// Every element is atomic, so each of them is initialized with a store instead of memset().
+// Other threads find the chunk only after it is published with release ordering, so the stores need no ordering.
+static Server_Chunk* AllocateServerChunk()
+{
+	void* pMemory = NULL;
+	if (0 != posix_memalign(&pMemory, CACHE_LINE_SIZE, sizeof(Server_Chunk)))
+		return NULL;
+	
+	Server_Chunk* pChunk = new (pMemory) Server_Chunk;
+	for (int i = 0; i < MAX_SERVER_NUMS_PER_ARRAY; ++i)
+	{
+		pChunk->iClientCounts[i].store(SERVER_NEVER_CONNECTED, std::memory_order_relaxed);
+		pChunk->uiSequence[i].store(0, std::memory_order_relaxed);
+		pChunk->uiGeneration[i].store(0, std::memory_order_relaxed);
+		pChunk->uiIP[i].store(0, std::memory_order_relaxed);
+		pChunk->usPort[i].store(0, std::memory_order_relaxed);
+		pChunk->usCapacity[i].store(0, std::memory_order_relaxed);
+		for (int j = 0; j < SM_MAX; ++j)
+			pChunk->uiMetrics[j][i].store(0, std::memory_order_relaxed);
+		
+		pChunk->stAssignmentInfo[i].uiUpdateEpoch.store(0, std::memory_order_relaxed);
+		for (int j = 0; j < MAX_THREAD_COUNTS; ++j)
+			pChunk->stAssignmentInfo[i].ulAssignedCounts[j].store(0, std::memory_order_relaxed);
+		
+		pChunk->ulLatency[i].store(0, std::memory_order_relaxed);
+		pChunk->ulReadyTime[i].store(0, std::memory_order_relaxed);
+	}
+	
+	return pChunk;
+}
+
+// Allocate a key array aligned on a cache line with every key set to SERVER_KEY_NONE
+static std::atomic<unsigned int>* AllocateServerKeyArray(size_t uiCounts_)
+{
+	void* pMemory = NULL;
+	if (0 != posix_memalign(&pMemory, CACHE_LINE_SIZE, uiCounts_ * sizeof(std::atomic<unsigned int>)))
+		return NULL;
+	
+	std::atomic<unsigned int>* pKeys = new (pMemory) std::atomic<unsigned int>[uiCounts_];
+	for (size_t i = 0; i < uiCounts_; ++i)
+		pKeys[i].store(SERVER_KEY_NONE, std::memory_order_relaxed);
+	
+	return pKeys;
+}
+
+// Order member servers by their IDs
+static bool CompareServerID(const std::pair<unsigned long long, Server_Location>& stBackend1_, const std::pair<unsigned long long, Server_Location>& stBackend2_)
+{
+	return stBackend1_.first < stBackend2_.first;
+}
+
+// Point a message of recvmmsg() or sendmmsg() at a buffer and an address
+static void SetUpUDPMessage(struct mmsghdr* pMessage_, struct iovec* pIOVec_, void* pBuffer_, size_t uiLength_, struct sockaddr_in* pSockAddr_, socklen_t uiAddrLen_)
+{
+	pIOVec_->iov_base = pBuffer_;
+	pIOVec_->iov_len = uiLength_;
+	
+	memset(pMessage_, 0, sizeof(*pMessage_));
+	pMessage_->msg_hdr.msg_name = pSockAddr_;
+	pMessage_->msg_hdr.msg_namelen = uiAddrLen_;
+	pMessage_->msg_hdr.msg_iov = pIOVec_;
+	pMessage_->msg_hdr.msg_iovlen = 1;
+}
 
 // Constructor
 // Set up Port Numbers servers and clients connect to
-CLoadBalancer::CLoadBalancer(__uint16_t uiPort1_, __uint16_t uiPort2_, int iThreadIndex_)
+CLoadBalancer::CLoadBalancer(__uint16_t uiPort1_, __uint16_t uiPort2_, int iThreadIndex_, const Load_Balancer_Options* pOptions_)
+	: m_UDPResponseQueue(pOptions_->iUDPOverflowPolicy), m_InCompletePacketPool(sizeof(InComplete_Packet))
 {
 	m_usPortForClients = uiPort1_;
 	m_uiPortForServers = uiPort2_;
@@ -34,10 +107,84 @@ CLoadBalancer::CLoadBalancer(__uint16_t uiPort1_, __uint16_t uiPort2_, int iThre
 	
 	m_uiPacketDataLength[SPT_PORT] = SERVER_PORT_NUM_PACKET_DATA_LENGTH;
 	m_uiPacketDataLength[SPT_STATUS] = SERVER_STATUS_UPDATE_PACKET_DATA_LENGTH;
+	m_uiPacketDataLength[SPT_PORT_CAPACITY] = SERVER_PORT_CAPACITY_PACKET_DATA_LENGTH;
+	m_uiPacketDataLength[SPT_PONG] = SERVER_PONG_PACKET_DATA_LENGTH;
+	m_uiPacketDataLength[SPT_STATUS_METRICS] = SERVER_STATUS_METRICS_PACKET_DATA_LENGTH;
+	
+	m_stOptions = *pOptions_;
+	
+	// Every thread needs a different seed, so the thread index is mixed into the seed
+	// The state of the generator must not be zero
+	m_ulRandomState = ((unsigned long long)time(NULL) ^ ((unsigned long long)(iThreadIndex_ + 1) * 0x9E3779B97F4A7C15ULL)) | 1;
+	
+	memset(m_uiMembershipVersion, 0, sizeof(m_uiMembershipVersion));
+	
+	m_ulNextPingTime = 0;
+	m_iBestServerRefreshInterval = BEST_SERVER_REFRESH_INTERVAL;
+	m_ulNextRebalanceTime = 0;
+	m_ulNextPendingPacketReportTime = 0;
+	m_ulReportedPacketAllocationCounts = 0;
+	m_ulReportedUDPResponseCounts = 0;
+	
+	m_bUDPReadingPaused = false;
+	m_ulUDPReadingPauseCounts = 0;
+	SetUpUDPRecvMessages();
+	
+	for (int i = 0; i < CT_MAX; ++i)
+		m_iReadBudgets[i] = ET_MIN_READ_BUDGET;
+	
+	// Zones are not in the snapshot, and the other policies do not choose the least busy server
+	m_bUseSnapshot = 0 < m_stOptions.iAggregatorInterval && 0 == m_stOptions.iZoneCounts && (SSP_LEAST_CLIENTS == m_stOptions.iSelectionPolicy || SSP_LEAST_LATENCY == m_stOptions.iSelectionPolicy);
+	m_ulSnapshotSequence = 0;
+	
+	m_uiServerKeyCapacity = SERVER_KEY_ARRAY_INITIAL_SIZE;
+	g_stServerShards[m_iThreadIndex].pServerKeys.store(AllocateServerKeyArray(m_uiServerKeyCapacity), std::memory_order_release);
+	
+	m_uiChunkDirectoryCapacity = SERVER_CHUNK_DIRECTORY_INITIAL_SIZE;
+	g_stServerShards[m_iThreadIndex].pChunks.store(new Server_Chunk*[m_uiChunkDirectoryCapacity](), std::memory_order_release);
 	
 	AllocateMemoryForNewServers();
 }
 
+// For the aggregator thread
+// It manages no server and no socket, so it has no shard of its own.
+CLoadBalancer::CLoadBalancer(const Load_Balancer_Options* pOptions_)
+	: m_UDPResponseQueue(pOptions_->iUDPOverflowPolicy), m_InCompletePacketPool(sizeof(InComplete_Packet))
+{
+	m_usPortForClients = 0;
+	m_uiPortForServers = 0;
+	
+	m_iThreadIndex = -1;
+	m_iEPollFD = -1;
+	
+	memset(m_uiPacketDataLength, 0, sizeof(m_uiPacketDataLength));
+	
+	m_stOptions = *pOptions_;
+	
+	m_ulRandomState = ((unsigned long long)time(NULL) * 0x9E3779B97F4A7C15ULL) | 1;
+	
+	memset(m_uiMembershipVersion, 0, sizeof(m_uiMembershipVersion));
+	
+	m_ulNextPingTime = 0;
+	m_iBestServerRefreshInterval = BEST_SERVER_REFRESH_INTERVAL;
+	m_ulNextRebalanceTime = 0;
+	m_ulNextPendingPacketReportTime = 0;
+	m_ulReportedPacketAllocationCounts = 0;
+	m_ulReportedUDPResponseCounts = 0;
+	
+	m_bUDPReadingPaused = false;
+	m_ulUDPReadingPauseCounts = 0;
+	
+	for (int i = 0; i < CT_MAX; ++i)
+		m_iReadBudgets[i] = ET_MIN_READ_BUDGET;
+	
+	m_bUseSnapshot = false;
+	m_ulSnapshotSequence = 0;
+	
+	m_uiServerKeyCapacity = 0;
+	m_uiChunkDirectoryCapacity = 0;
+}
+
 // Destructor
 CLoadBalancer::~CLoadBalancer()
 {
@@ -53,15 +200,27 @@ CLoadBalancer::~CLoadBalancer()
 // Return 0 on Success
 int CLoadBalancer::SetUp()
 {
-	m_iEPollFD = epoll_create1(0);
-	if (-1 == m_iEPollFD)
+	// The kernel has been checked at startup, so a failure here is not expected
+	if (EE_IO_URING == m_stOptions.iEventEngine)
 	{
-		perror("epoll_create1(0)");
-		return -1;
+		if (-1 == m_IOUring.SetUp(IO_URING_QUEUE_DEPTH, IO_URING_RECV_BUFFER_COUNTS, IO_URING_RECV_BUFFER_SIZE))
+		{
+			perror("io_uring set up");
+			return -1;
+		}
+	}
+	else
+	{
+		m_iEPollFD = epoll_create1(0);
+		if (-1 == m_iEPollFD)
+		{
+			perror("epoll_create1(0)");
+			return -1;
+		}
 	}
 	
 	//  TCP listening socket for clients
-	m_iListenSockForClients = SetUpTCPListenSocket(m_usPortForClients);
+	m_iListenSockForClients = SetUpTCPListenSocket(m_usPortForClients, CT_CLIENT_LISTEN);
 	if (-1 == m_iListenSockForClients)
 	{
 		DisplayErrorMessage("SetUpTCPListenSocket() for Clients Failed");
@@ -77,12 +236,53 @@ int CLoadBalancer::SetUp()
 	}
 		
 	//  TCP listening socket for servers
-	m_iListenSockForServers = SetUpTCPListenSocket(m_uiPortForServers);
+	m_iListenSockForServers = SetUpTCPListenSocket(m_uiPortForServers, CT_SERVER_LISTEN);
 	if (-1 == m_iListenSockForServers)
 	{
 		DisplayErrorMessage("SetUpTCPListenSocket() for Servers Failed");
 		return -1;
 	}
+	
+	// The key array is allocated by the constructor, which cannot report the failure
+	if (NULL == g_stServerShards[m_iThreadIndex].pServerKeys.load(std::memory_order_relaxed))
+	{
+		DisplayErrorMessage("AllocateServerKeyArray() Failed");
+		return -1;
+	}
+	
+	// The first chunk is allocated by the constructor as well
+	if (NULL == g_stServerShards[m_iThreadIndex].pChunks.load(std::memory_order_relaxed)[0])
+	{
+		DisplayErrorMessage("AllocateMemoryForNewServers() Failed");
+		return -1;
+	}
+	
+	// Servers handed off by other threads
+	OpenConnection(g_iHandoffEventFDs[m_iThreadIndex], CT_SERVER_HANDOFF);
+	if (-1 == Epoll_CTL_Wrapper(EPOLL_CTL_ADD, g_iHandoffEventFDs[m_iThreadIndex], EPOLLIN))
+	{
+		DisplayErrorMessage("Epoll_CTL_Wrapper() for Server Handoff Failed");
+		return -1;
+	}
+	
+	return 0;
+}
+
+// Create the eventfd of each thread that tells the thread that servers have been handed off to it
+// This must be called before the threads start so that every thread finds the eventfd of every other thread.
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::SetUpServerHandoff()
+{
+	for (int i = 0; i < MAX_THREAD_COUNTS; ++i)
+	{
+		g_iHandoffEventFDs[i] = eventfd(0, EFD_NONBLOCK);
+		if (-1 == g_iHandoffEventFDs[i])
+		{
+			perror("eventfd()");
+			return -1;
+		}
+	}
 		
 	return 0;
 }
@@ -97,7 +297,7 @@ void CLoadBalancer::DisplayErrorMessage(const char* szErrorMessage_)
 // Create a TCP listening socket and set it up to accept incomming connections.
 // Return -1 on Failure
 // Return a non-negative integer on Success
-int CLoadBalancer::SetUpTCPListenSocket(unsigned short usPort_)
+int CLoadBalancer::SetUpTCPListenSocket(unsigned short usPort_, int iConnectionType_)
 {
 	int iSockFD = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 	if (-1 == iSockFD)
@@ -106,7 +306,7 @@ int CLoadBalancer::SetUpTCPListenSocket(unsigned short usPort_)
 		return -1;
 	}
 	
-	if (-1 == SetUpSocket(iSockFD, usPort_, EPOLLIN | EPOLLRDHUP))
+	if (-1 == SetUpSocket(iSockFD, usPort_, EPOLLIN | EPOLLRDHUP, iConnectionType_))
 		return -1;
 	
 	
@@ -132,7 +332,7 @@ int CLoadBalancer::SetUpUDPSocket(unsigned short usPort_)
 		return -1;
 	}
 	
-	if (-1 == SetUpSocket(iSockFD, m_usPortForClients, EPOLLIN))
+	if (-1 == SetUpSocket(iSockFD, m_usPortForClients, EPOLLIN, CT_CLIENT_UDP))
 		return -1;
 	
 	return iSockFD;
@@ -141,7 +341,7 @@ int CLoadBalancer::SetUpUDPSocket(unsigned short usPort_)
 // Set up socket to be ready for communication with clients and servers
 // Return -1 on Failure
 // Return 0 on Success
-int CLoadBalancer::SetUpSocket(int iSockFD_, unsigned short uiPort_, uint32_t uiEpollEvents_)
+int CLoadBalancer::SetUpSocket(int iSockFD_, unsigned short uiPort_, uint32_t uiEpollEvents_, int iConnectionType_)
 {
 	// Set up socket options
 	if (-1 == SetSocketOptions(iSockFD_))
@@ -162,17 +362,10 @@ int CLoadBalancer::SetUpSocket(int iSockFD_, unsigned short uiPort_, uint32_t ui
 	if (-1 == SetNonBlocking(iSockFD_))
 		return -1;
 	
-	struct epoll_event event;
-	memset(&event, 0, sizeof(event));
-	event.events = uiEpollEvents_;
-	event.data.fd = iSockFD_;
-	
 	// Register the socket file descriptor to the epoll file descriptor
-	if (-1 == epoll_ctl(m_iEPollFD, EPOLL_CTL_ADD, iSockFD_, &event))
-	{
-		perror("epoll_ctl() EPOLL_CTL_ADD");
+	OpenConnection(iSockFD_, iConnectionType_);
+	if (-1 == Epoll_CTL_Wrapper(EPOLL_CTL_ADD, iSockFD_, uiEpollEvents_))
 		return -1;
-	}
 	
 	return 0;
 }
@@ -226,14 +419,27 @@ int CLoadBalancer::SetNonBlocking(int iSockFD_)
 }
 
 // Wrapper for epoll_ctl() 
+// The event points to the entry of the descriptor, so the descriptor must have been opened with OpenConnection().
+// With io_uring, the events are kept in the entry, and the requests for them are made when the thread waits next time.
 // Return -1 on Failure
 // Return 0 on Success
 int CLoadBalancer::Epoll_CTL_Wrapper(int iOption_, int iSockFD_, unsigned int uiEvent_)
 {
+	if (EE_IO_URING == m_stOptions.iEventEngine)
+	{
+		Connection* pConnection = m_vecConnections[iSockFD_];
+		if (EPOLL_CTL_DEL == iOption_)
+			return CancelIOUringRequests(pConnection);
+		
+		pConnection->uiWatchedEvents = uiEvent_;
+		return ArmIOUringRequests(pConnection);
+	}
+	
+	// A descriptor added or modified is reported right away if it is already ready, so nothing is missed with edge-triggered epoll
 	struct epoll_event event;
 	memset(&event, 0, sizeof(event));
-	event.events = uiEvent_;
-	event.data.fd = iSockFD_;
+	event.events = (EE_EPOLL_EDGE == m_stOptions.iEventEngine) ? (uiEvent_ | EPOLLET) : uiEvent_;
+	event.data.ptr = m_vecConnections[iSockFD_];
 	
 	if (-1 == epoll_ctl(m_iEPollFD, iOption_, iSockFD_, &event))
 	{
@@ -244,35 +450,195 @@ int CLoadBalancer::Epoll_CTL_Wrapper(int iOption_, int iSockFD_, unsigned int ui
 	return 0;
 }
 
-// Remove a server from the list when the server gets disconnected
-void CLoadBalancer::RemoveServer(int iSockFD_)
+// Stop watching a descriptor before it is closed or handed off
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::StopWatching(Connection* pConnection_)
+{
+	if (EE_IO_URING == m_stOptions.iEventEngine)
+		return CancelIOUringRequests(pConnection_);
+	
+	struct epoll_event event;
+	if (-1 == epoll_ctl(m_iEPollFD, EPOLL_CTL_DEL, pConnection_->iSockFD, &event))
+	{
+		perror("epoll_ctl EPOLL_CTL_DEL");
+		return -1;
+	}
+	
+	return 0;
+}
+
+// Get the user data of an io_uring request on a connection
+unsigned long long CLoadBalancer::GetIOUringUserData(const Connection* pConnection_, int iOperation_)
+{
+	return ((pConnection_->uiGeneration & IO_URING_GENERATION_MASK) << IO_URING_GENERATION_SHIFT) | ((unsigned long long)iOperation_ << IO_URING_OPERATION_SHIFT) | (unsigned int)pConnection_->iSockFD;
+}
+
+// Make the io_uring requests that a connection needs for the events that the thread watches
+// A listening socket accepts with a multishot accept, and a client connection receives with a multishot recv, so they are polled only for the other events.
+// A poll in flight for events that are no longer watched is left as it is, and its completion is ignored.
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::ArmIOUringRequests(Connection* pConnection_)
 {
-	std::unordered_map<int, Server_Data_Access_Info*>::iterator mitor = m_mapServerList.find(iSockFD_);
+	int iSockFD = pConnection_->iSockFD;
+	unsigned int uiPollEvents = pConnection_->uiWatchedEvents;
+	
+	if (CT_CLIENT_LISTEN == pConnection_->iType || CT_SERVER_LISTEN == pConnection_->iType)
+	{
+		uiPollEvents &= ~(EPOLLIN | EPOLLRDHUP);
+		if (0 == (pConnection_->uiArmedRequests & (1U << IUO_ACCEPT)))
+		{
+			if (-1 == m_IOUring.PrepareMultishotAccept(iSockFD, GetIOUringUserData(pConnection_, IUO_ACCEPT)))
+				return -1;
 			
+			pConnection_->uiArmedRequests |= (1U << IUO_ACCEPT);
+		}
+	}
+	else if (CT_CLIENT == pConnection_->iType)
+	{
+		uiPollEvents &= ~(EPOLLIN | EPOLLRDHUP);
+		if (0 == (pConnection_->uiArmedRequests & (1U << IUO_RECV)))
+		{
+			if (-1 == m_IOUring.PrepareMultishotRecv(iSockFD, GetIOUringUserData(pConnection_, IUO_RECV)))
+				return -1;
+			
+			pConnection_->uiArmedRequests |= (1U << IUO_RECV);
+		}
+	}
+	
+	if (0 == uiPollEvents)
+		return 0;
+	
+	if (0 == (pConnection_->uiArmedRequests & (1U << IUO_POLL)))
+	{
+		if (-1 == m_IOUring.PreparePoll(iSockFD, uiPollEvents, GetIOUringUserData(pConnection_, IUO_POLL)))
+			return -1;
+		
+		pConnection_->uiArmedRequests |= (1U << IUO_POLL);
+	}
+	else if (uiPollEvents != pConnection_->uiPolledEvents)
+	{
+		// If the poll has already completed, the update fails, and the poll is made again with the new events once its completion is handled
+		if (-1 == m_IOUring.PreparePollUpdate(GetIOUringUserData(pConnection_, IUO_POLL), uiPollEvents, GetIOUringUserData(pConnection_, IUO_CANCEL)))
+			return -1;
+	}
+	
+	pConnection_->uiPolledEvents = uiPollEvents;
+	
+	return 0;
+}
+
+// Cancel every io_uring request in flight on a connection
+// The requests complete after the descriptor has been closed or handed off, and their completions are ignored.
+// A multishot recv keeps the socket open until it is cancelled, so the peer sees the connection closed only after the next wait.
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::CancelIOUringRequests(Connection* pConnection_)
+{
+	for (int i = 0; i < IUO_CANCEL; ++i)
+	{
+		if (0 == (pConnection_->uiArmedRequests & (1U << i)))
+			continue;
+		
+		if (-1 == m_IOUring.PrepareCancel(GetIOUringUserData(pConnection_, i), GetIOUringUserData(pConnection_, IUO_CANCEL)))
+		{
+			perror("io_uring cancel");
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+// Remove a server from the list when the server gets disconnected
+void CLoadBalancer::RemoveServer(Connection* pConnection_)
+{
 	// This is not a server socket
-	if (m_mapServerList.end() == mitor)
+	if (CT_SERVER != pConnection_->iType)
 		return;
 	
-	Server_Data_Access_Info* pServer = mitor->second;
-	int iListIndex = pServer->iListIndex;
-	int iArrIndex = pServer->iArrayIndex;
-					
-	Simple_List<long int*>* pClientCountsList = g_pClientCountsList[m_iThreadIndex];
+	Server_Data_Access_Info* pServer = &(pConnection_->stServerInfo);
+	if (-1 != pServer->iArrayIndex)
+		UnregisterServer(pServer);
 
-	int i = 0;
-	while (i < iListIndex)
+	return;
+}
+	
+// Get the entry of a file descriptor that this thread is about to watch, and start it over
+// The table grows to the largest descriptor that this thread has watched. Descriptors are shared among all the threads, so the table may have gaps.
+Connection* CLoadBalancer::OpenConnection(int iSockFD_, int iConnectionType_)
+{
+	if ((size_t)iSockFD_ >= m_vecConnections.size())
+		m_vecConnections.resize(iSockFD_ + 1, NULL);
+				
+	Connection* pConnection = m_vecConnections[iSockFD_];
+	if (NULL == pConnection)
 	{
-		pClientCountsList = pClientCountsList->pNext;
-		++i;
+		pConnection = new Connection;
+		pConnection->uiGeneration = 0;
+		pConnection->bPending = false;
+		m_vecConnections[iSockFD_] = pConnection;
 	}
-							
-	if (-1 != iArrIndex)
-		pClientCountsList->Data[iArrIndex] = SERVER_DISCONNECTED;
+	
+	pConnection->iSockFD = iSockFD_;
+	pConnection->iType = iConnectionType_;
+	pConnection->pRecvPacket = NULL;
+	pConnection->pSendPacket = NULL;
+	
+	// Requests made for the descriptor before it was reused complete with the previous generation
+	++pConnection->uiGeneration;
+	pConnection->uiWatchedEvents = 0;
+	pConnection->uiPolledEvents = 0;
+	pConnection->uiArmedRequests = 0;
+	pConnection->pReceivedData = NULL;
+	pConnection->uiReceivedLength = 0;
+	pConnection->bMoreToRead = false;
+	
+	// The server has not sent its port yet
+	memset(&(pConnection->stServerInfo), 0, sizeof(pConnection->stServerInfo));
+	pConnection->stServerInfo.iSocketFD = iSockFD_;
+	pConnection->stServerInfo.iListIndex = -1;
+	pConnection->stServerInfo.iArrayIndex = -1;
+	
+	return pConnection;
+}
+
+// Forget a file descriptor that this thread no longer watches
+// Partial packets of the connection are released. Events of the descriptor already returned by epoll_wait() find the entry CT_NONE.
+void CLoadBalancer::CloseConnection(Connection* pConnection_)
+{
+	if (NULL != pConnection_->pRecvPacket)
+		RemoveTCPRecvQueuePacket(pConnection_);
+	
+	if (NULL != pConnection_->pSendPacket)
+		RemoveTCPSendQueuePacket(pConnection_);
+	
+	pConnection_->iType = CT_NONE;
+}
 
+// Take a server out of the arrays shared among all the threads
+// Other threads find the server disconnected, and its slot is given back.
+void CLoadBalancer::UnregisterServer(Server_Data_Access_Info* pServerInfo_)
+{
+	int iListIndex = pServerInfo_->iListIndex;
+	int iArrIndex = pServerInfo_->iArrayIndex;
 	
-	m_mapServerList.erase(mitor);
-				
-	return;
+	Server_Chunk* pChunk = GetServerChunk(m_iThreadIndex, iListIndex);
+	
+	UpdateRunningTotals(pChunk->iClientCounts[iArrIndex].load(std::memory_order_relaxed), SERVER_DISCONNECTED, pChunk->usCapacity[iArrIndex].load(std::memory_order_relaxed));
+	AddSettledClientCounts(GetInFlightCounts(&(pChunk->stAssignmentInfo[iArrIndex])));
+	pChunk->iClientCounts[iArrIndex].store(SERVER_DISCONNECTED, std::memory_order_release);
+	
+	RemoveServerKey(iListIndex * MAX_SERVER_NUMS_PER_ARRAY + iArrIndex);
+	PublishBestServer();
+	
+	ReleaseServerSlot(iListIndex * MAX_SERVER_NUMS_PER_ARRAY + iArrIndex);
+	
+	std::atomic<long int>& iConnectedServerCounts = g_stServerShards[m_iThreadIndex].iConnectedServerCounts;
+	iConnectedServerCounts.store(iConnectedServerCounts.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+	
+	IncreaseMembershipVersion();
 }
 
 // Send all of th UDP packets in the queue until space is not available or queue is empty
@@ -283,53 +649,68 @@ int CLoadBalancer::SendUDPQueuePacket(int iSockFD_)
 	if (iSockFD_ != m_iUDPSockForClients)
 		return 0;
 	
-	std::list < Queued_UDP_Packet*>::iterator litor = m_listUDPPacketQueue.begin();
-	while (litor != m_listUDPPacketQueue.end())
+	// Responses next to each other in the queue are sent with one sendmmsg() call
+	struct mmsghdr stMessages[MAX_UDP_BATCH_COUNTS];
+	struct iovec stIOVecs[MAX_UDP_BATCH_COUNTS];
+	while (!m_UDPResponseQueue.IsEmpty())
 	{
-		Queued_UDP_Packet* pPacket = (*litor);
-		ssize_t iResult = sendto(iSockFD_, pPacket->pBuffer, RESPONSE_TO_CLIENT_LENGTH, 0, (struct sockaddr*)&(pPacket->stSockAddr), pPacket->uiAddrLen);
-		if (-1 == iResult)
+		const Queued_UDP_Packet* pPackets = m_UDPResponseQueue.GetFront();
+		int iCounts = (int)std::min(m_UDPResponseQueue.GetContiguousCounts(), (size_t)MAX_UDP_BATCH_COUNTS);
+		for (int i = 0; i < iCounts; ++i)
+			SetUpUDPMessage(&stMessages[i], &stIOVecs[i], (void*)pPackets[i].szBuffer, RESPONSE_TO_CLIENT_LENGTH, (struct sockaddr_in*)&(pPackets[i].stSockAddr), pPackets[i].uiAddrLen);
+		
+		int iSentCounts = sendmmsg(iSockFD_, stMessages, iCounts, 0);
+		if (-1 == iSentCounts)
 		{
 			if (EAGAIN == errno || EWOULDBLOCK == errno)
-				return 0;
+				break;
 
-			perror("send()");
-			return -1;
-		}
-		else if (0 == iResult)
-			return 0;
-		else if (RESPONSE_TO_CLIENT_LENGTH == iResult)
-		{
-			delete pPacket->pBuffer;
-			delete pPacket;
-			litor = m_listUDPPacketQueue.erase(litor);
-		}
-		else
-		{
-			// Should not happen when using UDP
-			DisplayErrorMessage("sendto() Unepected Result");
+			perror("sendmmsg()");
 			return -1;
 		}
+		
+		// A datagram is sent entirely or not at all, so the responses sent are removed and the rest wait for space
+		m_UDPResponseQueue.PopFront(iSentCounts);
+		if (iSentCounts < iCounts)
+			break;
+	}
+	
+	if (m_UDPResponseQueue.IsEmpty())
+	{
+		m_bUDPReadingPaused = false;
+		return Epoll_CTL_Wrapper(EPOLL_CTL_MOD, iSockFD_, EPOLLIN);
+	}
+	
+	// Read requests again once the backlog has shrunk enough not to be paused again right away
+	if (m_bUDPReadingPaused && UDP_RESPONSE_QUEUE_RESUME_COUNTS >= m_UDPResponseQueue.GetCounts())
+	{
+		m_bUDPReadingPaused = false;
+		return Epoll_CTL_Wrapper(EPOLL_CTL_MOD, iSockFD_, EPOLLIN | EPOLLOUT);
 	}
 	
-	return Epoll_CTL_Wrapper(EPOLL_CTL_MOD, iSockFD_, EPOLLIN);
+	return 0;
 }
 
 // Handle an EPOLLIN event
 // Return -1 on Failure
 // Return 0 on Success
-int CLoadBalancer::EpollOutEventHanlder(int iSockFD_)
+int CLoadBalancer::EpollOutEventHanlder(Connection* pConnection_)
 {
-	// If there is a pending packet in the send queue, send it here.
-	if (-1 == SendTCPQueuePacket(iSockFD_))
+	if (CT_CLIENT_UDP == pConnection_->iType)
 	{
-		DisplayErrorMessage("SendTCPQueuePacket() Failed");
-		return -1;
+		if( SendUDPQueuePacket(pConnection_->iSockFD))
+		{
+			DisplayErrorMessage("SendUDPQueuePacket() Failed");
+			return -1;
+		}
+		
+		return 0;
 	}
 	
-	if( SendUDPQueuePacket(iSockFD_))
+	// If there is a pending packet in the send queue, send it here.
+	if (-1 == SendTCPQueuePacket(pConnection_))
 	{
-		DisplayErrorMessage("SendUDPQueuePacket() Failed");
+		DisplayErrorMessage("SendTCPQueuePacket() Failed");
 		return -1;
 	}
 	
@@ -338,16 +719,20 @@ int CLoadBalancer::EpollOutEventHanlder(int iSockFD_)
 
 
 // Handle EPOLLIN event
+// A handler reads up to the budget of the type of the descriptor (See GetReadBudget()), and clears bMoreToRead once a read finds nothing left.
 // Return -1 on Failure
 // Return 0 on Success
-int CLoadBalancer::EpollInEventHandler(int iSockFD_)
+int CLoadBalancer::EpollInEventHandler(Connection* pConnection_)
 {
+	int iType = pConnection_->iType;
+	int iBudget = GetReadBudget(iType);
+	
 	// UDP
-	if (iSockFD_ == m_iUDPSockForClients) // UDP 
+	if (CT_CLIENT_UDP == iType) // UDP 
 	{
 		return ClientUDPPacketHandler(m_iUDPSockForClients);
 	}
-	else if (iSockFD_ == m_iListenSockForClients) // Accept an incoming TCP connection from a client
+	else if (CT_CLIENT_LISTEN == iType) // Accept an incoming TCP connection from a client
 	{
 		int iCount = 0;
 		do
@@ -357,48 +742,66 @@ int CLoadBalancer::EpollInEventHandler(int iSockFD_)
 				
 			// Accepting an incoming connection may fail. ( ex) reached the system limit on the total number of open sockets.
 			// The load balancer should keep running
-			int iClientSock = AcceptConnection(m_iListenSockForClients, &stSockAddr, &uiAddrLen);
+			int iClientSock = AcceptConnection(m_iListenSockForClients, CT_CLIENT, &stSockAddr, &uiAddrLen);
 			if (0 > iClientSock )
+			{
+				pConnection_->bMoreToRead = false;
 				return iClientSock;
+			}
 
 			++iCount;
-		} while (iCount < MAX_CLIENT_ACCEPT_LOOPING_COUNT);
+		} while (iCount < iBudget);
 		
 		return 0;
 	}
-	else if (iSockFD_ == m_iListenSockForServers) // Accept an incoming TCP connection from a server
+	else if (CT_SERVER_HANDOFF == iType) // Servers handed off by other threads
+	{
+		// Every server in the queues is taken over at once
+		pConnection_->bMoreToRead = false;
+		return TakeOverServers();
+	}
+	else if (CT_SERVER_LISTEN == iType) // Accept an incoming TCP connection from a server
 	{
 		int iCount = 0;
 		do
 		{
 			struct sockaddr_in stSockAddr;
 			socklen_t uiAddrLen = sizeof(stSockAddr);
-			int iServerSock = AcceptConnection(m_iListenSockForServers, &stSockAddr, &uiAddrLen);
+			int iServerSock = AcceptConnection(m_iListenSockForServers, CT_SERVER, &stSockAddr, &uiAddrLen);
 			if (0 > iServerSock)
+			{
+				pConnection_->bMoreToRead = false;
 				return iServerSock;
+			}
 			
-			struct Server_Data_Access_Info* pServerSocketInfo = new Server_Data_Access_Info;
-			pServerSocketInfo->iSocketFD = iServerSock;
-			pServerSocketInfo->iArrayIndex = -1;
-			pServerSocketInfo->iListIndex  = -1;
-			pServerSocketInfo->uiIP = stSockAddr.sin_addr.s_addr;
-			m_mapServerList.insert(std::make_pair(iServerSock, pServerSocketInfo));
+			// The server gets a slot when it sends its port
+			m_vecConnections[iServerSock]->stServerInfo.uiIP = stSockAddr.sin_addr.s_addr;
 			++iCount;
 			
-		} while (iCount < MAX_SERVER_ACCEPT_LOOPING_COUNT);
+		} while (iCount < iBudget);
 		
 		return 0;
 	}
-	else
+	else if (CT_SERVER == iType) // This is a server socket
 	{
-		std::unordered_map<int, Server_Data_Access_Info*>::iterator mitor = m_mapServerList.find(iSockFD_);
-
-		// This is a client socket
-		if (m_mapServerList.end() == mitor)
-			return ClientTCPPacketHandler(iSockFD_);
-		else // This is a server socket
-			return ServerPacketHandler(mitor->second);
-					
+		// Until the socket has nothing left, unless the server gets disconnected
+		for (int i = 0; i < iBudget && pConnection_->bMoreToRead && CT_SERVER == pConnection_->iType; ++i)
+		{
+			if (-1 == ServerPacketHandler(pConnection_))
+				return -1;
+		}
+		
+		return 0;
+	}
+	else // This is a client socket
+	{
+		for (int i = 0; i < iBudget && pConnection_->bMoreToRead && CT_CLIENT == pConnection_->iType; ++i)
+		{
+			if (-1 == ClientTCPPacketHandler(pConnection_))
+				return -1;
+		}
+		
+		return 0;
 	}
 	
 	return 0;
@@ -410,73 +813,395 @@ int CLoadBalancer::EpollInEventHandler(int iSockFD_)
 // If an error occurs in Run(), the load balancer will terminate by calling exit(EXIT_FAILURE).
 void CLoadBalancer::Run()
 {
+	if (EE_IO_URING == m_stOptions.iEventEngine)
+	{
+		RunIOUring();
+		return;
+	}
+	
 	// Epoll Events
 	struct epoll_event stEPollEvents[MAX_EVENT_COUNTS];
 	memset(stEPollEvents, 0, sizeof(stEPollEvents));
 	
+	int iTimeout = -1;
 	do
 	{
+		// Descriptors that still have data are read again right away, so the thread only checks for new events then
+		if (!m_vecPendingConnections.empty())
+			iTimeout = 0;
+		
+		// The budgets shrink once the thread has been idle (Edge-triggered epoll only)
+		bool bMeasureWait = (EE_EPOLL_EDGE == m_stOptions.iEventEngine && 0 != iTimeout);
+		unsigned long long ulWaitStartTime = bMeasureWait ? GetCurrentTime() : 0;
+		
 		// Wait until an event occurs
-		int iEventCounts = epoll_wait(m_iEPollFD, stEPollEvents, MAX_EVENT_COUNTS, -1);
+		int iEventCounts = epoll_wait(m_iEPollFD, stEPollEvents, MAX_EVENT_COUNTS, iTimeout);
 		if (-1 == iEventCounts)
 		{
 			perror("epoll_wait");
 			exit(EXIT_FAILURE);
 		}
 		
+		if (bMeasureWait && GetCurrentTime() - ulWaitStartTime >= ET_IDLE_WAIT_TIME)
+			DecayReadBudgets();
+		
+		// Requests must not be answered from tables built before servers joined or left
+		RefreshMembership();
+		
 		for (int i = 0; i < iEventCounts; ++i)
 		{
-			// Error Checking
-			if ((EPOLLERR & stEPollEvents[i].events) || 
-				(EPOLLHUP & stEPollEvents[i].events) || 
-				(EPOLLRDHUP & stEPollEvents[i].events))
-			{
-				// Either a client or server got disconnected
-				if (-1 == DisconnectHandler(stEPollEvents[i].data.fd))
-				{
-					DisplayErrorMessage("DisconnectHandler() Failed");
-					exit(EXIT_FAILURE);
-				}
-
-			}
-			else if (EPOLLOUT & stEPollEvents[i].events)
-			{
-				if (-1 == EpollOutEventHanlder(stEPollEvents[i].data.fd))
-				{
-					DisplayErrorMessage("EpollOutEventHanlder() Failed");
-					exit(EXIT_FAILURE);
-				}
-			}
-			else // EPOLLIN & stEPollEvents[i].events
-			{
-				if (-1 == EpollInEventHandler(stEPollEvents[i].data.fd))
-				{
-					DisplayErrorMessage("EpollOutEventHanlder() Failed");
-					exit(EXIT_FAILURE);
-				}
-			}
+			Connection* pConnection = (Connection*)stEPollEvents[i].data.ptr;
+			
+			// The descriptor has been closed or handed off while handling an earlier event
+			if (CT_NONE == pConnection->iType)
+				continue;
+			
+			if (-1 == DispatchEvent(pConnection, stEPollEvents[i].events))
+				exit(EXIT_FAILURE);
 		}
+		
+		// Only after every descriptor reported above has been handled, so servers are not kept waiting behind a busy descriptor
+		if (-1 == ReadPendingConnections())
+			exit(EXIT_FAILURE);
+		
+		iTimeout = GetWaitTimeout();
 	} while (1);
 	
 	return;
 }
 
-// Handle a disconnected client or server
-// Return -1 on Failure
-// Return 0 on Success
-int CLoadBalancer::DisconnectHandler(int iSockFD_)
+// Main Loop with io_uring
+// The requests made while handling completions are submitted together when the thread waits, so a wait is a single system call however many sockets are involved.
+// Never return unless an error occurs.
+void CLoadBalancer::RunIOUring()
 {
-	RemoveServer(iSockFD_);
-	
-	// Deregister the Socket from the EPoll descriptor
-	struct epoll_event event;
-	if (-1 == epoll_ctl(m_iEPollFD, EPOLL_CTL_DEL, iSockFD_, &event))
+	int iTimeout = -1;
+	do
 	{
-		perror("epoll_ctl EPOLL_CTL_DEL");
-		return -1;
-	}
+		// Submit the new requests and wait until a completion arrives
+		if (-1 == m_IOUring.SubmitAndWait(iTimeout))
+		{
+			perror("io_uring_enter");
+			exit(EXIT_FAILURE);
+		}
+		
+		// Requests must not be answered from tables built before servers joined or left
+		RefreshMembership();
+		
+		// The completion is copied first, so its slot can be given back before it is handled
+		const struct io_uring_cqe* pCompletion = NULL;
+		while (NULL != (pCompletion = m_IOUring.PeekCompletion()))
+		{
+			unsigned long long ulUserData = pCompletion->user_data;
+			int iResult = pCompletion->res;
+			unsigned int uiFlags = pCompletion->flags;
+			m_IOUring.SeenCompletion();
+			
+			if (-1 == HandleIOUringCompletion(ulUserData, iResult, uiFlags))
+				exit(EXIT_FAILURE);
+		}
+		
+		iTimeout = GetWaitTimeout();
+	} while (1);
+}
+
+// Handle the events of a descriptor (epoll events, or the events of an io_uring poll)
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::DispatchEvent(Connection* pConnection_, unsigned int uiEvents_)
+{
+	// Error Checking
+	if ((EPOLLERR & uiEvents_) || (EPOLLHUP & uiEvents_) || (EPOLLRDHUP & uiEvents_))
+	{
+		// Either a client or server got disconnected
+		if (-1 == DisconnectHandler(pConnection_))
+		{
+			DisplayErrorMessage("DisconnectHandler() Failed");
+			return -1;
+		}
+	}
+	else if (EPOLLOUT & uiEvents_)
+	{
+		if (-1 == EpollOutEventHanlder(pConnection_))
+		{
+			DisplayErrorMessage("EpollOutEventHanlder() Failed");
+			return -1;
+		}
+		
+		// Edge-triggered epoll does not report the descriptor as readable again, so data that has arrived along with the space is read now
+		if (EE_EPOLL_EDGE == m_stOptions.iEventEngine && (EPOLLIN & uiEvents_) && CT_NONE != pConnection_->iType)
+			return DispatchEvent(pConnection_, EPOLLIN);
+	}
+	else // EPOLLIN & uiEvents_
+	{
+		pConnection_->bMoreToRead = true;
+		if (-1 == EpollInEventHandler(pConnection_))
+		{
+			DisplayErrorMessage("EpollInEventHandler() Failed");
+			return -1;
+		}
+		
+		if (EE_EPOLL_EDGE == m_stOptions.iEventEngine)
+			KeepReading(pConnection_);
+	}
+	
+	return 0;
+}
+
+// Do the periodic work of the thread, and get how long the thread may wait for an event (milliseconds, -1 waits until an event occurs)
+int CLoadBalancer::GetWaitTimeout()
+{
+	// Keep checking while clients are being assigned to the best server of this thread
+	// The best server keeps its assigned clients until its next status update, so the checks slow down while no more clients arrive.
+	// Otherwise, wait until an event occurs or until it is time to send Ping packets
+	int iTimeout = -1;
+	bool bAssigned = false;
+	if (0 < RefreshBestServer(&bAssigned))
+		m_iBestServerRefreshInterval = BEST_SERVER_REFRESH_INTERVAL;
+	else if (bAssigned)
+		m_iBestServerRefreshInterval = std::min(m_iBestServerRefreshInterval * 2, MAX_BEST_SERVER_REFRESH_INTERVAL);
+	
+	if (bAssigned)
+		iTimeout = m_iBestServerRefreshInterval;
+	else
+		m_iBestServerRefreshInterval = BEST_SERVER_REFRESH_INTERVAL;
+	
+	int iPingTimeout = PingServers();
+	if (-1 == iTimeout || (-1 != iPingTimeout && iPingTimeout < iTimeout))
+		iTimeout = iPingTimeout;
+	
+	int iRebalanceTimeout = RebalanceServers();
+	if (-1 == iTimeout || (-1 != iRebalanceTimeout && iRebalanceTimeout < iTimeout))
+		iTimeout = iRebalanceTimeout;
+	
+	int iReportTimeout = ReportPendingPackets();
+	if (-1 == iTimeout || (-1 != iReportTimeout && iReportTimeout < iTimeout))
+		iTimeout = iReportTimeout;
+	
+	return iTimeout;
+}
+
+// Get how many times a handler may read from a descriptor of a type on an event (UDP requests, accepted connections, packets from a client, or reads from a server)
+int CLoadBalancer::GetReadBudget(int iConnectionType_)
+{
+	if (EE_EPOLL_EDGE == m_stOptions.iEventEngine)
+		return m_iReadBudgets[iConnectionType_];
+	
+	// Level-triggered epoll reports the descriptor again if it still has data
+	if (CT_CLIENT_UDP == iConnectionType_)
+		return MAX_UDP_PACKET_LOOPING_COUNT;
+	else if (CT_CLIENT_LISTEN == iConnectionType_)
+		return MAX_CLIENT_ACCEPT_LOOPING_COUNT;
+	else if (CT_SERVER_LISTEN == iConnectionType_)
+		return MAX_SERVER_ACCEPT_LOOPING_COUNT;
+	
+	return 1;
+}
+
+// With edge-triggered epoll, grow the budget of a descriptor that still has data after an event, and read it again after the next epoll_wait()
+// The descriptor is closed, handed off, or paused (UDP with UOP_PAUSE_READING) in the meantime if it has no type or nothing more to read.
+void CLoadBalancer::KeepReading(Connection* pConnection_)
+{
+	int iType = pConnection_->iType;
+	if (CT_NONE == iType || !pConnection_->bMoreToRead || (CT_CLIENT_UDP == iType && m_bUDPReadingPaused))
+		return;
+	
+	m_iReadBudgets[iType] = std::min(m_iReadBudgets[iType] * 2, ET_MAX_READ_BUDGET);
+	
+	if (!pConnection_->bPending)
+	{
+		pConnection_->bPending = true;
+		m_vecPendingConnections.push_back(pConnection_);
+	}
+}
+
+// Read again from the descriptors that still had data once their budget had run out
+// Only the descriptors in the list at the start are read. Those that still have data afterwards are added at the end, and wait for the next round.
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::ReadPendingConnections()
+{
+	size_t uiCounts = m_vecPendingConnections.size();
+	for (size_t i = 0; i < uiCounts; ++i)
+	{
+		Connection* pConnection = m_vecPendingConnections[i];
+		pConnection->bPending = false;
+		
+		// The descriptor has been closed or handed off since
+		if (CT_NONE == pConnection->iType)
+			continue;
+		
+		if (-1 == DispatchEvent(pConnection, EPOLLIN))
+			return -1;
+	}
+	
+	m_vecPendingConnections.erase(m_vecPendingConnections.begin(), m_vecPendingConnections.begin() + uiCounts);
+	
+	return 0;
+}
+
+// Halve every read budget once the thread has been idle
+void CLoadBalancer::DecayReadBudgets()
+{
+	for (int i = 0; i < CT_MAX; ++i)
+		m_iReadBudgets[i] = std::max(m_iReadBudgets[i] / 2, ET_MIN_READ_BUDGET);
+}
+
+// Handle an io_uring completion
+// A completion of a request made for a connection that has been closed, handed off, or replaced by a new connection on the same descriptor is ignored.
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::HandleIOUringCompletion(unsigned long long ulUserData_, int iResult_, unsigned int uiFlags_)
+{
+	int iOperation = (int)((ulUserData_ >> IO_URING_OPERATION_SHIFT) & 0xFF);
+	if (IUO_CANCEL == iOperation)
+		return 0;
+	
+	Connection* pConnection = m_vecConnections[(int)(ulUserData_ & 0xFFFFFFFFULL)];
+	bool bCurrent = (ulUserData_ == GetIOUringUserData(pConnection, iOperation));
+	
+	// The request is no longer in flight unless it completes again
+	if (bCurrent && 0 == (IORING_CQE_F_MORE & uiFlags_))
+		pConnection->uiArmedRequests &= ~(1U << iOperation);
+	
+	if (!bCurrent || CT_NONE == pConnection->iType)
+	{
+		if ((IORING_CQE_F_BUFFER & uiFlags_) && -1 == m_IOUring.RecycleBuffer((unsigned short)(uiFlags_ >> IORING_CQE_BUFFER_SHIFT)))
+		{
+			perror("io_uring provide buffers");
+			return -1;
+		}
+		
+		// Nobody watches a socket accepted in the meantime
+		if (IUO_ACCEPT == iOperation && 0 <= iResult_)
+			close(iResult_);
+		
+		return 0;
+	}
+	
+	if (IUO_POLL == iOperation)
+	{
+		if (0 > iResult_)
+		{
+			errno = -iResult_;
+			perror("io_uring poll");
+			return -1;
+		}
+		
+		// Events that are no longer watched are ignored (Errors are always reported)
+		unsigned int uiEvents = (unsigned int)iResult_ & (pConnection->uiWatchedEvents | EPOLLERR | EPOLLHUP);
+		if (0 != uiEvents && -1 == DispatchEvent(pConnection, uiEvents))
+			return -1;
+	}
+	else if (IUO_ACCEPT == iOperation)
+	{
+		// Same as accept() on an EPOLLIN event
+		if (0 > iResult_)
+		{
+			if (-EAGAIN == iResult_ || -EWOULDBLOCK == iResult_)
+				return ArmIOUringRequests(pConnection);
+			
+			errno = -iResult_;
+			perror("accept()");
+			return -1;
+		}
+		
+		if (-1 == AcceptIOUringConnection(pConnection, iResult_))
+			return -1;
+	}
+	else if (IUO_RECV == iOperation)
+	{
+		if (-1 == HandleIOUringRecv(pConnection, iResult_, uiFlags_))
+			return -1;
+	}
+	
+	// The handlers may have closed the connection
+	if (ulUserData_ != GetIOUringUserData(pConnection, iOperation) || CT_NONE == pConnection->iType)
+		return 0;
+	
+	return ArmIOUringRequests(pConnection);
+}
+
+// Watch a socket accepted by a multishot accept (Non-blocking already)
+// The address of the peer does not come with the socket, so the address of a server is looked up.
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::AcceptIOUringConnection(Connection* pListenConnection_, int iSockFD_)
+{
+	int iConnectionType = (CT_CLIENT_LISTEN == pListenConnection_->iType) ? CT_CLIENT : CT_SERVER;
+	Connection* pConnection = OpenConnection(iSockFD_, iConnectionType);
+	
+	// The server gets a slot when it sends its port
+	if (CT_SERVER == iConnectionType)
+	{
+		struct sockaddr_in stSockAddr;
+		socklen_t uiAddrLen = sizeof(stSockAddr);
+		if (0 == getpeername(iSockFD_, (struct sockaddr *)&stSockAddr, &uiAddrLen))
+			pConnection->stServerInfo.uiIP = stSockAddr.sin_addr.s_addr;
+	}
+	
+	return Epoll_CTL_Wrapper(EPOLL_CTL_ADD, iSockFD_, EPOLLIN | EPOLLRDHUP);
+}
+
+// Hand the data received by a multishot recv to the client handlers
+// The handlers read the data with RecvFromConnection() until all of it has been consumed, and the buffer is given back right after.
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::HandleIOUringRecv(Connection* pConnection_, int iResult_, unsigned int uiFlags_)
+{
+	int iResult = 0;
+	if (0 < iResult_)
+	{
+		pConnection_->pReceivedData = m_IOUring.GetBuffer((unsigned short)(uiFlags_ >> IORING_CQE_BUFFER_SHIFT));
+		pConnection_->uiReceivedLength = iResult_;
+		while (0 < pConnection_->uiReceivedLength && CT_CLIENT == pConnection_->iType && -1 != iResult)
+			iResult = ClientTCPPacketHandler(pConnection_);
+		
+		pConnection_->pReceivedData = NULL;
+		pConnection_->uiReceivedLength = 0;
+	}
 	
-	close(iSockFD_);
+	if ((IORING_CQE_F_BUFFER & uiFlags_) && -1 == m_IOUring.RecycleBuffer((unsigned short)(uiFlags_ >> IORING_CQE_BUFFER_SHIFT)))
+	{
+		perror("io_uring provide buffers");
+		return -1;
+	}
+	
+	if (-1 == iResult)
+	{
+		DisplayErrorMessage("ClientTCPPacketHandler() Failed");
+		return -1;
+	}
+	
+	// No buffer was left, and the recv is made again along with the buffers given back
+	if (-ENOBUFS == iResult_)
+		return 0;
+	
+	// The client has closed the connection (0), or the connection has failed
+	if (0 >= iResult_ && CT_CLIENT == pConnection_->iType && -1 == DisconnectHandler(pConnection_))
+	{
+		DisplayErrorMessage("DisconnectHandler() Failed");
+		return -1;
+	}
+	
+	return 0;
+}
+
+// Handle a disconnected client or server
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::DisconnectHandler(Connection* pConnection_)
+{
+	int iSockFD = pConnection_->iSockFD;
+	
+	RemoveServer(pConnection_);
+	CloseConnection(pConnection_);
+	
+	// Deregister the Socket from the EPoll descriptor
+	if (-1 == StopWatching(pConnection_))
+		return -1;
+	
+	close(iSockFD);
 	
 	return 0;
 }
@@ -485,7 +1210,7 @@ int CLoadBalancer::DisconnectHandler(int iSockFD_)
 // Return -1 on failure (-1 causes the load balancer to terminate)
 // Return a non-negative integer on Success
 // Return -2 on Possible Failure ( the load balancer does not terminate)
-int CLoadBalancer::AcceptConnection(int iListenSockFD_, sockaddr_in* pSockAddr_, socklen_t* pAddrLen_)
+int CLoadBalancer::AcceptConnection(int iListenSockFD_, int iConnectionType_, sockaddr_in* pSockAddr_, socklen_t* pAddrLen_)
 {
 	int iSockFD = accept(iListenSockFD_, (struct sockaddr *)pSockAddr_, pAddrLen_);
 	if (-1 == iSockFD)
@@ -501,17 +1226,9 @@ int CLoadBalancer::AcceptConnection(int iListenSockFD_, sockaddr_in* pSockAddr_,
 	if (-1 == SetNonBlocking(iSockFD))
 		return -1;
 	
-	
-	struct epoll_event event;
-	memset(&event, 0, sizeof(event));
-	event.events = EPOLLIN | EPOLLRDHUP;
-	event.data.fd = iSockFD;
-	
-	if (-1 == epoll_ctl(m_iEPollFD, EPOLL_CTL_ADD, iSockFD, &event))
-	{
-		perror("epoll_ctl() EPOLL_CTL_ADD");
+	OpenConnection(iSockFD, iConnectionType_);
+	if (-1 == Epoll_CTL_Wrapper(EPOLL_CTL_ADD, iSockFD, EPOLLIN | EPOLLRDHUP))
 		return -1;
-	}
 	
 	return iSockFD;
 }
@@ -519,15 +1236,15 @@ int CLoadBalancer::AcceptConnection(int iListenSockFD_, sockaddr_in* pSockAddr_,
 // Send a TCP packet in the queue,  which contains TCP packets that were sent out partially
 // Return -1 on Failure
 // Return 0 on Success
-int CLoadBalancer::SendTCPQueuePacket(int iSockFD_)
+int CLoadBalancer::SendTCPQueuePacket(Connection* pConnection_)
 {
-	std::unordered_map<int, InComplete_Packet*>::iterator mitor = m_mapTCPPacketSendQueue.find(iSockFD_);
-	if (m_mapTCPPacketSendQueue.end() == mitor)
-		return Epoll_CTL_Wrapper(EPOLL_CTL_MOD, iSockFD_, EPOLLIN | EPOLLRDHUP);
+	int iSockFD = pConnection_->iSockFD;
+	InComplete_Packet* pPacket = pConnection_->pSendPacket;
+	if (NULL == pPacket)
+		return Epoll_CTL_Wrapper(EPOLL_CTL_MOD, iSockFD, EPOLLIN | EPOLLRDHUP);
 
-	InComplete_Packet* pPacket = mitor->second;
 	size_t uiRemainBytes = pPacket->uiBufferLen - pPacket->uiOffset;
-	ssize_t iResult = send(iSockFD_, pPacket->pBuffer + pPacket->uiOffset, uiRemainBytes, 0);
+	ssize_t iResult = send(iSockFD, pPacket->szBuffer + pPacket->uiOffset, uiRemainBytes, 0);
 	if (-1 == iResult)
 	{
 		if (EAGAIN == errno || EWOULDBLOCK == errno)
@@ -543,8 +1260,8 @@ int CLoadBalancer::SendTCPQueuePacket(int iSockFD_)
 	}
 	else
 	{
-		RemoveTCPSendQueuePacket(iSockFD_, pPacket);
-		return Epoll_CTL_Wrapper(EPOLL_CTL_MOD, iSockFD_, EPOLLIN | EPOLLRDHUP);
+		RemoveTCPSendQueuePacket(pConnection_);
+		return Epoll_CTL_Wrapper(EPOLL_CTL_MOD, iSockFD, EPOLLIN | EPOLLRDHUP);
 	}
 
 	return 0;
@@ -553,12 +1270,21 @@ int CLoadBalancer::SendTCPQueuePacket(int iSockFD_)
 // Send the IP and Port of the least busy server to the client
 // Return -1 on Failure
 // Return 0 on Success
-int CLoadBalancer::SendResponseToClient(int iSockFD_, unsigned char* szRecvBuff_)
+int CLoadBalancer::SendResponseToClient(Connection* pConnection_, unsigned char* szRecvBuff_, size_t uiRecvLength_)
 {
+	int iSockFD = pConnection_->iSockFD;
+	
+	// The address of the client is only needed to find its zone or to hash it
+	struct sockaddr_in stSockAddr;
+	socklen_t uiAddrLen = sizeof(stSockAddr);
+	const struct sockaddr_in* pClientAddr = NULL;
+	if ((0 != m_stOptions.iZoneCounts || SSP_BOUNDED_LOAD_HASHING == m_stOptions.iSelectionPolicy) && 0 == getpeername(iSockFD, (struct sockaddr *)&stSockAddr, &uiAddrLen))
+		pClientAddr = &stSockAddr;
+	
 	unsigned char szSendBuff[RESPONSE_TO_CLIENT_LENGTH];
-	BuildResponse(szRecvBuff_, szSendBuff);
+	BuildResponse(szRecvBuff_, uiRecvLength_, szSendBuff, NULL, pClientAddr);
 
-	ssize_t iResult = send(iSockFD_, szSendBuff, RESPONSE_TO_CLIENT_LENGTH, 0);
+	ssize_t iResult = send(iSockFD, szSendBuff, RESPONSE_TO_CLIENT_LENGTH, 0);
 	if (-1 == iResult)
 	{
 		if (EAGAIN == errno || EWOULDBLOCK == errno)
@@ -573,52 +1299,91 @@ int CLoadBalancer::SendResponseToClient(int iSockFD_, unsigned char* szRecvBuff_
 	
 	if (iResult < RESPONSE_TO_CLIENT_LENGTH)
 	{
-		AddTCPPacketToSendQueue(iSockFD_, szSendBuff + iResult, RESPONSE_TO_CLIENT_LENGTH - iResult);
-		return Epoll_CTL_Wrapper(EPOLL_CTL_MOD, iSockFD_, EPOLLIN | EPOLLRDHUP | EPOLLOUT);		
+		if (-1 == AddTCPPacketToSendQueue(pConnection_, szSendBuff + iResult, RESPONSE_TO_CLIENT_LENGTH - iResult))
+			return -1;
+		
+		return Epoll_CTL_Wrapper(EPOLL_CTL_MOD, iSockFD, EPOLLIN | EPOLLRDHUP | EPOLLOUT);		
 	}
 	
 	return 0;
 }
 
 // Add a partial TCP packet to the send queue in order to send the rest of the packet when space is availabe
-void CLoadBalancer::AddTCPPacketToSendQueue(int iSocket_, unsigned char* pSendBuff_, size_t uiBuffLength_)
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::AddTCPPacketToSendQueue(Connection* pConnection_, unsigned char* pSendBuff_, size_t uiBuffLength_)
 {
-	InComplete_Packet* pPacket = new InComplete_Packet;
+	InComplete_Packet* pPacket = (InComplete_Packet*)m_InCompletePacketPool.Allocate();
+	if (NULL == pPacket)
+	{
+		DisplayErrorMessage("Packet Pool Allocation Failed");
+		return -1;
+	}
+	
 	pPacket->uiOffset = 0;
 	pPacket->uiBufferLen = uiBuffLength_;
-	pPacket->pBuffer = new unsigned char[uiBuffLength_];
-	memcpy((void*)pPacket->pBuffer, (void*)pSendBuff_, uiBuffLength_);
-	m_mapTCPPacketSendQueue.insert(std::make_pair(iSocket_, pPacket));
+	memcpy((void*)pPacket->szBuffer, (void*)pSendBuff_, uiBuffLength_);
+	pConnection_->pSendPacket = pPacket;
+	
+	return 0;
 }
 
-// Erase a TCP packet from the send queue and release memory
-void CLoadBalancer::RemoveTCPSendQueuePacket(int iSockFD_, InComplete_Packet* pPacket_)
+// Erase a TCP packet from the send queue and give it back to the packet pool
+void CLoadBalancer::RemoveTCPSendQueuePacket(Connection* pConnection_)
 {
-	delete pPacket_->pBuffer;
-	delete pPacket_;
-	m_mapTCPPacketSendQueue.erase(iSockFD_);
+	m_InCompletePacketPool.Release(pConnection_->pSendPacket);
+	pConnection_->pSendPacket = NULL;
 }
 
 // Build a response that will be sent to the Client
-void CLoadBalancer::BuildResponse(unsigned char* szRecvBuff_, unsigned char* szSendBuff__)
+// If pAssignedServer_ is not NULL, a plain request gets that server
+void CLoadBalancer::BuildResponse(unsigned char* szRecvBuff_, size_t uiRecvLength_, unsigned char* szSendBuff__, const Server_Location* pAssignedServer_, const struct sockaddr_in* pClientAddr_)
 {			
 	unsigned short usPacketType = *((unsigned short*)szRecvBuff_);
 	unsigned short* pSendPacket = (unsigned short*)szSendBuff__;
 	*pSendPacket = usPacketType;
 	
 	//Checking Received Data from a client
-	if (SERVER_ADDR_REQUEST_TYPE != usPacketType)
+	if ((SERVER_ADDR_REQUEST_TYPE != usPacketType && SERVER_ADDR_KEYED_REQUEST_TYPE != usPacketType) || uiRecvLength_ < GetRequestLength(szRecvBuff_))
 	{
 		// Received a worng format of packet from a client.
 		*(pSendPacket + 1) = SERVER_ADDR_RESPONSE_UNKNOWN_TYPE;
 		return;
 	}
 	
-	// Choose the least busy server
 	int iThreadIndex = -1;
 	int iListIndex = -1;
 	int iArrIndex = -1;
-	GetBestServer(&iThreadIndex, &iListIndex, &iArrIndex);
+	unsigned int uiGeneration = 0;
+	
+	if (SERVER_ADDR_KEYED_REQUEST_TYPE == usPacketType)
+	{
+		// Choose the server that owns the key
+		unsigned long long ulKey = 0;
+		memcpy(&ulKey, szRecvBuff_ + PACKET_TYPE_LENGTH, sizeof(ulKey));
+		GetKeyedServer(ulKey, &iThreadIndex, &iListIndex, &iArrIndex, &uiGeneration);
+	}
+	else if (NULL != pAssignedServer_ && IsServerAlive(pAssignedServer_))
+	{
+		// The server has been chosen together with the other requests in the same batch
+		// If it has left or its slot has been taken by a new server since then, a server is chosen below as for a single request.
+		iThreadIndex = pAssignedServer_->iThreadIndex;
+		iListIndex = pAssignedServer_->iSlotIndex / MAX_SERVER_NUMS_PER_ARRAY;
+		iArrIndex = pAssignedServer_->iSlotIndex % MAX_SERVER_NUMS_PER_ARRAY;
+		uiGeneration = pAssignedServer_->uiGeneration;
+	}
+	else if (0 == GetSnapshotServer((unsigned char*)(pSendPacket + 2), &iThreadIndex, &iListIndex, &iArrIndex))
+	{
+		// The snapshot holds the address of the server as well, so the buffer has already been filled
+		*(pSendPacket + 1) = SERVER_ADDR_RESPONSE_SUCCESS;
+		RecordAssignment(iThreadIndex, iListIndex, iArrIndex);
+		return;
+	}
+	else
+	{
+		// Choose the least busy server
+		GetBestServer(pClientAddr_, &iThreadIndex, &iListIndex, &iArrIndex, &uiGeneration);
+	}
 	
 	if (-1 == iThreadIndex)
 	{
@@ -628,119 +1393,1026 @@ void CLoadBalancer::BuildResponse(unsigned char* szRecvBuff_, unsigned char* szS
 	}
 		
 	
-	*(pSendPacket + 1) = SERVER_ADDR_RESPONSE_SUCCESS;
 	// Filling the send buffer with the IP and Port of the least busy server
-	GetServerAddr((unsigned char*)(pSendPacket + 2), iThreadIndex, iListIndex, iArrIndex);
+	if (-1 == GetServerAddr((unsigned char*)(pSendPacket + 2), iThreadIndex, iListIndex, iArrIndex, uiGeneration))
+	{
+		// The server stopped running or its slot was taken by a new server after it was chosen, so choose again once
+		GetBestServer(pClientAddr_, &iThreadIndex, &iListIndex, &iArrIndex, &uiGeneration);
+		if (-1 == iThreadIndex || -1 == GetServerAddr((unsigned char*)(pSendPacket + 2), iThreadIndex, iListIndex, iArrIndex, uiGeneration))
+		{
+			*(pSendPacket + 1) = SERVER_ADDR_RESPONSE_NO_SERVER;
+			return;
+		}
+	}
+	
+	*(pSendPacket + 1) = SERVER_ADDR_RESPONSE_SUCCESS;
+	
+	// The client is counted as a client of the server until the server reports its new status
+	RecordAssignment(iThreadIndex, iListIndex, iArrIndex);
 	
 	return;
 }
 
-// Get IP and Port of the Server corresponding to the indices
-void CLoadBalancer::GetServerAddr(unsigned char* pBuff_, int iThreadIndex_, int iListIndex_, int iArrIndex_)
+// Get the zone that an address belongs to (Network byte order)
+// Return ZONE_NONE if the address does not belong to any zone or zones are not used
+int CLoadBalancer::GetZoneIndex(in_addr_t uiIP_)
 {
-	Simple_List<Server_Address_Info*>* pServerInfoList = g_pServerInfoList[iThreadIndex_];
-	int i = 0;
-	while (i < iListIndex_)
+	for (int i = 0; i < m_stOptions.iZoneCounts; ++i)
 	{
-		if (NULL == pServerInfoList)
-			return;
-		
-		pServerInfoList = pServerInfoList->pNext;
-		++i;
+		if ((uiIP_ & m_stOptions.stZones[i].uiMask) == m_stOptions.stZones[i].uiNetwork)
+			return i;
 	}
-		
-	unsigned short* pPort = (unsigned short*)pBuff_;
-	*pPort = pServerInfoList->Data[iArrIndex_].usPort;
 	
-	in_addr_t* pIP = (in_addr_t*)(pPort + 1);
-	*pIP = pServerInfoList->Data[iArrIndex_].uiIP;
-
-	return;
+	return ZONE_NONE;
 }
 
-// Choose the server with the fewest clients among all the servers
-void CLoadBalancer::GetBestServer(int* pThreadIndex_, int* pListIndex_, int* pArrIndex_)
+// Get the length of a request from a client from its packet type
+// Unknown packet types are treated as the shortest request, and the client gets SERVER_ADDR_RESPONSE_UNKNOWN_TYPE.
+size_t CLoadBalancer::GetRequestLength(unsigned char* pRecvBuff_)
 {
-	int iBestThreadIndex = -1;
-	int iBestListIndex = -1;
-	int iBestArrayIndex = -1;
+	unsigned short usPacketType = *((unsigned short*)pRecvBuff_);
+	if (SERVER_ADDR_KEYED_REQUEST_TYPE == usPacketType)
+		return SERVER_ADDR_KEYED_REQUEST_LENGTH;
 	
-	long int uiMinClinetCounts = LONG_MAX;
+	return SERVER_ADDR_REQUEST_LENGTH;
+}
+
+// Choose the server for a key with the Maglev lookup table
+// If there is no running server, *pThreadIndex_ is set to -1
+void CLoadBalancer::GetKeyedServer(unsigned long long ulKey_, int* pThreadIndex_, int* pListIndex_, int* pArrIndex_, unsigned int* pGeneration_)
+{
+	int iBackendIndex = m_MaglevTable.Lookup(ulKey_);
+	if (-1 != iBackendIndex)
+	{
+		const Server_Location& stLocation = m_vecMemberServers[iBackendIndex];
+		int iListIndex = stLocation.iSlotIndex / MAX_SERVER_NUMS_PER_ARRAY;
+		int iArrIndex = stLocation.iSlotIndex % MAX_SERVER_NUMS_PER_ARRAY;
+		
+		// The server may have been disconnected after the table was built
+		if (IsServerAlive(&stLocation))
+		{
+			*pThreadIndex_ = stLocation.iThreadIndex;
+			*pListIndex_ = iListIndex;
+			*pArrIndex_ = iArrIndex;
+			*pGeneration_ = stLocation.uiGeneration;
+			return;
+		}
+	}
 	
+	// The table gets rebuilt soon, so the least busy server is used for now
+	GetBestServer(NULL, pThreadIndex_, pListIndex_, pArrIndex_, pGeneration_);
+}
+
+// Rebuild the server membership and the tables built from it if servers have become ready or stopped running since they were built
+// This is called once per epoll_wait() instead of on each request.
+void CLoadBalancer::RefreshMembership()
+{
+	// Read the versions first
+	// If a server joins or leaves while the tables are being built, the version changes again and the tables are rebuilt next time
+	bool bChanged = false;
 	for (int i = 0; i < MAX_THREAD_COUNTS; ++i)
 	{
-		unsigned long uiServerCounts = g_uiServerCounts[i];
-		
-		Simple_List<long int*>* pClientCountsList = g_pClientCountsList[i];
+		unsigned long uiVersion = g_stServerShards[i].uiMembershipVersion.load(std::memory_order_acquire);
+		if (uiVersion != m_uiMembershipVersion[i])
+		{
+			m_uiMembershipVersion[i] = uiVersion;
+			bChanged = true;
+		}
+	}
+	
+	if (!bChanged)
+		return;
 	
-		unsigned long int j = 0;
-		int iArrayIndex = 0;
-		int iListIndex = 0;
+	// Every running server is a member. A server that is not ready yet joins once it sends its first status update.
+	// Each member is identified by its address, which does not change even if the server reconnects to another thread
+	std::vector<std::pair<unsigned long long, Server_Location> > vecMembers;
+	std::vector<unsigned short> vecCapacities;
+	for (int i = 0; i < MAX_THREAD_COUNTS; ++i)
+	{
+		unsigned long uiServerCounts = g_stServerShards[i].uiServerCounts.load(std::memory_order_acquire);
 		
-		while (j < uiServerCounts)
+		for (unsigned long j = 0; j < uiServerCounts; ++j)
 		{
-			long int iClientCounts = pClientCountsList->Data[iArrayIndex];
-			if (0 <= iClientCounts && iClientCounts < uiMinClinetCounts)
-			{
-				uiMinClinetCounts = iClientCounts;
-				iBestListIndex = iListIndex;
-				iBestArrayIndex = iArrayIndex;
-				iBestThreadIndex = i;
-			}
-			
-			if (++iArrayIndex >= MAX_SERVER_NUMS_PER_ARRAY)
-			{
-				iArrayIndex = 0;
-				++iListIndex;
-				pClientCountsList = pClientCountsList->pNext;
+			int iListIndex = j / MAX_SERVER_NUMS_PER_ARRAY;
+			int iArrIndex = j % MAX_SERVER_NUMS_PER_ARRAY;
+			if (0 > GetClientCounts(i, iListIndex, iArrIndex))
+				continue;
 				
-				if (NULL == pClientCountsList)
-					break;
-			}
+			// A new server is taking the slot, and it changes the membership version again when it is done
+			Server_Record stRecord;
+			if (-1 == ReadServerRecord(i, iListIndex, iArrIndex, &stRecord))
+				continue;
 			
-			++j;
+			Server_Location stLocation;
+			stLocation.iThreadIndex = i;
+			stLocation.iSlotIndex = (int)j;
+			stLocation.uiGeneration = stRecord.uiGeneration;
+			
+			unsigned long long ulServerID = ((unsigned long long)stRecord.uiIP << 16) | stRecord.usPort;
+			vecMembers.push_back(std::make_pair(ulServerID, stLocation));
 		}
 	}
 	
-	*pArrIndex_ = iBestArrayIndex;
-	*pListIndex_ = iBestListIndex;
-	*pThreadIndex_ = iBestThreadIndex;
-}
-
-// Receive data from a server (TCP)
-// Return -1 on Failure
-// Return 0 on Success
-int CLoadBalancer::ServerPacketHandler(Server_Data_Access_Info* pServerInfo_)
-{
-	// It is possible to receive fewer bytes,
-	// Check whether there is any data previously received.
-	// If so, combine with newly received data with that previous one.
-	int iSockFD = pServerInfo_->iSocketFD;
-	std::unordered_map<int, InComplete_Packet*>::iterator mitor = m_mapTCPPacketRecvQueue.find(iSockFD);
-
-	// There are some data previously received
-	if (m_mapTCPPacketRecvQueue.end() != mitor)
+	// Every thread must give the members to the tables in the same order
+	std::sort(vecMembers.begin(), vecMembers.end(), CompareServerID);
+	
+	std::vector<unsigned long long> vecServerIDs(vecMembers.size());
+	m_vecMemberServers.resize(vecMembers.size());
+	for (size_t i = 0; i < vecMembers.size(); ++i)
 	{
-		InComplete_Packet* pInCompletePacket = mitor->second;
-		return RecvServerPacketWithPreData(pServerInfo_, pInCompletePacket);			
+		vecServerIDs[i] = vecMembers[i].first;
+		m_vecMemberServers[i] = vecMembers[i].second;
 	}
-	// No previous data
-	else
+	
+	m_MaglevTable.Build(vecServerIDs);
+	
+	if (SSP_BOUNDED_LOAD_HASHING == m_stOptions.iSelectionPolicy)
+		m_HashRing.Build(vecServerIDs);
+	
+	if (SSP_WEIGHTED_ROUND_ROBIN == m_stOptions.iSelectionPolicy)
 	{
-		return RecvServerPacket(pServerInfo_);
+		std::vector<unsigned short> vecWeights(m_vecMemberServers.size());
+		for (size_t i = 0; i < m_vecMemberServers.size(); ++i)
+		{
+			const Server_Location& stLocation = m_vecMemberServers[i];
+			vecWeights[i] = GetServerCapacity(stLocation.iThreadIndex, stLocation.iSlotIndex / MAX_SERVER_NUMS_PER_ARRAY, stLocation.iSlotIndex % MAX_SERVER_NUMS_PER_ARRAY);
+		}
+		
+		// Each thread starts from a different position so that threads do not choose the same servers at the same time
+		m_WeightedRoundRobin.Build(vecWeights, m_iThreadIndex, MAX_THREAD_COUNTS);
 	}
 }
 
-// Receive data from a server and add it to the previous data partially received (TCP)
-// Return -1 on Failure
-// Return 0 on Success
-int CLoadBalancer::RecvServerPacketWithPreData(Server_Data_Access_Info* pServerInfo_, InComplete_Packet* pInCompletePacket_)
+// Choose the next running server in smooth weighted round-robin order
+// The order only depends on the capacities of the servers, not on the numbers of clients in their status updates.
+// A server is in the sequence only after its first status update, and it is skipped as soon as it stops running.
+// If there is no running server, *pThreadIndex_ is set to -1
+void CLoadBalancer::GetRoundRobinServer(int* pThreadIndex_, int* pListIndex_, int* pArrIndex_, unsigned int* pGeneration_)
 {
-	// Receive data from where it left off
-	int iSockFD = pServerInfo_->iSocketFD;
-	size_t uiRestBytes = pInCompletePacket_->uiBufferLen - pInCompletePacket_->uiOffset;
-	ssize_t iResult = recv(iSockFD, pInCompletePacket_->pBuffer + pInCompletePacket_->uiOffset, uiRestBytes, 0);
-	if (-1 == iResult)
+	*pThreadIndex_ = -1;
+	*pListIndex_ = -1;
+	*pArrIndex_ = -1;
+	
+	// Skip servers that have stopped running or been replaced since the sequence was built
+	size_t uiLength = m_WeightedRoundRobin.GetLength();
+	for (size_t i = 0; i < uiLength; ++i)
+	{
+		const Server_Location& stLocation = m_vecMemberServers[m_WeightedRoundRobin.Next()];
+		int iListIndex = stLocation.iSlotIndex / MAX_SERVER_NUMS_PER_ARRAY;
+		int iArrIndex = stLocation.iSlotIndex % MAX_SERVER_NUMS_PER_ARRAY;
+		
+		if (IsServerAlive(&stLocation))
+		{
+			*pThreadIndex_ = stLocation.iThreadIndex;
+			*pListIndex_ = iListIndex;
+			*pArrIndex_ = iArrIndex;
+			*pGeneration_ = stLocation.uiGeneration;
+			return;
+		}
+	}
+}
+
+// Walk the hash ring from a key and choose the first server whose clients do not exceed the load bound
+// A server is accepted if (its clients + 1) <= ceil((1 + epsilon) * (the clients of all the servers + 1) * its capacity / the capacity of all the servers).
+// Clients assigned since the last status update are counted for the server, so a burst of clients with the same key moves on to the next servers.
+// If there is no running server, or every server visited is too busy, *pThreadIndex_ is set to -1
+void CLoadBalancer::GetBoundedHashServer(unsigned long long ulKey_, int* pThreadIndex_, int* pListIndex_, int* pArrIndex_, unsigned int* pGeneration_)
+{
+	*pThreadIndex_ = -1;
+	*pListIndex_ = -1;
+	*pArrIndex_ = -1;
+	
+	size_t uiRingSize = m_HashRing.GetSize();
+	if (0 == uiRingSize)
+		return;
+	
+	long int iTotalClientCounts = 0;
+	long int iTotalCapacity = 0;
+	long int iInFlightCounts = 0;
+	for (int i = 0; i < MAX_THREAD_COUNTS; ++i)
+	{
+		iTotalClientCounts += g_stServerShards[i].iRunningClientCounts.load(std::memory_order_relaxed);
+		iTotalCapacity += g_stServerShards[i].iRunningCapacity.load(std::memory_order_relaxed);
+		iInFlightCounts += g_stServerShards[i].iAssignedClientCounts.load(std::memory_order_relaxed) - g_stServerShards[i].iSettledClientCounts.load(std::memory_order_relaxed);
+	}
+	
+	// The sums of different threads are not read at the same moment, so the difference may be slightly off
+	if (0 < iInFlightCounts)
+		iTotalClientCounts += iInFlightCounts;
+	
+	if (0 >= iTotalCapacity)
+		return;
+	
+	// Both sides of the comparison are multiplied by 100 * the capacity of all the servers to avoid division
+	// The products can exceed a long with thousands of servers of large capacities, so they are computed in 128 bits.
+	__int128 iBoundFactor = (__int128)(100 + m_stOptions.iLoadBoundPercent) * (iTotalClientCounts + 1);
+	__int128 iClientFactor = (__int128)100 * iTotalCapacity * SLOW_START_FULL_PERMILLE;
+	
+	size_t uiPosition = m_HashRing.FindFirstPosition(ulKey_);
+	size_t uiProbeCounts = std::min(uiRingSize, (size_t)MAX_HASH_RING_PROBES);
+	int iPrevBackend = -1;
+	for (size_t i = 0; i < uiProbeCounts; ++i)
+	{
+		// Neighbouring points often belong to the same server
+		int iBackend = m_HashRing.GetBackend(uiPosition + i);
+		if (iBackend == iPrevBackend)
+			continue;
+		
+		iPrevBackend = iBackend;
+		
+		const Server_Location& stLocation = m_vecMemberServers[iBackend];
+		int iListIndex = stLocation.iSlotIndex / MAX_SERVER_NUMS_PER_ARRAY;
+		int iArrIndex = stLocation.iSlotIndex % MAX_SERVER_NUMS_PER_ARRAY;
+		
+		// The server is not ready, disconnected, or replaced by another server
+		long int iClientCounts = GetClientCounts(stLocation.iThreadIndex, iListIndex, iArrIndex);
+		if (0 > iClientCounts || !IsServerAlive(&stLocation))
+			continue;
+		
+		iClientCounts += GetInFlightCounts(GetAssignmentInfo(stLocation.iThreadIndex, iListIndex, iArrIndex));
+		
+		// A server in its slow-start window has a smaller share of the bound
+		long int iCapacity = GetServerCapacity(stLocation.iThreadIndex, iListIndex, iArrIndex);
+		long int iRampPermille = GetServerRampPermille(stLocation.iThreadIndex, iListIndex, iArrIndex);
+		if (iClientCounts * iClientFactor < iBoundFactor * iCapacity * iRampPermille)
+		{
+			*pThreadIndex_ = stLocation.iThreadIndex;
+			*pListIndex_ = iListIndex;
+			*pArrIndex_ = iArrIndex;
+			*pGeneration_ = stLocation.uiGeneration;
+			return;
+		}
+	}
+}
+
+// Keep the number of clients and the capacity of the running servers of this thread up to date
+// A negative number of clients means that the server is not running, so it does not count.
+// Only this thread writes on the sums in its own shard, so they are updated with a load and a store instead of a read-modify-write.
+// Other threads use the sums only as estimates, so no ordering is needed.
+void CLoadBalancer::UpdateRunningTotals(long int iOldClientCounts_, long int iNewClientCounts_, unsigned short usCapacity_)
+{
+	long int iClientCounts = g_stServerShards[m_iThreadIndex].iRunningClientCounts.load(std::memory_order_relaxed);
+	long int iCapacity = g_stServerShards[m_iThreadIndex].iRunningCapacity.load(std::memory_order_relaxed);
+	
+	if (0 <= iOldClientCounts_)
+	{
+		iClientCounts -= iOldClientCounts_;
+		iCapacity -= usCapacity_;
+	}
+	
+	if (0 <= iNewClientCounts_)
+	{
+		iClientCounts += iNewClientCounts_;
+		iCapacity += usCapacity_;
+	}
+	
+	g_stServerShards[m_iThreadIndex].iRunningClientCounts.store(iClientCounts, std::memory_order_relaxed);
+	g_stServerShards[m_iThreadIndex].iRunningCapacity.store(iCapacity, std::memory_order_relaxed);
+}
+
+// Count clients that the servers of this thread have included in their status updates (or taken away on disconnection)
+// Only this thread writes on the count in its own shard.
+void CLoadBalancer::AddSettledClientCounts(long int iClientCounts_)
+{
+	std::atomic<long int>& iSettledClientCounts = g_stServerShards[m_iThreadIndex].iSettledClientCounts;
+	iSettledClientCounts.store(iSettledClientCounts.load(std::memory_order_relaxed) + iClientCounts_, std::memory_order_relaxed);
+}
+
+// Tell other threads that a server has joined or left this thread
+// Everything written about the server before this call is visible to a thread that reads the new version.
+void CLoadBalancer::IncreaseMembershipVersion()
+{
+	std::atomic<unsigned long>& uiMembershipVersion = g_stServerShards[m_iThreadIndex].uiMembershipVersion;
+	uiMembershipVersion.store(uiMembershipVersion.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// Get the number of clients of the server corresponding to the indices
+long int CLoadBalancer::GetClientCounts(int iThreadIndex_, int iListIndex_, int iArrIndex_)
+{
+	return GetServerChunk(iThreadIndex_, iListIndex_)->iClientCounts[iArrIndex_].load(std::memory_order_acquire);
+}
+
+// Check if the server at a location is still running and has not been replaced by another server
+// The slot of a disconnected server may have been taken by a new server since the location was taken.
+// A server that has not sent its first status update yet (SERVER_NOT_READY) is not running either.
+bool CLoadBalancer::IsServerAlive(const Server_Location* pLocation_)
+{
+	const Server_Chunk* pChunk = GetServerChunk(pLocation_->iThreadIndex, pLocation_->iSlotIndex / MAX_SERVER_NUMS_PER_ARRAY);
+	int iArrIndex = pLocation_->iSlotIndex % MAX_SERVER_NUMS_PER_ARRAY;
+	
+	// The status is read first. A new server in the slot writes its generation before its status.
+	if (0 > pChunk->iClientCounts[iArrIndex].load(std::memory_order_acquire))
+		return false;
+	
+	return pLocation_->uiGeneration == pChunk->uiGeneration[iArrIndex].load(std::memory_order_relaxed);
+}
+
+// Get the latency of the server corresponding to the indices (microseconds, 0 if unknown)
+unsigned long CLoadBalancer::GetServerLatency(int iThreadIndex_, int iListIndex_, int iArrIndex_)
+{
+	return GetServerChunk(iThreadIndex_, iListIndex_)->ulLatency[iArrIndex_].load(std::memory_order_relaxed);
+}
+
+// Get IP and Port of the Server corresponding to the indices
+// uiGeneration_ is the generation of the slot read when the server was chosen.
+// The IP and the port are read as one record with the generation, so they belong to the chosen server if the generation is the same.
+// This is called on every request, so the status is read in the same pass as the record (See ReadServerRecord()).
+// Return -1 if the server has stopped running or been replaced since it was chosen, or a new server is taking its slot
+// Return 0 on Success
+int CLoadBalancer::GetServerAddr(unsigned char* pBuff_, int iThreadIndex_, int iListIndex_, int iArrIndex_, unsigned int uiGeneration_)
+{
+	const Server_Chunk* pChunk = GetServerChunk(iThreadIndex_, iListIndex_);
+	
+	for (int i = 0; i < MAX_SERVER_RECORD_READ_ATTEMPTS; ++i)
+	{
+		unsigned int uiSequence = pChunk->uiSequence[iArrIndex_].load(std::memory_order_acquire);
+		
+		// The record is being written
+		if (0 != (uiSequence & 1))
+			continue;
+		
+		// The status is not part of the record, but the previous server in the slot was marked SERVER_DISCONNECTED before the record was written.
+		// Thus, the status read after the sequence number never belongs to a server older than the record.
+		unsigned int uiGeneration = pChunk->uiGeneration[iArrIndex_].load(std::memory_order_relaxed);
+		long int iClientCounts = pChunk->iClientCounts[iArrIndex_].load(std::memory_order_relaxed);
+		unsigned short usPort = pChunk->usPort[iArrIndex_].load(std::memory_order_relaxed);
+		in_addr_t uiIP = pChunk->uiIP[iArrIndex_].load(std::memory_order_relaxed);
+		
+		// The fields must be read before the sequence number is read again
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (uiSequence != pChunk->uiSequence[iArrIndex_].load(std::memory_order_relaxed))
+			continue;
+		
+		if (uiGeneration_ != uiGeneration || 0 > iClientCounts)
+			return -1;
+		
+		unsigned short* pPort = (unsigned short*)pBuff_;
+		*pPort = usPort;
+		
+		in_addr_t* pIP = (in_addr_t*)(pPort + 1);
+		*pIP = uiIP;
+		
+		return 0;
+	}
+	
+	return -1;
+}
+
+// Read a consistent copy of the record of the server corresponding to the indices (See Server_Chunk::uiSequence)
+// The thread that manages the server may be writing the record of a new server at the same time.
+// A reader never waits for the writer. It tries again up to MAX_SERVER_RECORD_READ_ATTEMPTS times instead.
+// Return -1 if every attempt overlapped with a write
+// Return 0 on Success
+int CLoadBalancer::ReadServerRecord(int iThreadIndex_, int iListIndex_, int iArrIndex_, Server_Record* pRecord_)
+{
+	const Server_Chunk* pChunk = GetServerChunk(iThreadIndex_, iListIndex_);
+		
+	for (int i = 0; i < MAX_SERVER_RECORD_READ_ATTEMPTS; ++i)
+	{
+		unsigned int uiSequence = pChunk->uiSequence[iArrIndex_].load(std::memory_order_acquire);
+	
+		// The record is being written
+		if (0 != (uiSequence & 1))
+			continue;
+
+		pRecord_->uiIP = pChunk->uiIP[iArrIndex_].load(std::memory_order_relaxed);
+		pRecord_->usPort = pChunk->usPort[iArrIndex_].load(std::memory_order_relaxed);
+		pRecord_->usCapacity = pChunk->usCapacity[iArrIndex_].load(std::memory_order_relaxed);
+		pRecord_->uiGeneration = pChunk->uiGeneration[iArrIndex_].load(std::memory_order_relaxed);
+		
+		// The fields must be read before the sequence number is read again
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (uiSequence == pChunk->uiSequence[iArrIndex_].load(std::memory_order_relaxed))
+			return 0;
+	}
+	
+	return -1;
+}
+
+// Write the record of a new server of this thread (See Server_Chunk::uiSequence)
+// The generation of the slot changes together with the address, so a reader gets either the old server or the new one.
+void CLoadBalancer::WriteServerRecord(int iListIndex_, int iArrIndex_, in_addr_t uiIP_, unsigned short usPort_, unsigned short usCapacity_)
+{
+	Server_Chunk* pChunk = GetServerChunk(m_iThreadIndex, iListIndex_);
+	
+	// Only this thread writes on the sequence number, so it is read without ordering
+	unsigned int uiSequence = pChunk->uiSequence[iArrIndex_].load(std::memory_order_relaxed);
+	
+	// An odd sequence number tells readers that the record is being written
+	// The fence keeps the fields from being written before the odd number.
+	pChunk->uiSequence[iArrIndex_].store(uiSequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	
+	pChunk->uiGeneration[iArrIndex_].store(pChunk->uiGeneration[iArrIndex_].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	pChunk->uiIP[iArrIndex_].store(uiIP_, std::memory_order_relaxed);
+	pChunk->usPort[iArrIndex_].store(usPort_, std::memory_order_relaxed);
+	pChunk->usCapacity[iArrIndex_].store(usCapacity_, std::memory_order_relaxed);
+	
+	pChunk->uiSequence[iArrIndex_].store(uiSequence + 2, std::memory_order_release);
+}
+
+// Choose the best server according to the selection policy
+// pClientAddr_ is the address of the client (NULL if unknown)
+// If there is no running server, *pThreadIndex_ is set to -1
+void CLoadBalancer::GetBestServer(const struct sockaddr_in* pClientAddr_, int* pThreadIndex_, int* pListIndex_, int* pArrIndex_, unsigned int* pGeneration_)
+{
+	if (SSP_POWER_OF_D_CHOICES == m_stOptions.iSelectionPolicy)
+	{
+		GetPowerOfDChoicesServer(pThreadIndex_, pListIndex_, pArrIndex_, pGeneration_);
+		
+		// Sampling may fail to find a running server when most of the servers are not ready or disconnected.
+		// In that case, scan every server
+		if (-1 != *pThreadIndex_)
+			return;
+	}
+	else if (SSP_WEIGHTED_ROUND_ROBIN == m_stOptions.iSelectionPolicy)
+	{
+		GetRoundRobinServer(pThreadIndex_, pListIndex_, pArrIndex_, pGeneration_);
+		if (-1 != *pThreadIndex_)
+			return;
+	}
+	else if (SSP_BOUNDED_LOAD_HASHING == m_stOptions.iSelectionPolicy && NULL != pClientAddr_)
+	{
+		// Only the IP address is hashed because a client uses a different port for each connection
+		GetBoundedHashServer(pClientAddr_->sin_addr.s_addr, pThreadIndex_, pListIndex_, pArrIndex_, pGeneration_);
+		if (-1 != *pThreadIndex_)
+			return;
+	}
+	
+	int iClientZoneIndex = ZONE_NONE;
+	if (NULL != pClientAddr_)
+		iClientZoneIndex = GetZoneIndex(pClientAddr_->sin_addr.s_addr);
+	
+	// Prefer the client's own zone unless its best server is too busy
+	// Then, the least busy server among all the zones is chosen, which may still be in the client's zone.
+	if (ZONE_NONE != iClientZoneIndex)
+	{
+		long int iScore = GetLeastBusyServer(iClientZoneIndex, pThreadIndex_, pListIndex_, pArrIndex_, pGeneration_);
+		if (-1 != *pThreadIndex_ && iScore <= (long int)m_stOptions.iZoneSpillThreshold * CAPACITY_SCORE_SCALE)
+			return;
+	}
+	
+	GetLeastBusyServer(ZONE_NONE, pThreadIndex_, pListIndex_, pArrIndex_, pGeneration_);
+}
+
+// Choose the least busy server in a zone, or among all the servers if the zone is ZONE_NONE (See GetServerScore())
+// Each thread keeps its best server published, so only MAX_THREAD_COUNTS summaries are read regardless of the number of servers.
+// Clients assigned to a server since its last status update are counted as its clients as well.
+// Return how busy the chosen server is (LONG_MAX if there is no running server)
+long int CLoadBalancer::GetLeastBusyServer(int iZoneIndex_, int* pThreadIndex_, int* pListIndex_, int* pArrIndex_, unsigned int* pGeneration_)
+{
+	int iBestThreadIndex = -1;
+	int iBestListIndex = -1;
+	int iBestArrayIndex = -1;
+	unsigned int uiBestGeneration = 0;
+	
+	long int iMinScore = LONG_MAX;
+	
+	for (int i = 0; i < MAX_THREAD_COUNTS; ++i)
+	{
+		const std::atomic<unsigned long long>& ulPublishedSummary = (ZONE_NONE == iZoneIndex_) ? g_stServerShards[i].ulBestServerSummary : g_stServerShards[i].ulZoneBestServerSummary[iZoneIndex_];
+		unsigned long long ulSummary = ulPublishedSummary.load(std::memory_order_acquire);
+		if (BEST_SERVER_SUMMARY_NONE == ulSummary)
+			continue;
+		
+		int iSlotIndex = (int)(ulSummary & BEST_SERVER_SUMMARY_SLOT_MASK);
+		int iListIndex = iSlotIndex / MAX_SERVER_NUMS_PER_ARRAY;
+		int iArrayIndex = iSlotIndex % MAX_SERVER_NUMS_PER_ARRAY;
+		
+		// The server has left and a new server has taken its slot since the summary was published
+		// The thread publishes a new summary soon, so its servers are skipped for now.
+		unsigned int uiGeneration = GetServerChunk(i, iListIndex)->uiGeneration[iArrayIndex].load(std::memory_order_relaxed);
+		if (((unsigned int)(ulSummary >> BEST_SERVER_SUMMARY_SLOT_BITS) & BEST_SERVER_SUMMARY_GENERATION_MASK) != (uiGeneration & BEST_SERVER_SUMMARY_GENERATION_MASK))
+			continue;
+		
+		long int iClientCounts = (long int)(ulSummary >> 32) - 1;
+		long int iInFlightCounts = GetInFlightCounts(GetAssignmentInfo(i, iListIndex, iArrayIndex));
+		long int iLoad = GetServerLoad(i, iListIndex, iArrayIndex, iClientCounts, iInFlightCounts);
+		
+		long int iScore = GetServerScore(iLoad, GetServerCapacity(i, iListIndex, iArrayIndex), GetServerLatency(i, iListIndex, iArrayIndex), GetServerRampPermille(i, iListIndex, iArrayIndex));
+		if (iScore < iMinScore)
+		{
+			iMinScore = iScore;
+			iBestListIndex = iListIndex;
+			iBestArrayIndex = iArrayIndex;
+			iBestThreadIndex = i;
+			uiBestGeneration = uiGeneration;
+		}
+	}
+	
+	*pArrIndex_ = iBestArrayIndex;
+	*pListIndex_ = iBestListIndex;
+	*pThreadIndex_ = iBestThreadIndex;
+	*pGeneration_ = uiBestGeneration;
+	
+	return iMinScore;
+}
+
+// Sample d random servers and choose the one with the fewest clients per capacity among them
+// Unlike GetLeastBusyServer(), the cost does not grow with the number of servers.
+// In addition, concurrent requests do not all land on the single server with the fewest clients.
+void CLoadBalancer::GetPowerOfDChoicesServer(int* pThreadIndex_, int* pListIndex_, int* pArrIndex_, unsigned int* pGeneration_)
+{
+	int iBestThreadIndex = -1;
+	int iBestListIndex = -1;
+	int iBestArrayIndex = -1;
+	unsigned int uiBestGeneration = 0;
+	
+	long int iMinScore = LONG_MAX;
+	
+	// Other threads may add new servers while sampling, so take a snapshot of the number of servers first
+	unsigned long uiServerCounts[MAX_THREAD_COUNTS];
+	unsigned long uiTotalServerCounts = 0;
+	for (int i = 0; i < MAX_THREAD_COUNTS; ++i)
+	{
+		uiServerCounts[i] = g_stServerShards[i].uiServerCounts.load(std::memory_order_acquire);
+		uiTotalServerCounts += uiServerCounts[i];
+	}
+	
+	const int iMaxSampleCounts = m_stOptions.iChoiceCounts * MAX_SAMPLING_ROUNDS_PER_CHOICE;
+	int iChoiceCounts = 0;
+	int iSampleCounts = 0;
+	
+	while (0 < uiTotalServerCounts && iChoiceCounts < m_stOptions.iChoiceCounts && iSampleCounts < iMaxSampleCounts)
+	{
+		++iSampleCounts;
+		
+		// Every server has the same chance to be sampled regardless of which thread manages it
+		unsigned long uiIndex = GetRandomNumber() % uiTotalServerCounts;
+		int iThreadIndex = 0;
+		while (uiIndex >= uiServerCounts[iThreadIndex])
+		{
+			uiIndex -= uiServerCounts[iThreadIndex];
+			++iThreadIndex;
+		}
+		
+		int iListIndex = uiIndex / MAX_SERVER_NUMS_PER_ARRAY;
+		int iArrayIndex = uiIndex % MAX_SERVER_NUMS_PER_ARRAY;
+		
+		Server_Chunk* pChunk = GetServerChunk(iThreadIndex, iListIndex);
+		
+		// The server is not ready or disconnected
+		long int iClientCounts = pChunk->iClientCounts[iArrayIndex].load(std::memory_order_acquire);
+		if (0 > iClientCounts)
+			continue;
+		
+		// Read after the status, so it is at least as new as the server whose status was read
+		unsigned int uiGeneration = pChunk->uiGeneration[iArrayIndex].load(std::memory_order_relaxed);
+		
+		long int iInFlightCounts = GetInFlightCounts(&(pChunk->stAssignmentInfo[iArrayIndex]));
+		long int iLoad = GetServerLoad(iThreadIndex, iListIndex, iArrayIndex, iClientCounts, iInFlightCounts);
+		
+		++iChoiceCounts;
+		long int iScore = GetServerScore(iLoad, pChunk->usCapacity[iArrayIndex].load(std::memory_order_relaxed), pChunk->ulLatency[iArrayIndex].load(std::memory_order_relaxed), GetServerRampPermille(iThreadIndex, iListIndex, iArrayIndex));
+		if (iScore < iMinScore)
+		{
+			iMinScore = iScore;
+			iBestListIndex = iListIndex;
+			iBestArrayIndex = iArrayIndex;
+			iBestThreadIndex = iThreadIndex;
+			uiBestGeneration = uiGeneration;
+		}
+	}
+	
+	*pArrIndex_ = iBestArrayIndex;
+	*pListIndex_ = iBestListIndex;
+	*pThreadIndex_ = iBestThreadIndex;
+	*pGeneration_ = uiBestGeneration;
+}
+
+// Get a pseudo random number from this thread's own generator (xorshift64*)
+// This is not suitable for cryptographic purposes, but it is fast enough to be called on every request.
+unsigned long long CLoadBalancer::GetRandomNumber()
+{
+	unsigned long long ulState = m_ulRandomState;
+	ulState ^= ulState >> 12;
+	ulState ^= ulState << 25;
+	ulState ^= ulState >> 27;
+	m_ulRandomState = ulState;
+	
+	return ulState * 0x2545F4914F6CDD1DULL;
+}
+
+// Get the load of the server corresponding to the indices from its metrics
+// The load is the sum of the metrics weighted by the scoring option. With the default option, the load is the number of clients.
+// Clients assigned since the last status update are not included in the reported metrics yet,
+// so each of them is expected to add as much as an average client of the server does (or 1 if the server has no clients).
+// Otherwise, every client would get the same idle server until the next status update.
+long int CLoadBalancer::GetServerLoad(int iThreadIndex_, int iListIndex_, int iArrIndex_, long int iClientCounts_, long int iInFlightCounts_)
+{
+	const int* pWeights = m_stOptions.iMetricWeights;
+	long int iLoad = pWeights[SM_CLIENTS] * (iClientCounts_ + iInFlightCounts_);
+	
+	const Server_Chunk* pChunk = GetServerChunk(iThreadIndex_, iListIndex_);
+	for (int i = SM_REQUESTS; i < SM_MAX; ++i)
+	{
+		// The metric is not used, so there is no need to read it
+		if (0 == pWeights[i])
+			continue;
+		
+		long int iMetric = pChunk->uiMetrics[i][iArrIndex_].load(std::memory_order_relaxed);
+		if (0 < iClientCounts_)
+			iMetric += iMetric * iInFlightCounts_ / iClientCounts_;
+		else
+			iMetric += iInFlightCounts_;
+		
+		iLoad += pWeights[i] * iMetric;
+	}
+	
+	return iLoad;
+}
+
+// Get how busy a server is from its load, its capacity, its latency, and its slow-start window
+// A server with capacity 4 and load 8 is as busy as a server with capacity 1 and load 2.
+// The latency is taken into account only with SSP_LEAST_LATENCY.
+long int CLoadBalancer::GetServerScore(long int iLoad_, unsigned short usCapacity_, unsigned long ulLatency_, unsigned int uiRampPermille_)
+{
+	// An idle server is counted as load 1 so that an idle server that responds faster is still preferred
+	if (SSP_LEAST_LATENCY == m_stOptions.iSelectionPolicy)
+		++iLoad_;
+	
+	if (iLoad_ > LONG_MAX / CAPACITY_SCORE_SCALE)
+		return LONG_MAX;
+	
+	long int iScore = iLoad_ * CAPACITY_SCORE_SCALE / usCapacity_;
+	
+	// A server in its slow-start window looks as if it had only part of its capacity
+	if (SLOW_START_FULL_PERMILLE > uiRampPermille_)
+	{
+		if (iScore > LONG_MAX / SLOW_START_FULL_PERMILLE)
+			return LONG_MAX;
+		
+		iScore = iScore * SLOW_START_FULL_PERMILLE / uiRampPermille_;
+	}
+	
+	if (SSP_LEAST_LATENCY != m_stOptions.iSelectionPolicy)
+		return iScore;
+	
+	long int iLatencyFactor = SERVER_LATENCY_REFERENCE + (long int)ulLatency_;
+	if (iScore > LONG_MAX / iLatencyFactor)
+		return LONG_MAX;
+	
+	return iScore * iLatencyFactor / SERVER_LATENCY_REFERENCE;
+}
+
+// Get how much of its capacity the server corresponding to the indices is given during its slow-start window (per mille)
+// The share grows linearly from SLOW_START_MIN_PERMILLE to SLOW_START_FULL_PERMILLE over the window.
+// Return SLOW_START_FULL_PERMILLE if slow start is disabled or the window has ended
+unsigned int CLoadBalancer::GetServerRampPermille(int iThreadIndex_, int iListIndex_, int iArrIndex_)
+{
+	if (0 == m_stOptions.iSlowStartWindow)
+		return SLOW_START_FULL_PERMILLE;
+	
+	unsigned long long ulReadyTime = GetServerChunk(iThreadIndex_, iListIndex_)->ulReadyTime[iArrIndex_].load(std::memory_order_relaxed);
+	if (0 == ulReadyTime)
+		return SLOW_START_FULL_PERMILLE;
+	
+	// The ready time may have been written by another thread after this thread read the clock, so it can be slightly ahead
+	unsigned long long ulCurrentTime = GetCurrentTime();
+	unsigned long long ulElapsedTime = (ulCurrentTime > ulReadyTime) ? ulCurrentTime - ulReadyTime : 0;
+	unsigned long long ulWindow = (unsigned long long)m_stOptions.iSlowStartWindow * 1000000ULL;
+	if (ulElapsedTime >= ulWindow)
+		return SLOW_START_FULL_PERMILLE;
+	
+	return SLOW_START_MIN_PERMILLE + (unsigned int)((SLOW_START_FULL_PERMILLE - SLOW_START_MIN_PERMILLE) * ulElapsedTime / ulWindow);
+}
+
+// Get the capacity of the server corresponding to the indices
+unsigned short CLoadBalancer::GetServerCapacity(int iThreadIndex_, int iListIndex_, int iArrIndex_)
+{
+	return GetServerChunk(iThreadIndex_, iListIndex_)->usCapacity[iArrIndex_].load(std::memory_order_relaxed);
+}
+
+// Publish the summary of the best server among the servers that this thread manages
+// Only this thread writes on the summaries in its own shard
+void CLoadBalancer::PublishBestServer()
+{
+	g_stServerShards[m_iThreadIndex].ulBestServerSummary.store(GetBestServerSummary(&m_ServerHeap), std::memory_order_release);
+	
+	for (int i = 0; i < m_stOptions.iZoneCounts; ++i)
+		g_stServerShards[m_iThreadIndex].ulZoneBestServerSummary[i].store(GetBestServerSummary(&m_ZoneHeaps[i]), std::memory_order_release);
+}
+
+// Build the summary of the server at the top of a heap (See BEST_SERVER_SUMMARY_NONE)
+unsigned long long CLoadBalancer::GetBestServerSummary(const CServerHeap* pHeap_)
+{
+	if (pHeap_->IsEmpty())
+		return BEST_SERVER_SUMMARY_NONE;
+	
+	// The key in the heap includes clients assigned by other threads, but the summary only holds the number of clients reported by the server.
+	// Readers add the assigned clients by themselves because the number keeps changing after the summary is published.
+	int iSlotIndex = pHeap_->GetTopSlotIndex();
+	int iListIndex = iSlotIndex / MAX_SERVER_NUMS_PER_ARRAY;
+	int iArrIndex = iSlotIndex % MAX_SERVER_NUMS_PER_ARRAY;
+	
+	const Server_Chunk* pChunk = GetServerChunk(m_iThreadIndex, iListIndex);
+	unsigned long long ulClientCounts = (unsigned long long)pChunk->iClientCounts[iArrIndex].load(std::memory_order_relaxed);
+	if (ulClientCounts > MAX_SUMMARY_CLIENT_COUNTS)
+		ulClientCounts = MAX_SUMMARY_CLIENT_COUNTS;
+	
+	unsigned long long ulGeneration = pChunk->uiGeneration[iArrIndex].load(std::memory_order_relaxed) & BEST_SERVER_SUMMARY_GENERATION_MASK;
+	
+	// Build the whole summary first so that it is written at once
+	return ((ulClientCounts + 1) << 32) | (ulGeneration << BEST_SERVER_SUMMARY_SLOT_BITS) | (unsigned long long)iSlotIndex;
+}
+
+// Move the best server down the heap according to the clients that other threads assigned to it
+// Other threads assign clients to the published best server without telling this thread.
+// The key of the best server is updated with those clients, and the next best server gets published if it becomes less busy.
+// With zones, the best server of each zone is published as well, so the top of each zone heap is refreshed in the same way.
+// *pAssigned_ is set to true if clients have been assigned to a published server since its last status update
+// Return the number of servers whose keys have been updated (0 if no client has been assigned since the last check)
+int CLoadBalancer::RefreshBestServer(bool* pAssigned_)
+{
+	int iRefreshCounts = RefreshHeapTop(&m_ServerHeap, pAssigned_);
+	
+	for (int i = 0; i < m_stOptions.iZoneCounts; ++i)
+		iRefreshCounts += RefreshHeapTop(&m_ZoneHeaps[i], pAssigned_);
+	
+	if (0 < iRefreshCounts)
+		PublishBestServer();
+	
+	return iRefreshCounts;
+}
+
+// Move the top of a heap down according to the clients that other threads assigned to it
+// *pAssigned_ is set to true if clients have been assigned to the top of the heap since its last status update
+// Return the number of servers whose keys have been updated
+int CLoadBalancer::RefreshHeapTop(CServerHeap* pHeap_, bool* pAssigned_)
+{
+	int iRefreshCounts = 0;
+	
+	while (!pHeap_->IsEmpty() && iRefreshCounts < MAX_BEST_SERVER_REFRESH_COUNTS)
+	{
+		int iSlotIndex = pHeap_->GetTopSlotIndex();
+		int iListIndex = iSlotIndex / MAX_SERVER_NUMS_PER_ARRAY;
+		int iArrIndex = iSlotIndex % MAX_SERVER_NUMS_PER_ARRAY;
+		
+		Server_Chunk* pChunk = GetServerChunk(m_iThreadIndex, iListIndex);
+		
+		long int iInFlightCounts = GetInFlightCounts(&(pChunk->stAssignmentInfo[iArrIndex]));
+		if (0 < iInFlightCounts)
+			*pAssigned_ = true;
+		
+		// The key is up to date, so this server is still the best one
+		long int iLoad = GetServerLoad(m_iThreadIndex, iListIndex, iArrIndex, pChunk->iClientCounts[iArrIndex].load(std::memory_order_relaxed), iInFlightCounts);
+		long int iKey = GetServerScore(iLoad, pChunk->usCapacity[iArrIndex].load(std::memory_order_relaxed), pChunk->ulLatency[iArrIndex].load(std::memory_order_relaxed), GetServerRampPermille(m_iThreadIndex, iListIndex, iArrIndex));
+		if (iKey == pHeap_->GetTopKey())
+			break;
+		
+		SetServerKey(iSlotIndex, iKey);
+		++iRefreshCounts;
+	}
+	
+	return iRefreshCounts;
+}
+
+// Set the key of a running server in the heap and in the flat key array
+// Keys that do not fit in 32 bits are stored as the largest key below SERVER_KEY_NONE, so the server is still considered.
+void CLoadBalancer::SetServerKey(int iSlotIndex_, long int iKey_)
+{
+	m_ServerHeap.Update(iSlotIndex_, iKey_);
+	
+	int iZoneIndex = m_vecServerZones[iSlotIndex_];
+	if (ZONE_NONE != iZoneIndex)
+		m_ZoneHeaps[iZoneIndex].Update(iSlotIndex_, iKey_);
+	
+	unsigned int uiKey = SERVER_KEY_NONE - 1;
+	if (0 > iKey_)
+		uiKey = 0;
+	else if ((unsigned long)iKey_ < (unsigned long)(SERVER_KEY_NONE - 1))
+		uiKey = (unsigned int)iKey_;
+	
+	g_stServerShards[m_iThreadIndex].pServerKeys.load(std::memory_order_relaxed)[iSlotIndex_].store(uiKey, std::memory_order_relaxed);
+}
+
+// Remove a server that is not running from the heap and from the flat key array
+void CLoadBalancer::RemoveServerKey(int iSlotIndex_)
+{
+	m_ServerHeap.Remove(iSlotIndex_);
+	
+	int iZoneIndex = m_vecServerZones[iSlotIndex_];
+	if (ZONE_NONE != iZoneIndex)
+		m_ZoneHeaps[iZoneIndex].Remove(iSlotIndex_);
+	
+	g_stServerShards[m_iThreadIndex].pServerKeys.load(std::memory_order_relaxed)[iSlotIndex_].store(SERVER_KEY_NONE, std::memory_order_relaxed);
+}
+
+// Make room for a new server in the flat key array
+// The keys are copied to an array twice as large, and the new array is published.
+// Other threads read the number of servers before the array, so they never read past the end of an old array.
+// Return -1 on Failure (The array stays as it is)
+// Return 0 on Success
+int CLoadBalancer::GrowServerKeyArray(size_t uiServerCounts_)
+{
+	if (uiServerCounts_ <= m_uiServerKeyCapacity)
+		return 0;
+	
+	size_t uiNewCapacity = m_uiServerKeyCapacity * 2;
+	std::atomic<unsigned int>* pNewKeys = AllocateServerKeyArray(uiNewCapacity);
+	if (NULL == pNewKeys)
+		return -1;
+	
+	std::atomic<unsigned int>* pKeys = g_stServerShards[m_iThreadIndex].pServerKeys.load(std::memory_order_relaxed);
+	for (size_t i = 0; i < m_uiServerKeyCapacity; ++i)
+		pNewKeys[i].store(pKeys[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+	
+	g_stServerShards[m_iThreadIndex].pServerKeys.store(pNewKeys, std::memory_order_release);
+	m_uiServerKeyCapacity = uiNewCapacity;
+	
+	return 0;
+}
+
+// Get the assignment information of the server corresponding to the indices
+Server_Assignment_Info* CLoadBalancer::GetAssignmentInfo(int iThreadIndex_, int iListIndex_, int iArrIndex_)
+{
+	return &(GetServerChunk(iThreadIndex_, iListIndex_)->stAssignmentInfo[iArrIndex_]);
+}
+
+// Get the number of clients assigned to a server since its last status update
+// Counts written before the last status update are ignored.
+long int CLoadBalancer::GetInFlightCounts(Server_Assignment_Info* pAssignmentInfo_)
+{
+	unsigned long long ulUpdateEpoch = pAssignmentInfo_->uiUpdateEpoch.load(std::memory_order_acquire);
+	long int iInFlightCounts = 0;
+	
+	for (int i = 0; i < MAX_THREAD_COUNTS; ++i)
+	{
+		unsigned long long ulAssignedCounts = pAssignmentInfo_->ulAssignedCounts[i].load(std::memory_order_relaxed);
+		if ((ulAssignedCounts >> 32) == ulUpdateEpoch)
+			iInFlightCounts += (long int)(ulAssignedCounts & 0xFFFFFFFFULL);
+	}
+	
+	return iInFlightCounts;
+}
+
+// Count a client assigned to the server corresponding to the indices
+// This thread only writes on its own element of ulAssignedCounts.
+void CLoadBalancer::RecordAssignment(int iThreadIndex_, int iListIndex_, int iArrIndex_)
+{
+	Server_Assignment_Info* pAssignmentInfo = GetAssignmentInfo(iThreadIndex_, iListIndex_, iArrIndex_);
+	
+	unsigned long long ulUpdateEpoch = pAssignmentInfo->uiUpdateEpoch.load(std::memory_order_acquire);
+	unsigned long long ulAssignedCounts = pAssignmentInfo->ulAssignedCounts[m_iThreadIndex].load(std::memory_order_relaxed);
+	
+	// The server has sent a status update since this thread assigned a client to it last time
+	if ((ulAssignedCounts >> 32) != ulUpdateEpoch)
+		ulAssignedCounts = ulUpdateEpoch << 32;
+	
+	// Build the whole value first, and then write it at once
+	pAssignmentInfo->ulAssignedCounts[m_iThreadIndex].store(ulAssignedCounts + 1, std::memory_order_relaxed);
+	
+	std::atomic<long int>& iAssignedClientCounts = g_stServerShards[m_iThreadIndex].iAssignedClientCounts;
+	iAssignedClientCounts.store(iAssignedClientCounts.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+// Receive data on a connection
+// With io_uring, a client connection has already received its data into a buffer, and it is copied from there.
+// Return -1 with errno EAGAIN if the data has been consumed, in the same way as recv() on a non-blocking socket.
+ssize_t CLoadBalancer::RecvFromConnection(Connection* pConnection_, void* pBuffer_, size_t uiLength_)
+{
+	// Fewer bytes than asked for means that the socket buffer is empty (Edge-triggered epoll does not report the socket again until more data arrives)
+	if (NULL == pConnection_->pReceivedData)
+	{
+		ssize_t iResult = recv(pConnection_->iSockFD, pBuffer_, uiLength_, 0);
+		if (iResult < (ssize_t)uiLength_)
+			pConnection_->bMoreToRead = false;
+		
+		return iResult;
+	}
+	
+	if (0 == pConnection_->uiReceivedLength)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	
+	size_t uiCopyLength = std::min(uiLength_, pConnection_->uiReceivedLength);
+	memcpy(pBuffer_, pConnection_->pReceivedData, uiCopyLength);
+	pConnection_->pReceivedData += uiCopyLength;
+	pConnection_->uiReceivedLength -= uiCopyLength;
+	
+	return (ssize_t)uiCopyLength;
+}
+
+// Receive data from a server, and handle every complete packet in it (TCP)
+// Everything in the socket buffer, up to SERVER_RECV_BUFFER_SIZE bytes, is received with one recv() call right after the bytes kept from the previous call.
+// The bytes of the packet at the end that is not complete yet are kept again (See KeepServerPacketBytes()).
+// A status replaces every status before it, so only the newest status received is applied, after the other packets.
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::ServerPacketHandler(Connection* pConnection_)
+{
+	unsigned char szRecvBuff[SERVER_RECV_BUFFER_SIZE];
+
+	size_t uiKeptBytes = 0;
+	if (NULL != pConnection_->pRecvPacket)
+	{
+		uiKeptBytes = pConnection_->pRecvPacket->uiOffset;
+		memcpy(szRecvBuff, pConnection_->pRecvPacket->szBuffer, uiKeptBytes);
+	}
+
+	ssize_t iResult = RecvFromConnection(pConnection_, szRecvBuff + uiKeptBytes, SERVER_RECV_BUFFER_SIZE - uiKeptBytes);
+	if (-1 == iResult)
+	{
+		if (EAGAIN == errno || EWOULDBLOCK == errno)
+			return 0;
+		
+		perror("recv");
+		return -1;
+	}
+	
+	size_t uiLength = uiKeptBytes + iResult;
+	size_t uiOffset = 0;
+	unsigned char* pStatus = NULL;
+	int iStatusType = SPT_MAX;
+	while (PACKET_TYPE_LENGTH <= uiLength - uiOffset)
+	{
+		// A server packet consists of a header section and variable sized data section
+		int iPacketType = GetPacketType(szRecvBuff + uiOffset);
+		if (SPT_MAX == iPacketType)
+			return DisconnectHandler(pConnection_);
+		
+		size_t uiPacketLength = PACKET_TYPE_LENGTH + GetPacketDataLength(iPacketType);
+		if (uiPacketLength > uiLength - uiOffset)
+			break;
+		
+		unsigned char* pData = szRecvBuff + uiOffset + PACKET_TYPE_LENGTH;
+		if (SPT_STATUS == iPacketType || SPT_STATUS_METRICS == iPacketType)
+		{
+			pStatus = pData;
+			iStatusType = iPacketType;
+		}
+		// A server without a slot cannot be chosen, so it connects again later
+		else if (-1 == ProcessServerPacket(&(pConnection_->stServerInfo), iPacketType, pData))
+			return DisconnectHandler(pConnection_);
+		
+		uiOffset += uiPacketLength;
+	}
+	
+	if (NULL != pStatus)
+		ProcessServerPacket(&(pConnection_->stServerInfo), iStatusType, pStatus);
+	
+	return KeepServerPacketBytes(pConnection_, szRecvBuff + uiOffset, uiLength - uiOffset);
+}
+
+// Keep the bytes of a server packet received so far until the rest arrives
+// They are fewer than a whole packet, so they fit in a partial packet, which is given back to the pool once no byte is kept.
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::KeepServerPacketBytes(Connection* pConnection_, unsigned char* pRecvBuff_, size_t uiLength_)
+{
+	InComplete_Packet* pInCompletePacket = pConnection_->pRecvPacket;
+	if (0 == uiLength_)
+	{
+		if (NULL != pInCompletePacket)
+			RemoveTCPRecvQueuePacket(pConnection_);
+		
+		return 0;
+	}
+	
+	if (NULL == pInCompletePacket)
+		return AddTCPPacketToRecvQueue(pConnection_, SPT_MAX, PACKET_BUFFER_SIZE, uiLength_, pRecvBuff_);
+		
+	memcpy(pInCompletePacket->szBuffer, pRecvBuff_, uiLength_);
+	pInCompletePacket->uiOffset = uiLength_;
+			
+	return 0;
+}
+
+// Receive data from a client (TCP)
+// Return 0 on Failure
+// Return 1 on Success
+int CLoadBalancer::ClientTCPPacketHandler(Connection* pConnection_)
+{
+	// It is possible to receive fewer bytes.
+	// Check whether there is any data previously received.
+	// If so, combine with newly received data with that previous one.
+
+	// There are some data previously received
+	if (NULL != pConnection_->pRecvPacket)
+	{
+		return RecvClientPacketWithPreData(pConnection_);			
+	}
+	// No previous data
+	else
+	{
+		return RecvClientPacket(pConnection_);
+	}
+		
+	return 0;
+}
+
+// Receive data from a client and add it to the previous data partially received (TCP)
+// Return 0 on Failure
+// Return 1 on Success
+int CLoadBalancer::RecvClientPacketWithPreData(Connection* pConnection_)
+{
+	InComplete_Packet* pInCompletePacket = pConnection_->pRecvPacket;
+	
+	size_t uiRestBytes = pInCompletePacket->uiBufferLen - pInCompletePacket->uiOffset;
+	ssize_t iResult = RecvFromConnection(pConnection_, pInCompletePacket->szBuffer + pInCompletePacket->uiOffset, uiRestBytes);
+	if (-1 == iResult)
 	{
 		if (EAGAIN == errno || EWOULDBLOCK == errno)
 			return 0;
@@ -750,331 +2422,1149 @@ int CLoadBalancer::RecvServerPacketWithPreData(Server_Data_Access_Info* pServerI
 	}
 	else if ((size_t)iResult < uiRestBytes)
 	{
-		// There are more data to receive later
-		// For now, store the data that has been received so far 
-		pInCompletePacket_->uiOffset += iResult; 
-		return 0;
+		// There are more data to receive later
+		// For now, store the data that has been received so far 
+		pInCompletePacket->uiOffset += iResult; 
+		return 0;
+	}
+	
+	// Only the packet type has been received so far, and the rest of the packet is needed
+	if (-1 == pInCompletePacket->iPacketType)
+	{
+		// Every request fits in the buffer, so only the length changes
+		// The rest of the packet is received right after the packet type.
+		size_t uiRequestLength = GetRequestLength(pInCompletePacket->szBuffer);
+		if (uiRequestLength > pInCompletePacket->uiBufferLen)
+		{
+			pInCompletePacket->uiBufferLen = uiRequestLength;
+			pInCompletePacket->uiOffset = PACKET_TYPE_LENGTH;
+			pInCompletePacket->iPacketType = 0;
+			
+			// If the rest of the packet is already in the socket buffer, epoll notifies again (Or the handler reads it right away with edge-triggered epoll)
+			return 0;
+		}
+	}
+	
+	// Send a response with the best available server's IP and Port back to the client.
+	if (-1 == SendResponseToClient(pConnection_, pInCompletePacket->szBuffer, pInCompletePacket->uiBufferLen))
+		return -1;
+	
+	RemoveTCPRecvQueuePacket(pConnection_);
+	
+	return 0;
+}
+
+// Receive data from a client when there is no previous data partially received (TCP)
+// Return 0 on Failure
+// Return 1 on Success
+int CLoadBalancer::RecvClientPacket(Connection* pConnection_)
+{
+	unsigned char szRecvBuff[REQUEST_FROM_CLIENT_LENGTH] = { 0, };
+	// Receive Packeet Header first
+	ssize_t iResult = RecvFromConnection(pConnection_, szRecvBuff, PACKET_TYPE_LENGTH);
+	if (-1 == iResult)
+	{
+		if (EAGAIN == errno || EWOULDBLOCK == errno)
+			return 0;
+		
+		perror("recv");
+		return -1;
+	}
+	else if (iResult < PACKET_TYPE_LENGTH)
+	{
+		// There are more data to receive later
+		// For now, store the data that has been received so far 
+		return AddTCPPacketToRecvQueue(pConnection_, -1, PACKET_TYPE_LENGTH, iResult, szRecvBuff);
+	}
+	
+	// Receive the rest of the packet if the packet type has more data (ex. Keyed Server Address Request)
+	size_t uiRequestLength = GetRequestLength(szRecvBuff);
+	if (uiRequestLength > PACKET_TYPE_LENGTH)
+	{
+		size_t uiRestBytes = uiRequestLength - PACKET_TYPE_LENGTH;
+		iResult = RecvFromConnection(pConnection_, szRecvBuff + PACKET_TYPE_LENGTH, uiRestBytes);
+		if (-1 == iResult)
+		{
+			if (EAGAIN == errno || EWOULDBLOCK == errno)
+				iResult = 0;
+			else
+			{
+				perror("recv");
+				return -1;
+			}
+		}
+		
+		if ((size_t)iResult < uiRestBytes)
+		{
+			// There are more data to receive later
+			// For now, store the data that has been received so far 
+			return AddTCPPacketToRecvQueue(pConnection_, 0, uiRequestLength, PACKET_TYPE_LENGTH + iResult, szRecvBuff);
+		}
+	}
+	
+	// Send a response with the best available server's IP and Port back to the client.
+	if (-1 == SendResponseToClient(pConnection_, szRecvBuff, uiRequestLength))
+		return -1;
+	
+	return 0;
+}
+
+
+// Receive a UDP packet from a client 
+// Return 0 on Failure
+// Return 1 on Success
+int CLoadBalancer::ClientUDPPacketHandler(int iSockFD_)
+{
+	// Requests wait in the socket buffer until the queued responses have been sent (Only with UOP_PAUSE_READING)
+	if (m_bUDPReadingPaused)
+		return 0;
+	
+	Connection* pConnection = m_vecConnections[iSockFD_];
+	int iBudget = GetReadBudget(CT_CLIENT_UDP);
+	
+	// Every request of a batch counts against the budget, and at least one batch is received
+	if (1 < m_stOptions.iBatchCounts)
+	{
+		int iCount = 0;
+		do
+		{
+			if (-1 == ClientUDPBatchHandler(iSockFD_))
+				return -1;
+			
+			iCount += m_stOptions.iBatchCounts;
+		} while (iCount < iBudget && pConnection->bMoreToRead && !m_bUDPReadingPaused);
+		
+		return 0;
+	}
+	
+	// Receive a UDP Request for a Client
+	// Mulitple clients send a request to this UDP socket, so there could be multiple packets
+	// Read All of them and send a response to each client
+	unsigned char szRecvBuff[REQUEST_FROM_CLIENT_LENGTH] = { 0, };
+	int iCount = 0;
+	do
+	{
+		struct sockaddr_in stSockAddr;
+		memset(&stSockAddr, 0, sizeof(stSockAddr));
+		socklen_t uiAddrLen = sizeof(stSockAddr);
+						
+		ssize_t iReadBytes = recvfrom(m_iUDPSockForClients, szRecvBuff, REQUEST_FROM_CLIENT_LENGTH, 0, (struct sockaddr *)&stSockAddr, &uiAddrLen);
+		if (-1 == iReadBytes)
+		{
+			if (EAGAIN == errno || EWOULDBLOCK == errno)
+			{
+				pConnection->bMoreToRead = false;
+				break;
+			}
+			
+			perror("recvfrom");
+			return -1;
+		}
+		else if (0 == iReadBytes)
+			continue;
+		
+		// Build a Response and Send it back to the Client
+		unsigned char szSendBuff[RESPONSE_TO_CLIENT_LENGTH] = { 0, };
+		BuildResponse(szRecvBuff, iReadBytes, szSendBuff, NULL, &stSockAddr);
+		if (-1 == SendUDPResponse(iSockFD_, szSendBuff, &stSockAddr, uiAddrLen))
+			return -1;
+					
+	} while (++iCount < iBudget && !m_bUDPReadingPaused);
+	
+	return 0;
+}
+
+// Receive UDP packets from clients and answer them as a batch
+// When many clients send requests at the same time, every request handled alone would get the same least busy server.
+// Instead, the requests in the socket buffer are received first, and their servers are chosen at once (See AssignServersInBatch()).
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::ClientUDPBatchHandler(int iSockFD_)
+{
+	unsigned char (*szRecvBuff)[REQUEST_FROM_CLIENT_LENGTH] = m_szUDPRecvBuffs;
+	struct sockaddr_in* stSockAddr = m_stUDPRecvAddrs;
+	socklen_t uiAddrLen[MAX_UDP_BATCH_COUNTS];
+	bool bPlainRequest[MAX_UDP_BATCH_COUNTS];
+	
+	// With UOP_PAUSE_READING, no more requests are read than the responses that fit in the queue
+	int iMaxRequestCounts = m_stOptions.iBatchCounts;
+	if (UOP_PAUSE_READING == m_stOptions.iUDPOverflowPolicy)
+		iMaxRequestCounts = std::min(iMaxRequestCounts, (int)m_UDPResponseQueue.GetFreeCounts());
+	
+	// Every request in the socket buffer, up to the batch size, is received with one recvmmsg() call
+	// The messages have been set up in the constructor (See SetUpUDPRecvMessages()).
+	int iRequestCounts = recvmmsg(iSockFD_, m_stUDPRecvMessages, iMaxRequestCounts, 0, NULL);
+	if (-1 == iRequestCounts)
+	{
+		if (EAGAIN == errno || EWOULDBLOCK == errno)
+		{
+			m_vecConnections[iSockFD_]->bMoreToRead = false;
+			return 0;
+		}
+		
+		perror("recvmmsg");
+		return -1;
+	}
+	
+	// A batch that is not full has emptied the socket buffer
+	if (iRequestCounts < iMaxRequestCounts)
+		m_vecConnections[iSockFD_]->bMoreToRead = false;
+	
+	int iPlainRequestCounts = 0;
+	for (int i = 0; i < iRequestCounts; ++i)
+	{
+		struct msghdr* pMessage = &(m_stUDPRecvMessages[i].msg_hdr);
+		size_t uiRecvLength = m_stUDPRecvMessages[i].msg_len;
+		
+		// The kernel has written the size of the address, so it is set back for the next batch.
+		// A short request is followed by zeros instead of the bytes of an older request.
+		uiAddrLen[i] = pMessage->msg_namelen;
+		pMessage->msg_namelen = sizeof(stSockAddr[i]);
+		if (uiRecvLength < REQUEST_FROM_CLIENT_LENGTH)
+			memset(szRecvBuff[i] + uiRecvLength, 0, REQUEST_FROM_CLIENT_LENGTH - uiRecvLength);
+		
+		// Only plain requests are assigned in a batch. Keyed requests and wrong packets are handled one by one.
+		bPlainRequest[i] = (SERVER_ADDR_REQUEST_LENGTH <= uiRecvLength && SERVER_ADDR_REQUEST_TYPE == *((unsigned short*)szRecvBuff[i]));
+		if (bPlainRequest[i])
+			++iPlainRequestCounts;
+	}
+	
+	// Water-filling needs every server to be compared by how busy it is, so the other policies choose a server for each request as usual.
+	// Clients in a batch may belong to different zones, so zone-aware routing also chooses a server for each request.
+	Server_Location stServers[MAX_UDP_BATCH_COUNTS];
+	int iAssignedCounts = 0;
+	if (1 < iPlainRequestCounts && 0 == m_stOptions.iZoneCounts && (SSP_LEAST_CLIENTS == m_stOptions.iSelectionPolicy || SSP_LEAST_LATENCY == m_stOptions.iSelectionPolicy))
+		iAssignedCounts = AssignServersInBatch(iPlainRequestCounts, stServers);
+	
+	// The responses are built first, and sent back together
+	// An empty datagram gets no response, so the addresses of the responses are moved down over it.
+	unsigned char szSendBuff[MAX_UDP_BATCH_COUNTS][RESPONSE_TO_CLIENT_LENGTH];
+	memset(szSendBuff, 0, sizeof(szSendBuff));
+	
+	int iResponseCounts = 0;
+	int iNextServer = 0;
+	for (int i = 0; i < iRequestCounts; ++i)
+	{
+		if (0 == m_stUDPRecvMessages[i].msg_len)
+			continue;
+		
+		const Server_Location* pAssignedServer = NULL;
+		if (bPlainRequest[i] && iNextServer < iAssignedCounts)
+			pAssignedServer = &stServers[iNextServer++];
+		
+		BuildResponse(szRecvBuff[i], m_stUDPRecvMessages[i].msg_len, szSendBuff[iResponseCounts], pAssignedServer, &stSockAddr[i]);
+		stSockAddr[iResponseCounts] = stSockAddr[i];
+		uiAddrLen[iResponseCounts] = uiAddrLen[i];
+		++iResponseCounts;
 	}
 	
-	// Add a new Server
-	if (SPT_PORT == pInCompletePacket_->iPacketType)
-		AddNewServer(pServerInfo_, pInCompletePacket_->pBuffer);
-	//Update Server Status
-	else if(SPT_STATUS == pInCompletePacket_->iPacketType)
-		UpdateServerStatus(pServerInfo_, pInCompletePacket_->pBuffer);
-	// Data received above is the header section of a packet
-	else
+	return SendUDPResponses(iSockFD_, iResponseCounts, szSendBuff, stSockAddr, uiAddrLen);
+}
+
+// Point every message for recvmmsg() at its buffer and address once
+// Only the size of the address is written by the kernel, and ClientUDPBatchHandler() sets it back after each batch.
+void CLoadBalancer::SetUpUDPRecvMessages()
+{
+	memset(m_szUDPRecvBuffs, 0, sizeof(m_szUDPRecvBuffs));
+	memset(m_stUDPRecvAddrs, 0, sizeof(m_stUDPRecvAddrs));
+	for (int i = 0; i < MAX_UDP_BATCH_COUNTS; ++i)
+		SetUpUDPMessage(&m_stUDPRecvMessages[i], &m_stUDPRecvIOVecs[i], m_szUDPRecvBuffs[i], REQUEST_FROM_CLIENT_LENGTH, &m_stUDPRecvAddrs[i], sizeof(m_stUDPRecvAddrs[i]));
+}
+
+// Compare the keys of two servers (With std::push_heap(), the largest key is kept on top)
+static bool CompareBatchKey(const Batch_Key& stKey1_, const Batch_Key& stKey2_)
+{
+	return stKey1_.uiKey < stKey2_.uiKey;
+}
+
+// Choose servers for a batch of requests at once by water-filling
+// Each request goes to the least busy server counting the requests assigned before it.
+// The least busy servers are filled up to the level of the next least busy one, and so on.
+// With n requests, no more than n servers can get a request, and a server gets one only if every server less busy than it has received one.
+// Thus, only the servers with the smallest keys are considered, and they are found in one pass over the flat key arrays.
+// A key is only updated by the status updates of its server, so a server that got clients from other threads since then looks less busy than it is.
+// More candidates than requests are taken and scored from their current information, but a server whose key is far too small may still leave a less busy one out.
+// Return the number of requests assigned (0 if there is no running server)
+int CLoadBalancer::AssignServersInBatch(int iRequestCounts_, Server_Location* pServers_)
+{
+	m_vecBatchKeys.clear();
+	m_BatchHeap.Clear();
+	m_vecBatchCandidates.clear();
+	
+	// Keep the smallest keys seen so far in a max-heap, so a key larger than all of them is skipped with one comparison
+	size_t uiCandidateCounts = (size_t)iRequestCounts_ * BATCH_CANDIDATE_FACTOR;
+	for (int iThreadIndex = 0; iThreadIndex < MAX_THREAD_COUNTS; ++iThreadIndex)
 	{
-		// A server packet consists of a header section and variable sized data section
-		// Get the size of the data section of the packet
-		int iPacketType = GetPacketType(pInCompletePacket_->pBuffer);
-		if (SPT_MAX == iPacketType)
+		// Other threads may add new servers while reading, so take a snapshot of the number of servers first
+		// The array is read after the number, so it always has room for that number of servers.
+		long uiServerCounts = g_stServerShards[iThreadIndex].uiServerCounts.load(std::memory_order_acquire);
+		const std::atomic<unsigned int>* pKeys = g_stServerShards[iThreadIndex].pServerKeys.load(std::memory_order_acquire);
+		for (long i = 0; i < uiServerCounts; ++i)
 		{
-			RemoveTCPRecvQueuePacket(iSockFD, pInCompletePacket_);
-			return DisconnectHandler(iSockFD);
+			unsigned int uiKey = pKeys[i].load(std::memory_order_relaxed);
+			if (SERVER_KEY_NONE == uiKey)
+				continue;
+			
+			if (m_vecBatchKeys.size() == uiCandidateCounts)
+			{
+				if (uiKey >= m_vecBatchKeys.front().uiKey)
+					continue;
+				
+				std::pop_heap(m_vecBatchKeys.begin(), m_vecBatchKeys.end(), CompareBatchKey);
+				m_vecBatchKeys.pop_back();
+			}
+			
+			Batch_Key stKey;
+			stKey.uiKey = uiKey;
+			stKey.iThreadIndex = iThreadIndex;
+			stKey.iSlotIndex = (int)i;
+			
+			m_vecBatchKeys.push_back(stKey);
+			std::push_heap(m_vecBatchKeys.begin(), m_vecBatchKeys.end(), CompareBatchKey);
 		}
+	}
+	
+	// The keys may be a little old, so the current information of each server is read again below.
+	for (size_t i = 0; i < m_vecBatchKeys.size(); ++i)
+	{
+		int iThreadIndex = m_vecBatchKeys[i].iThreadIndex;
+		int iSlotIndex = m_vecBatchKeys[i].iSlotIndex;
+		int iListIndex = iSlotIndex / MAX_SERVER_NUMS_PER_ARRAY;
+		int iArrIndex = iSlotIndex % MAX_SERVER_NUMS_PER_ARRAY;
+		
+		// The server has stopped running since its key was read
+		long int iClientCounts = GetClientCounts(iThreadIndex, iListIndex, iArrIndex);
+		if (0 > iClientCounts)
+			continue;
 		
-		const size_t uiDataLength = GetPacketDataLength(iPacketType);
-		unsigned char szRecvBuff[uiDataLength];
+		Batch_Candidate stCandidate;
+		stCandidate.stLocation.iThreadIndex = iThreadIndex;
+		stCandidate.stLocation.iSlotIndex = iSlotIndex;
+		stCandidate.stLocation.uiGeneration = GetServerChunk(iThreadIndex, iListIndex)->uiGeneration[iArrIndex].load(std::memory_order_relaxed);
+		stCandidate.iClientCounts = iClientCounts;
+		stCandidate.iInFlightCounts = GetInFlightCounts(GetAssignmentInfo(iThreadIndex, iListIndex, iArrIndex));
+		stCandidate.usCapacity = GetServerCapacity(iThreadIndex, iListIndex, iArrIndex);
+		stCandidate.uiRampPermille = GetServerRampPermille(iThreadIndex, iListIndex, iArrIndex);
+		stCandidate.ulLatency = GetServerLatency(iThreadIndex, iListIndex, iArrIndex);
 		
-		// Receive the data section
-		iResult = recv(iSockFD, szRecvBuff, uiDataLength, 0);
-		if (-1 == iResult)
+		m_vecBatchCandidates.push_back(stCandidate);
+		m_BatchHeap.Update(m_vecBatchCandidates.size() - 1, GetBatchCandidateScore(&stCandidate));
+	}
+	
+	if (m_BatchHeap.IsEmpty())
+		return 0;
+	
+	for (int i = 0; i < iRequestCounts_; ++i)
+	{
+		int iCandidateIndex = m_BatchHeap.GetTopSlotIndex();
+		Batch_Candidate* pCandidate = &m_vecBatchCandidates[iCandidateIndex];
+		pServers_[i] = pCandidate->stLocation;
+		
+		++pCandidate->iInFlightCounts;
+		m_BatchHeap.Update(iCandidateIndex, GetBatchCandidateScore(pCandidate));
+	}
+	
+	return iRequestCounts_;
+}
+
+// Get how busy a server considered for a batch is
+long int CLoadBalancer::GetBatchCandidateScore(const Batch_Candidate* pCandidate_)
+{
+	int iListIndex = pCandidate_->stLocation.iSlotIndex / MAX_SERVER_NUMS_PER_ARRAY;
+	int iArrIndex = pCandidate_->stLocation.iSlotIndex % MAX_SERVER_NUMS_PER_ARRAY;
+	long int iLoad = GetServerLoad(pCandidate_->stLocation.iThreadIndex, iListIndex, iArrIndex, pCandidate_->iClientCounts, pCandidate_->iInFlightCounts);
+	
+	return GetServerScore(iLoad, pCandidate_->usCapacity, pCandidate_->ulLatency, pCandidate_->uiRampPermille);
+}
+
+// Send a response to a UDP client, or queue it if space is not available
+// Responses already in the queue go first, so a response is queued behind them without trying to send it.
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::SendUDPResponse(int iSockFD_, unsigned char* szSendBuff_, struct sockaddr_in* pSockAddr_, socklen_t uiAddrLen_)
+{
+	if (m_UDPResponseQueue.IsEmpty())
+	{
+		ssize_t iSendBytes = sendto(iSockFD_, szSendBuff_, RESPONSE_TO_CLIENT_LENGTH, 0, (struct sockaddr *)pSockAddr_, uiAddrLen_);
+		if (-1 == iSendBytes)
 		{
 			if (EAGAIN == errno || EWOULDBLOCK == errno)
-				iResult = 0;
+				iSendBytes = 0;
 			else
 			{
-				perror("recv");
+				perror("sendto()");
 				return -1;
 			}
 		}
 		
-		if ((size_t)iResult < uiDataLength)
+		if (0 != iSendBytes)
+			return 0;
+	}
+		
+	return QueueUDPResponse(iSockFD_, szSendBuff_, pSockAddr_, uiAddrLen_);
+}
+
+// Send responses to UDP clients with one sendmmsg() call, and queue the ones that could not be sent
+// Responses already in the queue go first, so every response is queued behind them without trying to send it.
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::SendUDPResponses(int iSockFD_, int iCounts_, unsigned char (*szSendBuffs_)[RESPONSE_TO_CLIENT_LENGTH], struct sockaddr_in* pSockAddrs_, socklen_t* pAddrLens_)
+{
+	int iSentCounts = 0;
+	if (m_UDPResponseQueue.IsEmpty() && 0 < iCounts_)
+	{
+		struct mmsghdr stMessages[MAX_UDP_BATCH_COUNTS];
+		struct iovec stIOVecs[MAX_UDP_BATCH_COUNTS];
+		for (int i = 0; i < iCounts_; ++i)
+			SetUpUDPMessage(&stMessages[i], &stIOVecs[i], szSendBuffs_[i], RESPONSE_TO_CLIENT_LENGTH, &pSockAddrs_[i], pAddrLens_[i]);
+		
+		iSentCounts = sendmmsg(iSockFD_, stMessages, iCounts_, 0);
+		if (-1 == iSentCounts)
 		{
-			// There are more data to receive later
-			// For now, store the data that has been received so far 
-			if (uiDataLength > pInCompletePacket_->uiBufferLen)
+			if (EAGAIN == errno || EWOULDBLOCK == errno)
+				iSentCounts = 0;
+			else
 			{
-				delete pInCompletePacket_->pBuffer;
-				pInCompletePacket_->pBuffer = new unsigned char[uiDataLength];
+				perror("sendmmsg()");
+				return -1;
 			}
+		}
+	}
+	
+	// The rest of the batch carries over into the queue in order
+	for (int i = iSentCounts; i < iCounts_; ++i)
+	{
+		if (-1 == QueueUDPResponse(iSockFD_, szSendBuffs_[i], &pSockAddrs_[i], pAddrLens_[i]))
+			return -1;
+	}
+	
+	return 0;
+}
+
+// Queue a response that could not be sent, to be sent when space is available
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::QueueUDPResponse(int iSockFD_, unsigned char* szSendBuff_, struct sockaddr_in* pSockAddr_, socklen_t uiAddrLen_)
+{
+	// The socket is watched for space only while responses are waiting
+	if (m_UDPResponseQueue.IsEmpty() && -1 == Epoll_CTL_Wrapper(EPOLL_CTL_MOD, iSockFD_, EPOLLIN | EPOLLOUT))
+		return -1;
+	
+	// The response may be dropped, or replace the oldest one, according to the overflow policy
+	m_UDPResponseQueue.Push(szSendBuff_, pSockAddr_, uiAddrLen_);
+	
+	// Stop reading requests before their responses overflow the queue (See ClientUDPPacketHandler())
+	if (UOP_PAUSE_READING == m_stOptions.iUDPOverflowPolicy && m_UDPResponseQueue.IsFull())
+	{
+		m_bUDPReadingPaused = true;
+		++m_ulUDPReadingPauseCounts;
+		return Epoll_CTL_Wrapper(EPOLL_CTL_MOD, iSockFD_, EPOLLOUT);
+	}
+	
+	return 0;
+}
+
+// Update the status of a server with the new value transferred from that server
+void CLoadBalancer::UpdateServerStatus(Server_Data_Access_Info* pServerInfo_, unsigned char* pRecvBuff_, int iPacketType_)
+{
+	int iListIndex = pServerInfo_->iListIndex;
+	int iArrIndex = pServerInfo_->iArrayIndex;
+	
+	if (-1 == iListIndex || -1 == iArrIndex)
+	{
+		DisplayErrorMessage("Unexpected Server Indices");
+		return;
+	}
+
+	Server_Chunk* pChunk = GetServerChunk(m_iThreadIndex, iListIndex);
+	
+	long int* pData = (long int*)(pRecvBuff_);
+	long int iNewClinetCounts = *(pData);
+	
+	// The other metrics are written before the number of clients, which tells other threads whether the server is running
+	if (SPT_STATUS_METRICS == iPacketType_)
+	{
+		unsigned int uiMetrics[SM_MAX - 1];
+		memcpy(uiMetrics, pData + 1, sizeof(uiMetrics));
+		
+		for (int j = SM_REQUESTS; j < SM_MAX; ++j)
+			pChunk->uiMetrics[j][iArrIndex].store(uiMetrics[j - 1], std::memory_order_relaxed);
+	}
+	
+	// A server that becomes ready starts its slow-start window before other threads find it ready
+	// The window is closed by the first status update after it ends, so other threads stop checking the time for the server.
+	if (0 < m_stOptions.iSlowStartWindow)
+	{
+		std::atomic<unsigned long long>& ulReadyTime = pChunk->ulReadyTime[iArrIndex];
+		if (0 > pChunk->iClientCounts[iArrIndex].load(std::memory_order_relaxed) && 0 <= iNewClinetCounts)
+			ulReadyTime.store(GetCurrentTime(), std::memory_order_relaxed);
+		else if (0 != ulReadyTime.load(std::memory_order_relaxed) && SLOW_START_FULL_PERMILLE == GetServerRampPermille(m_iThreadIndex, iListIndex, iArrIndex))
+			ulReadyTime.store(0, std::memory_order_relaxed);
+	}
+	
+	UpdateRunningTotals(pChunk->iClientCounts[iArrIndex].load(std::memory_order_relaxed), iNewClinetCounts, pChunk->usCapacity[iArrIndex].load(std::memory_order_relaxed));
+	long int iOldClientCounts = pChunk->iClientCounts[iArrIndex].load(std::memory_order_relaxed);
+	pChunk->iClientCounts[iArrIndex].store(iNewClinetCounts, std::memory_order_release);
+	
+	// Only running servers are members, so a server joins the membership when it becomes ready (and leaves if it stops being ready)
+	if ((0 > iOldClientCounts) != (0 > iNewClinetCounts))
+		IncreaseMembershipVersion();
+	
+	// The new status includes the clients assigned so far, so reset the assigned clients
+	// The number of clients is written first so that other threads never count those clients out.
+	Server_Assignment_Info* pAssignmentInfo = &(pChunk->stAssignmentInfo[iArrIndex]);
+	AddSettledClientCounts(GetInFlightCounts(pAssignmentInfo));
+	pAssignmentInfo->uiUpdateEpoch.store(pAssignmentInfo->uiUpdateEpoch.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	
+	// Keep the heap and the published summary up to date
+	int iSlotIndex = iListIndex * MAX_SERVER_NUMS_PER_ARRAY + iArrIndex;
+	if (0 <= iNewClinetCounts)
+	{
+		long int iLoad = GetServerLoad(m_iThreadIndex, iListIndex, iArrIndex, iNewClinetCounts, 0);
+		SetServerKey(iSlotIndex, GetServerScore(iLoad, pChunk->usCapacity[iArrIndex].load(std::memory_order_relaxed), pChunk->ulLatency[iArrIndex].load(std::memory_order_relaxed), GetServerRampPermille(m_iThreadIndex, iListIndex, iArrIndex)));
+	}
+	else
+		RemoveServerKey(iSlotIndex);
+	
+	PublishBestServer();
+}
+
+// Handle a packet from a server whose data section has completely been received
+// Return -1 if the server could not be added
+// Return 0 on Success
+int CLoadBalancer::ProcessServerPacket(Server_Data_Access_Info* pServerInfo_, int iPacketType_, unsigned char* pRecvBuff_)
+{
+	// Add a new Server
+	if (SPT_PORT == iPacketType_ || SPT_PORT_CAPACITY == iPacketType_)
+		return AddNewServer(pServerInfo_, pRecvBuff_, iPacketType_);
+	//Update Server Status
+	else if (SPT_STATUS == iPacketType_ || SPT_STATUS_METRICS == iPacketType_)
+		UpdateServerStatus(pServerInfo_, pRecvBuff_, iPacketType_);
+	// Update Server Latency
+	else if (SPT_PONG == iPacketType_)
+		UpdateServerLatency(pServerInfo_, pRecvBuff_);
+	
+	return 0;
+}
 
-			pInCompletePacket_->iPacketType = iPacketType;
-			pInCompletePacket_->uiBufferLen = uiDataLength;
-			pInCompletePacket_->uiOffset = iResult;
+// Send a Ping packet to each server that this thread manages if it is time to do so
+// Return the number of milliseconds until the next time (-1 if this thread has no server)
+int CLoadBalancer::PingServers()
+{
+	// Servers that have not sent their ports yet are not counted, and they are not pinged either
+	if (0 == g_stServerShards[m_iThreadIndex].iConnectedServerCounts.load(std::memory_order_relaxed))
+		return -1;
+	
+	unsigned long long ulCurrentTime = GetCurrentTime();
+	if (ulCurrentTime < m_ulNextPingTime)
+		return (int)((m_ulNextPingTime - ulCurrentTime + 999) / 1000);
+	
+	for (size_t i = 0; i < m_vecConnections.size(); ++i)
+	{
+		// Not a server, or the server has not sent its port yet
+		Connection* pConnection = m_vecConnections[i];
+		if (NULL == pConnection || CT_SERVER != pConnection->iType || -1 == pConnection->stServerInfo.iListIndex)
+			continue;
+		
+		SendPingPacket(pConnection, ulCurrentTime);
+	}
+	
+	m_ulNextPingTime = ulCurrentTime + SERVER_PING_INTERVAL * 1000ULL;
+	
+	return SERVER_PING_INTERVAL;
+}
 
-			memcpy((void*)pInCompletePacket_->pBuffer, (void *)szRecvBuff, iResult);
+// Main loop of the aggregator thread
+// Rebuild the snapshot every iAggregatorInterval microseconds, and report how it is going every SERVER_SNAPSHOT_REPORT_INTERVAL seconds
+void CLoadBalancer::RunAggregator()
+{
+	struct timespec stInterval;
+	stInterval.tv_sec = m_stOptions.iAggregatorInterval / 1000000;
+	stInterval.tv_nsec = (m_stOptions.iAggregatorInterval % 1000000) * 1000L;
+	
+	unsigned long long ulRebuildCounts = 0;
+	unsigned long long ulTotalBuildCost = 0;
+	unsigned long long ulMaxBuildCost = 0;
+	
+	// The oldest that a snapshot got before it was replaced (What readers may see at worst)
+	unsigned long long ulMaxSnapshotAge = 0;
+	unsigned long long ulLastBuildTime = 0;
+	
+	unsigned long long ulNextReportTime = GetCurrentTime() + SERVER_SNAPSHOT_REPORT_INTERVAL * 1000000ULL;
+	
+	do
+	{
+		unsigned long long ulBuildCost = 0;
+		if (-1 == BuildServerSnapshot(&ulBuildCost))
+		{
+			DisplayErrorMessage("BuildServerSnapshot() Failed");
+			exit(EXIT_FAILURE);
+		}
+		
+		unsigned long long ulCurrentTime = GetCurrentTime();
+		
+		++ulRebuildCounts;
+		ulTotalBuildCost += ulBuildCost;
+		if (ulBuildCost > ulMaxBuildCost)
+			ulMaxBuildCost = ulBuildCost;
+		
+		if (0 != ulLastBuildTime && ulCurrentTime - ulLastBuildTime > ulMaxSnapshotAge)
+			ulMaxSnapshotAge = ulCurrentTime - ulLastBuildTime;
+		
+		ulLastBuildTime = ulCurrentTime;
+		
+		if (ulCurrentTime >= ulNextReportTime)
+		{
+			printf("AGGREGATOR, Snapshot : %llu rebuilds, build cost %llu us on average and %llu us at most, age %llu us at most, %zu retired\n",
+				ulRebuildCounts, ulTotalBuildCost / ulRebuildCounts, ulMaxBuildCost, ulMaxSnapshotAge, g_ServerSnapshot.GetRetiredCounts());
 			
-			return 0;
+			ulRebuildCounts = 0;
+			ulTotalBuildCost = 0;
+			ulMaxBuildCost = 0;
+			ulMaxSnapshotAge = 0;
+			ulNextReportTime = ulCurrentTime + SERVER_SNAPSHOT_REPORT_INTERVAL * 1000000ULL;
 		}
-		// Data senction has completely been recevied
-		else
+		
+		nanosleep(&stInterval, NULL);
+	} while (1);
+}
+
+// Compare two servers in a snapshot (The less busy, the earlier)
+static bool CompareSnapshotEntry(const Snapshot_Entry& stEntry1_, const Snapshot_Entry& stEntry2_)
+{
+	return stEntry1_.iScore < stEntry2_.iScore;
+}
+
+// Rank every running server of all the threads and publish the least busy ones as a new snapshot
+// The servers are read in the same way as GetPowerOfDChoicesServer() reads them, so no thread is stopped while the snapshot is built.
+// The membership versions are read first. If a server joins or leaves during the scan, the snapshot looks older than that change to readers.
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::BuildServerSnapshot(unsigned long long* pBuildCost_)
+{
+	unsigned long long ulStartTime = GetCurrentTime();
+	
+	unsigned long long ulMembershipVersion = 0;
+	for (int i = 0; i < MAX_THREAD_COUNTS; ++i)
+		ulMembershipVersion += g_stServerShards[i].uiMembershipVersion.load(std::memory_order_acquire);
+	
+	m_vecSnapshotCandidates.clear();
+	for (int i = 0; i < MAX_THREAD_COUNTS; ++i)
+	{
+		int iServerCounts = (int)g_stServerShards[i].uiServerCounts.load(std::memory_order_acquire);
+		for (int j = 0; j < iServerCounts; ++j)
 		{
-			// Add a new Server
-			if (SPT_PORT == iPacketType)
-				AddNewServer(pServerInfo_, szRecvBuff);
-			//Update Server Status
-			else if (SPT_STATUS == iPacketType)
-				UpdateServerStatus(pServerInfo_, szRecvBuff);
+			int iListIndex = j / MAX_SERVER_NUMS_PER_ARRAY;
+			int iArrayIndex = j % MAX_SERVER_NUMS_PER_ARRAY;
 			
-			RemoveTCPRecvQueuePacket(iSockFD, pInCompletePacket_);
-			return 0;
+			Server_Record stRecord;
+			if (-1 == ReadServerRecord(i, iListIndex, iArrayIndex, &stRecord))
+				continue;
+			
+			// The server is not ready or disconnected
+			long int iClientCounts = GetClientCounts(i, iListIndex, iArrayIndex);
+			if (0 > iClientCounts)
+				continue;
+			
+			// A new server has taken the slot since the record was read
+			if (stRecord.uiGeneration != GetServerChunk(i, iListIndex)->uiGeneration[iArrayIndex].load(std::memory_order_relaxed))
+				continue;
+			
+			long int iInFlightCounts = GetInFlightCounts(GetAssignmentInfo(i, iListIndex, iArrayIndex));
+			unsigned long ulLatency = GetServerLatency(i, iListIndex, iArrayIndex);
+			unsigned int uiRampPermille = GetServerRampPermille(i, iListIndex, iArrayIndex);
+			
+			Snapshot_Entry stEntry;
+			stEntry.iThreadIndex = i;
+			stEntry.iSlotIndex = j;
+			stEntry.uiGeneration = stRecord.uiGeneration;
+			stEntry.uiIP = stRecord.uiIP;
+			stEntry.usPort = stRecord.usPort;
+			stEntry.iScore = GetServerScore(GetServerLoad(i, iListIndex, iArrayIndex, iClientCounts, iInFlightCounts), stRecord.usCapacity, ulLatency, uiRampPermille);
+			
+			// How much busier the server gets with one more client, so readers can account for the clients assigned after the snapshot was built
+			long int iNextScore = GetServerScore(GetServerLoad(i, iListIndex, iArrayIndex, iClientCounts, iInFlightCounts + 1), stRecord.usCapacity, ulLatency, uiRampPermille);
+			stEntry.iScorePerClient = std::max(1L, iNextScore - stEntry.iScore);
+			stEntry.iInFlightCounts = iInFlightCounts;
+			
+			m_vecSnapshotCandidates.push_back(stEntry);
+		}
+	}
+	
+	size_t uiEntryCounts = std::min(m_vecSnapshotCandidates.size(), (size_t)SERVER_SNAPSHOT_SIZE);
+	std::partial_sort(m_vecSnapshotCandidates.begin(), m_vecSnapshotCandidates.begin() + uiEntryCounts, m_vecSnapshotCandidates.end(), CompareSnapshotEntry);
+	
+	Server_Snapshot* pSnapshot = g_ServerSnapshot.Allocate();
+	if (NULL == pSnapshot)
+		return -1;
+	
+	pSnapshot->ulSequence = ++m_ulSnapshotSequence;
+	pSnapshot->ulMembershipVersion = ulMembershipVersion;
+	pSnapshot->iEntryCounts = (int)uiEntryCounts;
+	for (size_t i = 0; i < uiEntryCounts; ++i)
+		pSnapshot->stEntries[i] = m_vecSnapshotCandidates[i];
+	
+	pSnapshot->ulBuildTime = GetCurrentTime();
+	pSnapshot->ulBuildCost = pSnapshot->ulBuildTime - ulStartTime;
+	*pBuildCost_ = pSnapshot->ulBuildCost;
+	
+	g_ServerSnapshot.Publish(pSnapshot);
+	
+	return 0;
+}
+
+// Choose the least busy server from the snapshot and fill the buffer with its IP and Port in the same way as GetServerAddr()
+// Return -1 if the snapshot is not used or cannot be trusted (The caller chooses a server in the usual way)
+// Return 0 on Success
+int CLoadBalancer::GetSnapshotServer(unsigned char* pBuff_, int* pThreadIndex_, int* pListIndex_, int* pArrIndex_)
+{
+	if (!m_bUseSnapshot)
+		return -1;
+	
+	static_assert(MAX_THREAD_COUNTS <= MAX_SNAPSHOT_READER_COUNTS, "Every thread must have its own reader index");
+	
+	const Server_Snapshot* pSnapshot = g_ServerSnapshot.Acquire(m_iThreadIndex);
+	int iResult = ChooseSnapshotServer(pSnapshot, pBuff_, pThreadIndex_, pListIndex_, pArrIndex_);
+	g_ServerSnapshot.Release(m_iThreadIndex);
+	
+	return iResult;
+}
+
+// Choose the least busy server from a snapshot that this thread has acquired
+// Each server is ranked by its score in the snapshot plus the clients that every thread has assigned to it since the snapshot was built.
+// Those clients are read from the assignment counts of the server itself, so threads do not keep sending clients to the same server until the next snapshot.
+// Return -1 if there is no snapshot, it is older than a change in membership or MAX_SERVER_SNAPSHOT_AGE, or the chosen server has left
+// Return 0 on Success
+int CLoadBalancer::ChooseSnapshotServer(const Server_Snapshot* pSnapshot_, unsigned char* pBuff_, int* pThreadIndex_, int* pListIndex_, int* pArrIndex_)
+{
+	if (NULL == pSnapshot_ || 0 == pSnapshot_->iEntryCounts)
+		return -1;
+	
+	// A server has joined or left since the snapshot was built
+	unsigned long long ulMembershipVersion = 0;
+	for (int i = 0; i < MAX_THREAD_COUNTS; ++i)
+		ulMembershipVersion += g_stServerShards[i].uiMembershipVersion.load(std::memory_order_acquire);
+	
+	if (pSnapshot_->ulMembershipVersion != ulMembershipVersion)
+		return -1;
+	
+	// The aggregator thread may have been stopped, and the scores may be far from the current status
+	unsigned long long ulCurrentTime = GetCurrentTime();
+	if (ulCurrentTime > pSnapshot_->ulBuildTime && ulCurrentTime - pSnapshot_->ulBuildTime > MAX_SERVER_SNAPSHOT_AGE)
+		return -1;
+	
+	int iBestIndex = -1;
+	long int iMinScore = LONG_MAX;
+	for (int i = 0; i < pSnapshot_->iEntryCounts; ++i)
+	{
+		const Snapshot_Entry& stEntry = pSnapshot_->stEntries[i];
+		
+		// After a status update of the server, its new clients are in its own count, which the snapshot does not know yet
+		long int iAssignedCounts = GetInFlightCounts(GetAssignmentInfo(stEntry.iThreadIndex, stEntry.iSlotIndex / MAX_SERVER_NUMS_PER_ARRAY, stEntry.iSlotIndex % MAX_SERVER_NUMS_PER_ARRAY)) - stEntry.iInFlightCounts;
+		if (0 > iAssignedCounts)
+			iAssignedCounts = 0;
+		
+		long int iScore = LONG_MAX;
+		if (iAssignedCounts <= (LONG_MAX - stEntry.iScore) / stEntry.iScorePerClient)
+			iScore = stEntry.iScore + iAssignedCounts * stEntry.iScorePerClient;
+		
+		if (iScore < iMinScore)
+		{
+			iMinScore = iScore;
+			iBestIndex = i;
 		}
 	}
 	
+	if (-1 == iBestIndex)
+		return -1;
+	
+	const Snapshot_Entry& stBestEntry = pSnapshot_->stEntries[iBestIndex];
+	
+	// The server has left or its slot has been taken by a new server since the snapshot was built
+	Server_Location stLocation;
+	stLocation.iThreadIndex = stBestEntry.iThreadIndex;
+	stLocation.iSlotIndex = stBestEntry.iSlotIndex;
+	stLocation.uiGeneration = stBestEntry.uiGeneration;
+	if (!IsServerAlive(&stLocation))
+		return -1;
+	
+	unsigned short* pPort = (unsigned short*)pBuff_;
+	*pPort = stBestEntry.usPort;
+	
+	in_addr_t* pIP = (in_addr_t*)(pPort + 1);
+	*pIP = stBestEntry.uiIP;
+	
+	*pThreadIndex_ = stBestEntry.iThreadIndex;
+	*pListIndex_ = stBestEntry.iSlotIndex / MAX_SERVER_NUMS_PER_ARRAY;
+	*pArrIndex_ = stBestEntry.iSlotIndex % MAX_SERVER_NUMS_PER_ARRAY;
+	
+	return 0;
+}
+
+// Send a Ping packet to a server to measure its latency
+// Only one Ping packet is outstanding at a time.
+// A server that does not answer its Ping packet looks at least as slow as the time that has passed since the packet was sent.
+// However, a server that has never answered is considered not to support Ping packets, and its latency is left unknown.
+void CLoadBalancer::SendPingPacket(Connection* pConnection_, unsigned long long ulCurrentTime_)
+{
+	Server_Data_Access_Info* pServerInfo = &(pConnection_->stServerInfo);
+	if (0 != pServerInfo->ulPingTime)
+	{
+		unsigned long ulElapsedTime = (unsigned long)(ulCurrentTime_ - pServerInfo->ulPingTime);
+		if (0 != pServerInfo->ulLatency && ulElapsedTime > pServerInfo->ulLatency)
+			PublishServerLatency(pServerInfo->iListIndex, pServerInfo->iArrayIndex, ulElapsedTime);
+		
+		return;
+	}
+	
+	// A Ping packet must not be mixed with a partial packet in the send queue
+	int iSockFD = pConnection_->iSockFD;
+	if (NULL != pConnection_->pSendPacket)
+		return;
+	
+	const size_t uiSendBuffLength = PACKET_TYPE_LENGTH + SERVER_PING_PACKET_DATA_LENGTH;
+	unsigned char szSendBuff[uiSendBuffLength];
+	*((unsigned short*)szSendBuff) = SERVER_PING_PACKET_TYPE;
+	memcpy(szSendBuff + PACKET_TYPE_LENGTH, &ulCurrentTime_, sizeof(ulCurrentTime_));
+	
+	// A failure is not fatal. If the server is disconnected, epoll reports it.
+	ssize_t iResult = send(iSockFD, szSendBuff, uiSendBuffLength, MSG_NOSIGNAL);
+	if (-1 == iResult)
+	{
+		if (EAGAIN != errno && EWOULDBLOCK != errno)
+			return;
+		
+		iResult = 0;
+	}
+	
+	if ((size_t)iResult < uiSendBuffLength)
+	{
+		if (-1 == AddTCPPacketToSendQueue(pConnection_, szSendBuff + iResult, uiSendBuffLength - iResult))
+			return;
+		
+		if (-1 == Epoll_CTL_Wrapper(EPOLL_CTL_MOD, iSockFD, EPOLLIN | EPOLLRDHUP | EPOLLOUT))
+			return;
+	}
+	
+	pServerInfo->ulPingTime = ulCurrentTime_;
+}
+
+// Update the latency of a server with the round trip time of the Ping packet that the server has answered
+void CLoadBalancer::UpdateServerLatency(Server_Data_Access_Info* pServerInfo_, unsigned char* pRecvBuff_)
+{
+	int iListIndex = pServerInfo_->iListIndex;
+	int iArrIndex = pServerInfo_->iArrayIndex;
+	
+	if (-1 == iListIndex || -1 == iArrIndex)
+	{
+		DisplayErrorMessage("Unexpected Server Indices");
+		return;
+	}
+	
+	unsigned long long ulPingTime = 0;
+	memcpy(&ulPingTime, pRecvBuff_, sizeof(ulPingTime));
 	
-	RemoveTCPRecvQueuePacket(iSockFD, pInCompletePacket_);
+	// Not the Ping packet that this thread is waiting for
+	if (0 == pServerInfo_->ulPingTime || ulPingTime != pServerInfo_->ulPingTime)
+		return;
 	
-	return 0;
+	pServerInfo_->ulPingTime = 0;
+	
+	// The round trip time is at least 1 microsecond so that 0 always means unknown
+	unsigned long ulRoundTripTime = (unsigned long)(GetCurrentTime() - ulPingTime);
+	if (0 == ulRoundTripTime)
+		ulRoundTripTime = 1;
+	
+	// The first round trip time becomes the latency as it is
+	unsigned long ulLatency = pServerInfo_->ulLatency;
+	if (0 == ulLatency)
+		ulLatency = ulRoundTripTime;
+	else
+		ulLatency = (unsigned long)((long int)ulLatency + ((long int)ulRoundTripTime - (long int)ulLatency) / SERVER_LATENCY_EWMA_WEIGHT);
+	
+	if (0 == ulLatency)
+		ulLatency = 1;
+	
+	pServerInfo_->ulLatency = ulLatency;
+	PublishServerLatency(iListIndex, iArrIndex, ulLatency);
 }
 
-// Receive data from a server when there is no previous data partially received (TCP)
-// Return -1 on Failure
-// Return 0 on Success
-int CLoadBalancer::RecvServerPacket(Server_Data_Access_Info* pServerInfo_)
+// Publish the latency of a server so that other threads can read it
+// The position of the server in the heap changes with its latency when SSP_LEAST_LATENCY is used.
+void CLoadBalancer::PublishServerLatency(int iListIndex_, int iArrIndex_, unsigned long ulLatency_)
 {
-	int iSockFD = pServerInfo_->iSocketFD;
-	unsigned char szHeader[PACKET_TYPE_LENGTH] = { 0, };
-	// Receive Packeet Header first
-				
-	ssize_t iResult = recv(iSockFD, szHeader, PACKET_TYPE_LENGTH, 0);
-	if (-1 == iResult)
-	{
-		if (EAGAIN == errno || EWOULDBLOCK == errno)
-			return 0;
-		
-		perror("recv() header");
+	Server_Chunk* pChunk = GetServerChunk(m_iThreadIndex, iListIndex_);
+	if (ulLatency_ == pChunk->ulLatency[iArrIndex_].load(std::memory_order_relaxed))
+		return;
+	
+	pChunk->ulLatency[iArrIndex_].store(ulLatency_, std::memory_order_relaxed);
+	
+	if (SSP_LEAST_LATENCY != m_stOptions.iSelectionPolicy)
+		return;
+	
+	// The server is not ready or disconnected
+	long int iClientCounts = GetClientCounts(m_iThreadIndex, iListIndex_, iArrIndex_);
+	if (0 > iClientCounts)
+		return;
+	
+	long int iInFlightCounts = GetInFlightCounts(GetAssignmentInfo(m_iThreadIndex, iListIndex_, iArrIndex_));
+	long int iLoad = GetServerLoad(m_iThreadIndex, iListIndex_, iArrIndex_, iClientCounts, iInFlightCounts);
+	
+	int iSlotIndex = iListIndex_ * MAX_SERVER_NUMS_PER_ARRAY + iArrIndex_;
+	SetServerKey(iSlotIndex, GetServerScore(iLoad, GetServerCapacity(m_iThreadIndex, iListIndex_, iArrIndex_), ulLatency_, GetServerRampPermille(m_iThreadIndex, iListIndex_, iArrIndex_)));
+	PublishBestServer();
+}
+
+// Hand some servers of this thread off to the thread with the fewest servers if this thread has too many of them
+// Moving half of the difference leaves both threads with about the same number of servers,
+// but only a few servers are moved at a time so that threads comparing their numbers at the same time do not overshoot.
+// Return the number of milliseconds until the next time (-1 if rebalancing is disabled or this thread has no server)
+int CLoadBalancer::RebalanceServers()
+{
+	if (0 == m_stOptions.iRebalanceThreshold || 0 == g_stServerShards[m_iThreadIndex].iConnectedServerCounts.load(std::memory_order_relaxed))
 		return -1;
-	}
 	
-	// There are more data to receive later
-	// For now, store the data that has been received so far 
-	if (iResult < PACKET_TYPE_LENGTH)
-	{
-		AddTCPPacketToRecvQueue(iSockFD, SPT_MAX, PACKET_TYPE_LENGTH, iResult, szHeader);
-		return 0;
-	}
-		
-	// Receive packet data section
-	int iPacketType = GetPacketType(szHeader);
-	if (SPT_MAX == iPacketType)
-		return DisconnectHandler(iSockFD);
+	unsigned long long ulCurrentTime = GetCurrentTime();
+	if (ulCurrentTime < m_ulNextRebalanceTime)
+		return (int)((m_ulNextRebalanceTime - ulCurrentTime + 999) / 1000);
 	
-	const size_t uiDataLength = GetPacketDataLength(iPacketType);
-	unsigned char szRecvBuff[uiDataLength];
+	m_ulNextRebalanceTime = ulCurrentTime + SHARD_REBALANCE_INTERVAL * 1000ULL;
 	
-	iResult = recv(iSockFD, szRecvBuff, uiDataLength, 0);
-	if (-1 == iResult)
+	// Find the thread with the fewest servers
+	// The numbers of other threads may be changing, but they are only used to decide whether to move servers.
+	long int iServerCounts = g_stServerShards[m_iThreadIndex].iConnectedServerCounts.load(std::memory_order_relaxed);
+	long int iTargetServerCounts = iServerCounts;
+	int iTargetThreadIndex = -1;
+	for (int i = 0; i < MAX_THREAD_COUNTS; ++i)
 	{
-		if (EAGAIN == errno || EWOULDBLOCK == errno)
-			iResult = 0;
-		else
+		long int iCounts = g_stServerShards[i].iConnectedServerCounts.load(std::memory_order_relaxed);
+		if (i != m_iThreadIndex && iCounts < iTargetServerCounts)
 		{
-			perror("recv() data");
-			return -1;	
+			iTargetServerCounts = iCounts;
+			iTargetThreadIndex = i;
 		}
-		
-	}
-								
-	// There are more data to receive later
-	// For now, store the data that has been received so far 
-	if ((size_t)iResult < uiDataLength)
-	{
-		AddTCPPacketToRecvQueue(iSockFD, iPacketType, uiDataLength, iResult, szRecvBuff);
-		return 0;
 	}
 	
+	if (-1 == iTargetThreadIndex || iServerCounts - iTargetServerCounts <= m_stOptions.iRebalanceThreshold)
+		return SHARD_REBALANCE_INTERVAL;
 	
-	// A whole packet has completely been received
-	// Add a new Server
-	if (SPT_PORT == iPacketType)
-		AddNewServer(pServerInfo_, szRecvBuff);
-	//Update Server Status
-	else if (SPT_STATUS == iPacketType)
-		UpdateServerStatus(pServerInfo_, szRecvBuff);
-			
-	return 0;
-}
-
-// Receive data from a client (TCP)
-// Return 0 on Failure
-// Return 1 on Success
-int CLoadBalancer::ClientTCPPacketHandler(int iSockFD_)
-{
-	// It is possible to receive fewer bytes.
-	// Check whether there is any data previously received.
-	// If so, combine with newly received data with that previous one.
-	std::unordered_map<int, InComplete_Packet*>::iterator mitor = m_mapTCPPacketRecvQueue.find(iSockFD_);
-
-	// There are some data previously received
-	if (m_mapTCPPacketRecvQueue.end() != mitor)
+	// The target thread may not have taken over the servers handed off last time yet
+	Server_Handoff_Queue* pQueue = &(g_stServerHandoffQueues[iTargetThreadIndex][m_iThreadIndex]);
+	long int iFreeCounts = SERVER_HANDOFF_QUEUE_SIZE - (long int)(pQueue->ulTail.load(std::memory_order_relaxed) - pQueue->ulHead.load(std::memory_order_acquire));
+	long int iHandoffCounts = std::min(std::min((iServerCounts - iTargetServerCounts) / 2, (long int)MAX_SERVER_HANDOFFS_PER_REBALANCE), iFreeCounts);
+	
+	// The servers are chosen first, and then handed off
+	Connection* pServers[MAX_SERVER_HANDOFFS_PER_REBALANCE];
+	int iCounts = 0;
+	for (size_t i = 0; i < m_vecConnections.size() && iCounts < iHandoffCounts; ++i)
 	{
-		InComplete_Packet* pInCompletePacket = mitor->second;
-		return RecvClientPacketWithPreData(iSockFD_, pInCompletePacket);			
+		Connection* pConnection = m_vecConnections[i];
+		if (NULL != pConnection && CT_SERVER == pConnection->iType && CanHandOffServer(pConnection))
+			pServers[iCounts++] = pConnection;
 	}
-	// No previous data
-	else
+	
+	// A failure is not fatal. The server stays in this thread.
+	for (int i = 0; i < iCounts; ++i)
 	{
-		return RecvClientPacket(iSockFD_);
+		if (-1 == HandOffServer(pServers[i], iTargetThreadIndex))
+			break;
 	}
-		
-	return 0;
+	
+	return SHARD_REBALANCE_INTERVAL;
 }
 
-// Receive data from a client and add it to the previous data partially received (TCP)
-// Return 0 on Failure
-// Return 1 on Success
-int CLoadBalancer::RecvClientPacketWithPreData(int iSockFD_, InComplete_Packet* pInCompletePacket_)
+// Print how many partial and queued packets this thread keeps every PENDING_PACKET_REPORT_INTERVAL seconds
+// Nothing is printed while this thread keeps no packet, so an idle thread does not wake up for it.
+// Return the time until the next report in milliseconds (-1 if there is nothing to report)
+int CLoadBalancer::ReportPendingPackets()
 {
-	size_t uiRestBytes = pInCompletePacket_->uiBufferLen - pInCompletePacket_->uiOffset;
-	ssize_t iResult = recv(iSockFD_, pInCompletePacket_->pBuffer + pInCompletePacket_->uiOffset, uiRestBytes, 0);
-	if (-1 == iResult)
+	unsigned long long ulAllocationCounts = m_InCompletePacketPool.GetAllocationCounts();
+	unsigned long long ulUDPResponseCounts = m_UDPResponseQueue.GetQueuedCounts() + m_UDPResponseQueue.GetDroppedCounts();
+	if (ulAllocationCounts == m_ulReportedPacketAllocationCounts && 0 == m_InCompletePacketPool.GetInUseCounts() &&
+		ulUDPResponseCounts == m_ulReportedUDPResponseCounts && m_UDPResponseQueue.IsEmpty())
 	{
-		if (EAGAIN == errno || EWOULDBLOCK == errno)
-			return 0;
-		
-		perror("recv");
+		m_ulNextPendingPacketReportTime = 0;
 		return -1;
 	}
-	else if ((size_t)iResult < uiRestBytes)
-	{
-		// There are more data to receive later
-		// For now, store the data that has been received so far 
-		pInCompletePacket_->uiOffset += iResult; 
-		return 0;
-	}
 	
-	// Send a response with the best available server's IP and Port back to the client.
-	if (-1 == SendResponseToClient(iSockFD_, pInCompletePacket_->pBuffer))
+	// This thread has just started keeping packets, so the first report covers a whole interval
+	unsigned long long ulCurrentTime = GetCurrentTime();
+	if (0 == m_ulNextPendingPacketReportTime)
+		m_ulNextPendingPacketReportTime = ulCurrentTime + PENDING_PACKET_REPORT_INTERVAL * 1000000ULL;
+	
+	if (ulCurrentTime < m_ulNextPendingPacketReportTime)
+		return (int)((m_ulNextPendingPacketReportTime - ulCurrentTime + 999) / 1000);
+	
+	printf("THREAD %d, Packet pool : %zu partial TCP packets (%zu at most), %zu slabs, %llu allocations, UDP backlog : %zu responses (%zu at most), %llu queued, %llu dropped, paused %llu times\n",
+		m_iThreadIndex, m_InCompletePacketPool.GetInUseCounts(), m_InCompletePacketPool.GetPeakInUseCounts(), m_InCompletePacketPool.GetSlabCounts(), ulAllocationCounts,
+		m_UDPResponseQueue.GetCounts(), m_UDPResponseQueue.GetPeakCounts(), m_UDPResponseQueue.GetQueuedCounts(), m_UDPResponseQueue.GetDroppedCounts(), m_ulUDPReadingPauseCounts);
+	
+	m_InCompletePacketPool.ResetPeakInUseCounts();
+	m_UDPResponseQueue.ResetPeakCounts();
+	m_ulReportedPacketAllocationCounts = ulAllocationCounts;
+	m_ulReportedUDPResponseCounts = ulUDPResponseCounts;
+	m_ulNextPendingPacketReportTime = ulCurrentTime + PENDING_PACKET_REPORT_INTERVAL * 1000000ULL;
+	
+	return PENDING_PACKET_REPORT_INTERVAL * 1000;
+}
+
+// Check if a server can be handed off to another thread
+// A partial packet in a queue of this thread would be lost, so only a registered server without one is handed off.
+bool CLoadBalancer::CanHandOffServer(const Connection* pConnection_)
+{
+	if (-1 == pConnection_->stServerInfo.iListIndex)
+		return false;
+	
+	return NULL == pConnection_->pRecvPacket && NULL == pConnection_->pSendPacket;
+}
+
+// Hand a server off to another thread
+// The connection, the status, and the latency of the server move to the target thread, which gives the server a slot of its own.
+// Clients assigned to the server since its last status update are settled here, and the target thread counts them again with the next status update.
+// Return -1 on Failure (The server stays in this thread)
+// Return 0 on Success
+int CLoadBalancer::HandOffServer(Connection* pConnection_, int iTargetThreadIndex_)
+{
+	Server_Data_Access_Info* pServerInfo = &(pConnection_->stServerInfo);
+	int iSockFD = pConnection_->iSockFD;
+	int iListIndex = pServerInfo->iListIndex;
+	int iArrIndex = pServerInfo->iArrayIndex;
+	
+	// Stop watching the socket first
+	// Packets that arrive in the meantime stay in the socket buffer until the target thread watches the socket.
+	// With io_uring, a server connection is only polled, so no data has been taken out of the socket buffer.
+	if (-1 == StopWatching(pConnection_))
 		return -1;
 	
-	RemoveTCPRecvQueuePacket(iSockFD_, pInCompletePacket_);
+	// Only this thread pushes on the queue, so the tail is read without ordering
+	Server_Handoff_Queue* pQueue = &(g_stServerHandoffQueues[iTargetThreadIndex_][m_iThreadIndex]);
+	unsigned long ulTail = pQueue->ulTail.load(std::memory_order_relaxed);
+	Server_Handoff* pHandoff = &(pQueue->stHandoffs[ulTail & (SERVER_HANDOFF_QUEUE_SIZE - 1)]);
+	
+	const Server_Chunk* pChunk = GetServerChunk(m_iThreadIndex, iListIndex);
+	pHandoff->iSocketFD = iSockFD;
+	pHandoff->uiIP = pServerInfo->uiIP;
+	pHandoff->usPort = pChunk->usPort[iArrIndex].load(std::memory_order_relaxed);
+	pHandoff->usCapacity = pChunk->usCapacity[iArrIndex].load(std::memory_order_relaxed);
+	pHandoff->iClientCounts = pChunk->iClientCounts[iArrIndex].load(std::memory_order_relaxed);
+	for (int j = 0; j < SM_MAX; ++j)
+		pHandoff->uiMetrics[j] = pChunk->uiMetrics[j][iArrIndex].load(std::memory_order_relaxed);
+	
+	pHandoff->ulReadyTime = pChunk->ulReadyTime[iArrIndex].load(std::memory_order_relaxed);
+	pHandoff->ulPingTime = pServerInfo->ulPingTime;
+	pHandoff->ulLatency = pServerInfo->ulLatency;
+	
+	// The server leaves this thread before it joins the target thread, so no thread ever finds it twice
+	UnregisterServer(pServerInfo);
+	CloseConnection(pConnection_);
+	
+	pQueue->ulTail.store(ulTail + 1, std::memory_order_release);
+	
+	// Wake the target thread up
+	// A write fails only if the counter would overflow, and then the target thread has not read the previous writes yet.
+	unsigned long long ulValue = 1;
+	if (-1 == write(g_iHandoffEventFDs[iTargetThreadIndex_], &ulValue, sizeof(ulValue)) && EAGAIN != errno)
+		perror("write() on eventfd");
 	
 	return 0;
 }
 
-// Receive data from a client when there is no previous data partially received (TCP)
-// Return 0 on Failure
-// Return 1 on Success
-int CLoadBalancer::RecvClientPacket(int iSockFD_)
+// Take over the servers that other threads have handed off to this thread
+// The eventfd is reset before the queues are read, so servers handed off in the meantime wake this thread up again.
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::TakeOverServers()
 {
-	unsigned char szRecvBuff[REQUEST_FROM_CLIENT_LENGTH] = { 0, };
-	// Receive Packeet Header first
-	ssize_t iResult = recv(iSockFD_, szRecvBuff, REQUEST_FROM_CLIENT_LENGTH, 0);
-	if (-1 == iResult)
+	unsigned long long ulValue = 0;
+	if (-1 == read(g_iHandoffEventFDs[m_iThreadIndex], &ulValue, sizeof(ulValue)))
 	{
 		if (EAGAIN == errno || EWOULDBLOCK == errno)
 			return 0;
 		
-		perror("recv");
+		perror("read() on eventfd");
 		return -1;
 	}
-	else if (iResult < REQUEST_FROM_CLIENT_LENGTH)
-	{
-		// There are more data to receive later
-		// For now, store the data that has been received so far 
-		AddTCPPacketToRecvQueue(iSockFD_, -1, REQUEST_FROM_CLIENT_LENGTH, iResult, szRecvBuff);
-		return 0;
-	}
-														
-	
-	// Send a response with the best available server's IP and Port back to the client.
-	if (-1 == SendResponseToClient(iSockFD_, szRecvBuff))
-		return -1;
 	
-	return 0;
-}
-
-
-// Receive a UDP packet from a client 
-// Return 0 on Failure
-// Return 1 on Success
-int CLoadBalancer::ClientUDPPacketHandler(int iSockFD_)
-{
-	// Receive a UDP Request for a Client
-	// Mulitple clients send a request to this UDP socket, so there could be multiple packets
-	// Read All of them and send a response to each client
-	unsigned char szRecvBuff[REQUEST_FROM_CLIENT_LENGTH] = { 0, };
-	int iCount = 0;
-	do
+	for (int i = 0; i < MAX_THREAD_COUNTS; ++i)
 	{
-		struct sockaddr_in stSockAddr;
-		memset(&stSockAddr, 0, sizeof(stSockAddr));
-		socklen_t uiAddrLen = sizeof(stSockAddr);
-						
-		ssize_t iReadBytes = recvfrom(m_iUDPSockForClients, szRecvBuff, REQUEST_FROM_CLIENT_LENGTH, 0, (struct sockaddr *)&stSockAddr, &uiAddrLen);
-		if (-1 == iReadBytes)
-		{
-			if (EAGAIN == errno || EWOULDBLOCK == errno)
-				break;
-			
-			perror("recvfrom");
-			return -1;
-		}
-		else if (0 == iReadBytes)
+		if (i == m_iThreadIndex)
 			continue;
 		
-		// Build a Response and Send it back to the Client
-		unsigned char szSendBuff[RESPONSE_TO_CLIENT_LENGTH] = { 0, };
-		BuildResponse(szRecvBuff, szSendBuff);
-		ssize_t iSendBytes = sendto(m_iUDPSockForClients, szSendBuff, RESPONSE_TO_CLIENT_LENGTH, 0, (struct sockaddr *)&stSockAddr, uiAddrLen);
-		if (-1 == iSendBytes)
-		{
-			if (EAGAIN == errno || EWOULDBLOCK == errno)
-				iSendBytes = 0;
-			else
-			{
-				perror("sendto()");
-				return -1;
-			}
-		}
+		// Only this thread pops from the queue, so the head is read without ordering
+		Server_Handoff_Queue* pQueue = &(g_stServerHandoffQueues[m_iThreadIndex][i]);
+		unsigned long ulHead = pQueue->ulHead.load(std::memory_order_relaxed);
+		unsigned long ulTail = pQueue->ulTail.load(std::memory_order_acquire);
+		if (ulHead == ulTail)
+			continue;
 		
-		if (0 == iSendBytes)
-		{
-			Queued_UDP_Packet* pUDPPacket = new Queued_UDP_Packet;
-			pUDPPacket->pBuffer = new unsigned char[RESPONSE_TO_CLIENT_LENGTH];
-			memcpy(pUDPPacket->pBuffer, szSendBuff, RESPONSE_TO_CLIENT_LENGTH);
-			memcpy(&(pUDPPacket->stSockAddr), &stSockAddr, sizeof(pUDPPacket->stSockAddr));
-			pUDPPacket->uiAddrLen = uiAddrLen;
-			pUDPPacket->uiBufferLen = RESPONSE_TO_CLIENT_LENGTH;
-							
-			m_listUDPPacketQueue.push_back(pUDPPacket);
-			if (-1 == Epoll_CTL_Wrapper(EPOLL_CTL_MOD, iSockFD_, EPOLLIN | EPOLLOUT))
-				return -1;
-		}
-					
-	} while (++iCount < MAX_UDP_PACKET_LOOPING_COUNT);
+		for (; ulHead != ulTail; ++ulHead)
+			TakeOverServer(&(pQueue->stHandoffs[ulHead & (SERVER_HANDOFF_QUEUE_SIZE - 1)]));
+		
+		pQueue->ulHead.store(ulHead, std::memory_order_release);
+	}
 	
 	return 0;
 }
 
-// Update the status of a server with the new value transferred from that server
-void CLoadBalancer::UpdateServerStatus(Server_Data_Access_Info* pServerInfo_, unsigned char* pRecvBuff_)
+// Take over a server handed off to this thread
+// The server gets a new slot with the status and the latency that it had in the source thread.
+// If the socket cannot be watched, the connection is closed, and the server is expected to connect again.
+void CLoadBalancer::TakeOverServer(const Server_Handoff* pHandoff_)
 {
-	int iListIndex = pServerInfo_->iListIndex;
-	int iArrIndex = pServerInfo_->iArrayIndex;
-	
-	if (-1 == iListIndex || -1 == iArrIndex)
+	int iSockFD = pHandoff_->iSocketFD;
+	Connection* pConnection = OpenConnection(iSockFD, CT_SERVER);
+	if (-1 == Epoll_CTL_Wrapper(EPOLL_CTL_ADD, iSockFD, EPOLLIN | EPOLLRDHUP))
 	{
-		DisplayErrorMessage("Unexpected Server Indices");
+		CloseConnection(pConnection);
+		close(iSockFD);
 		return;
 	}
-							
-
-	int i = 0;
-	Simple_List<long int*>* pClientCountsList = g_pClientCountsList[m_iThreadIndex];
 	
-	while (i < iListIndex)
+	struct Server_Data_Access_Info* pServerSocketInfo = &(pConnection->stServerInfo);
+	pServerSocketInfo->uiIP = pHandoff_->uiIP;
+	pServerSocketInfo->ulPingTime = pHandoff_->ulPingTime;
+	pServerSocketInfo->ulLatency = pHandoff_->ulLatency;
+	
+	// The server cannot be kept without a slot, so it connects again to a thread
+	if (-1 == RegisterServer(pServerSocketInfo, pHandoff_->usPort, pHandoff_->usCapacity))
 	{
-		pClientCountsList = pClientCountsList->pNext;
-		++i;
+		DisconnectHandler(pConnection);
+		return;
 	}
 	
-	long int* pData = (long int*)(pRecvBuff_);
-	long int iNewClinetCounts = *(pData);
+	int iListIndex = pServerSocketInfo->iListIndex;
+	int iArrIndex = pServerSocketInfo->iArrayIndex;
+	Server_Chunk* pChunk = GetServerChunk(m_iThreadIndex, iListIndex);
+	for (int j = SM_REQUESTS; j < SM_MAX; ++j)
+		pChunk->uiMetrics[j][iArrIndex].store(pHandoff_->uiMetrics[j], std::memory_order_relaxed);
+	
+	// The slow-start window goes on from where it was (Every thread uses the same clock)
+	pChunk->ulReadyTime[iArrIndex].store(pHandoff_->ulReadyTime, std::memory_order_relaxed);
+	pChunk->ulLatency[iArrIndex].store(pHandoff_->ulLatency, std::memory_order_relaxed);
+	
+	// The server has not sent its first status update yet
+	long int iClientCounts = pHandoff_->iClientCounts;
+	if (0 > iClientCounts)
+		return;
+	
+	// Same as a status update, except that the slow-start window does not start over
+	UpdateRunningTotals(SERVER_NOT_READY, iClientCounts, pHandoff_->usCapacity);
+	pChunk->iClientCounts[iArrIndex].store(iClientCounts, std::memory_order_release);
+	IncreaseMembershipVersion();
 	
-	pClientCountsList->Data[iArrIndex] = iNewClinetCounts;
+	long int iLoad = GetServerLoad(m_iThreadIndex, iListIndex, iArrIndex, iClientCounts, 0);
+	SetServerKey(iListIndex * MAX_SERVER_NUMS_PER_ARRAY + iArrIndex, GetServerScore(iLoad, pHandoff_->usCapacity, pHandoff_->ulLatency, GetServerRampPermille(m_iThreadIndex, iListIndex, iArrIndex)));
+	PublishBestServer();
+}
+
+// Get the current time in microseconds (Monotonic clock)
+// Only differences between two values are meaningful.
+unsigned long long CLoadBalancer::GetCurrentTime()
+{
+	struct timespec stTime;
+	clock_gettime(CLOCK_MONOTONIC, &stTime);
+	
+	return (unsigned long long)stTime.tv_sec * 1000000ULL + (unsigned long long)stTime.tv_nsec / 1000ULL;
 }
 
 // Get the type of a packet
@@ -1085,6 +3575,12 @@ int CLoadBalancer::GetPacketType(unsigned char* pRecvBuff_)
 		return SPT_STATUS;
 	else if (SERVER_PORT_NUM_PACKET_TYPE == usType)
 		return SPT_PORT;
+	else if (SERVER_PORT_CAPACITY_PACKET_TYPE == usType)
+		return SPT_PORT_CAPACITY;
+	else if (SERVER_PONG_PACKET_TYPE == usType)
+		return SPT_PONG;
+	else if (SERVER_STATUS_METRICS_PACKET_TYPE == usType)
+		return SPT_STATUS_METRICS;
 	else
 		return SPT_MAX;
 }
@@ -1098,103 +3594,186 @@ size_t CLoadBalancer::GetPacketDataLength(int iPacketType_)
 // Allocate memory to store information about the new servers
 // Frequent memory allocation could increase overhead, so memory for MAX_SERVER_NUMS_PER_ARRAY (20) servers are allocated at once.
 // No memory allocation is needed until the number of servers exceeds MAX_SERVER_NUMS_PER_ARRAY value
-void CLoadBalancer::AllocateMemoryForNewServers()
+// Return -1 on Failure (The directory may have grown, but the chunk is not there)
+// Return 0 on Success
+int CLoadBalancer::AllocateMemoryForNewServers()
 {
-	unsigned long uiServerCounts = g_uiServerCounts[m_iThreadIndex];
+	unsigned long uiServerCounts = g_stServerShards[m_iThreadIndex].uiServerCounts.load(std::memory_order_relaxed);
 	int iArrIndex = uiServerCounts % MAX_SERVER_NUMS_PER_ARRAY;
 	int iListIndex = uiServerCounts / MAX_SERVER_NUMS_PER_ARRAY;
 	
+	// Only this thread writes on its directory, so it is read without ordering
+	Server_Chunk** pChunks = g_stServerShards[m_iThreadIndex].pChunks.load(std::memory_order_relaxed);
+	
 	// Allocate memory only when the array is out of space
 	if (0 != iArrIndex)
-		return;
+		return 0;
 	
-	// Allocate Memory
-	Simple_List<long int*>* pNewClientCountsList = new Simple_List<long int*>;
-	pNewClientCountsList->Data = new long int[MAX_SERVER_NUMS_PER_ARRAY];
-	memset(pNewClientCountsList->Data, SERVER_NEVER_CONNECTED, MAX_SERVER_NUMS_PER_ARRAY);
-	pNewClientCountsList->pNext = NULL;
-		
-		
-	Simple_List<Server_Address_Info*>* pNewServerInfoList = new Simple_List<Server_Address_Info*>;
-	pNewServerInfoList->Data = new Server_Address_Info[MAX_SERVER_NUMS_PER_ARRAY];
-	pNewServerInfoList->pNext = NULL;
+	// The chunk has been allocated before, and its slots were given back when their servers left
+	if ((size_t)iListIndex < m_uiChunkDirectoryCapacity && NULL != pChunks[iListIndex])
+		return 0;
 	
-	if (0 == iListIndex)
+	// The directory is out of space, so publish a larger copy
+	// The old directory is never released because other threads may still be reading it.
+	if ((size_t)iListIndex >= m_uiChunkDirectoryCapacity)
 	{
-		g_pClientCountsList[m_iThreadIndex] = pNewClientCountsList;
-		g_pServerInfoList[m_iThreadIndex] = pNewServerInfoList;
-	}
-	else
-	{
-		Simple_List<long int*>* pClientCountsList = g_pClientCountsList[m_iThreadIndex];
-		Simple_List<Server_Address_Info*>* pServerInfoList = g_pServerInfoList[m_iThreadIndex];
+		size_t uiNewCapacity = m_uiChunkDirectoryCapacity * 2;
+		Server_Chunk** pNewChunks = new (std::nothrow) Server_Chunk*[uiNewCapacity]();
+		if (NULL == pNewChunks)
+			return -1;
 		
-		int i = 1;
-		while (i < iListIndex)
-		{
-			pClientCountsList = pClientCountsList->pNext;
-			pServerInfoList = pServerInfoList->pNext;
-			++i;
-		}
+		memcpy(pNewChunks, pChunks, sizeof(Server_Chunk*) * m_uiChunkDirectoryCapacity);
 		
-		pClientCountsList->pNext = pNewClientCountsList;
-		pServerInfoList->pNext = pNewServerInfoList;
+		pChunks = pNewChunks;
+		g_stServerShards[m_iThreadIndex].pChunks.store(pChunks, std::memory_order_release);
+		m_uiChunkDirectoryCapacity = uiNewCapacity;
 	}
+	
+	// Allocate Memory
+	// Other threads read the new element only after the server count that covers it is published with release ordering.
+	Server_Chunk* pChunk = AllocateServerChunk();
+	if (NULL == pChunk)
+		return -1;
+	
+	pChunks[iListIndex] = pChunk;
+	
+	return 0;
 }
 
 // Add a new server to the server list, which other threads access by read operations
-void CLoadBalancer::AddNewServer(Server_Data_Access_Info* pServerInfo_, unsigned char* pRecvBuff_)
+// The capacity of the server is available only in a Port and Capacity packet
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::AddNewServer(Server_Data_Access_Info* pServerInfo_, unsigned char* pRecvBuff_, int iPacketType_)
+{
+	unsigned short int* pPort = (unsigned short int*)pRecvBuff_;
+	unsigned short usCapacity = DEFAULT_SERVER_CAPACITY;
+	if (SPT_PORT_CAPACITY == iPacketType_)
+		usCapacity = *(pPort + 1);
+	
+	// Capacity 0 would make the server look infinitely busy
+	if (0 == usCapacity)
+		usCapacity = DEFAULT_SERVER_CAPACITY;
+	
+	return RegisterServer(pServerInfo_, *pPort, usCapacity);
+}
+
+// Give a server a slot in the arrays shared among all the threads
+// The server is not ready until its status is known.
+// Return -1 on Failure (The server has no slot)
+// Return 0 on Success
+int CLoadBalancer::RegisterServer(Server_Data_Access_Info* pServerInfo_, unsigned short usPort_, unsigned short usCapacity_)
 {
+	// The key array must have room for the server before other threads can find it
+	// The server takes a free slot or the slot right after the slots in use, so one more key is enough.
+	if (-1 == GrowServerKeyArray(g_stServerShards[m_iThreadIndex].uiServerCounts.load(std::memory_order_relaxed) + 1))
+		return -1;
+	
+	// In the same way, the chunk of the slot right after the slots in use must exist before the server takes a slot
+	// Memory is allocated only when the array is out of space, and no slot has been taken yet if it fails.
+	if (-1 == AllocateMemoryForNewServers())
+		return -1;
+	
 	// Calculate Indicies
-	unsigned long uiServerCounts = g_uiServerCounts[m_iThreadIndex];
-	int iArrIndex = uiServerCounts % MAX_SERVER_NUMS_PER_ARRAY;
-	int iListIndex = uiServerCounts / MAX_SERVER_NUMS_PER_ARRAY;
+	int iSlotIndex = AcquireServerSlot();
+	int iArrIndex = iSlotIndex % MAX_SERVER_NUMS_PER_ARRAY;
+	int iListIndex = iSlotIndex / MAX_SERVER_NUMS_PER_ARRAY;
 			
 	pServerInfo_->iArrayIndex = iArrIndex;
 	pServerInfo_->iListIndex = iListIndex;
-	
-	// Allocate memory only when the array is out of space
-	if (0 == iArrIndex && 0 != iListIndex)
-		AllocateMemoryForNewServers();
 
-	Simple_List<long int*>* pClientCountsList = g_pClientCountsList[m_iThreadIndex];
-	Simple_List<Server_Address_Info*>* pServerInfoList = g_pServerInfoList[m_iThreadIndex];
-	int i = 0;
-	while (i < iListIndex)
-	{
-		pClientCountsList = pClientCountsList->pNext;
-		pServerInfoList = pServerInfoList->pNext;
-		++i;
-	}
+	Server_Chunk* pChunk = GetServerChunk(m_iThreadIndex, iListIndex);
+	
+	// A reused slot still holds the data of the previous server, so start over
+	// Clients assigned to the previous server are ignored from the next epoch.
+	for (int j = SM_REQUESTS; j < SM_MAX; ++j)
+		pChunk->uiMetrics[j][iArrIndex].store(0, std::memory_order_relaxed);
+	
+	pChunk->ulLatency[iArrIndex].store(0, std::memory_order_relaxed);
+	pChunk->ulReadyTime[iArrIndex].store(0, std::memory_order_relaxed);
+	
+	std::atomic<unsigned int>& uiUpdateEpoch = pChunk->stAssignmentInfo[iArrIndex].uiUpdateEpoch;
+	uiUpdateEpoch.store(uiUpdateEpoch.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	
+	// The generation changes together with the address so that other threads holding the slot of the previous server can tell that it has been replaced.
+	WriteServerRecord(iListIndex, iArrIndex, pServerInfo_->uiIP, usPort_, usCapacity_);
 	
 	// Set the Server status Not Ready
 	// The server becomes ready when this loadblaner receives the first status update packet from the server	
-	pClientCountsList->Data[iArrIndex] = SERVER_NOT_READY;
+	// Other threads that read the new status also see everything written above.
+	pChunk->iClientCounts[iArrIndex].store(SERVER_NOT_READY, std::memory_order_release);
 	
-	unsigned short int* pPort = (unsigned short int*)pRecvBuff_;
-	pServerInfoList->Data[iArrIndex].usPort = *pPort;
-	pServerInfoList->Data[iArrIndex].uiIP = pServerInfo_->uiIP;
+	// The zone of a server does not change while it is connected
+	if ((size_t)iSlotIndex >= m_vecServerZones.size())
+		m_vecServerZones.resize(iSlotIndex + 1, ZONE_NONE);
+
+	m_vecServerZones[iSlotIndex] = GetZoneIndex(pServerInfo_->uiIP);
+	
+	// A slot beyond the slots in use is counted last
+	if (iSlotIndex == g_stServerShards[m_iThreadIndex].uiServerCounts.load(std::memory_order_relaxed))
+		g_stServerShards[m_iThreadIndex].uiServerCounts.store(iSlotIndex + 1, std::memory_order_release);
+	
+	std::atomic<long int>& iConnectedServerCounts = g_stServerShards[m_iThreadIndex].iConnectedServerCounts;
+	iConnectedServerCounts.store(iConnectedServerCounts.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	
+	return 0;
+}
+
+// Take a slot for a new server
+// The smallest free slot is reused if there is one. Otherwise, the slot right after the slots in use is taken.
+int CLoadBalancer::AcquireServerSlot()
+{
+	if (m_setFreeSlots.empty())
+		return (int)g_stServerShards[m_iThreadIndex].uiServerCounts.load(std::memory_order_relaxed);
+	
+	int iSlotIndex = *m_setFreeSlots.begin();
+	m_setFreeSlots.erase(m_setFreeSlots.begin());
+	
+	return iSlotIndex;
+}
 
-	++g_uiServerCounts[m_iThreadIndex];
+// Give back the slot of a disconnected server
+// Free slots at the end are no longer counted, so other threads scan only up to the last slot in use.
+// A thread that still holds one of those slots reads SERVER_DISCONNECTED because the chunk is never released.
+void CLoadBalancer::ReleaseServerSlot(int iSlotIndex_)
+{
+	m_setFreeSlots.insert(iSlotIndex_);
+	
+	long uiServerCounts = g_stServerShards[m_iThreadIndex].uiServerCounts.load(std::memory_order_relaxed);
+	while (!m_setFreeSlots.empty() && *m_setFreeSlots.rbegin() == uiServerCounts - 1)
+	{
+		m_setFreeSlots.erase(uiServerCounts - 1);
+		--uiServerCounts;
+	}
+	
+	g_stServerShards[m_iThreadIndex].uiServerCounts.store(uiServerCounts, std::memory_order_release);
 }
 
 // Add a partial TCP packet to the receive queue in order to receive the rest of the packet later from where it left off
-void CLoadBalancer::AddTCPPacketToRecvQueue(int iSockFD_, int iPacketType_, size_t uiBufferLength_, size_t uiOffset_, unsigned char* pRecvBuff_)
+// Return -1 on Failure
+// Return 0 on Success
+int CLoadBalancer::AddTCPPacketToRecvQueue(Connection* pConnection_, int iPacketType_, size_t uiBufferLength_, size_t uiOffset_, unsigned char* pRecvBuff_)
 {
-	InComplete_Packet* pInCompletePacket = new InComplete_Packet;
+	InComplete_Packet* pInCompletePacket = (InComplete_Packet*)m_InCompletePacketPool.Allocate();
+	if (NULL == pInCompletePacket)
+	{
+		DisplayErrorMessage("Packet Pool Allocation Failed");
+		return -1;
+	}
+	
 	pInCompletePacket->iPacketType = iPacketType_;
 	pInCompletePacket->uiBufferLen = uiBufferLength_;
 	pInCompletePacket->uiOffset = uiOffset_;
-	pInCompletePacket->pBuffer = new unsigned char[uiBufferLength_];
-	memcpy((void*)pInCompletePacket->pBuffer, (void *)pRecvBuff_, uiOffset_);
+	memcpy((void*)pInCompletePacket->szBuffer, (void *)pRecvBuff_, uiOffset_);
 	
-	m_mapTCPPacketRecvQueue.insert(std::make_pair(iSockFD_, pInCompletePacket));
+	pConnection_->pRecvPacket = pInCompletePacket;
+	
+	return 0;
 }
 
-// Erase a packet from the receive queue and release memory
-void CLoadBalancer::RemoveTCPRecvQueuePacket(int iSockFD_, InComplete_Packet* pInCompletePacket_)
+// Erase a packet from the receive queue and give it back to the packet pool
+void CLoadBalancer::RemoveTCPRecvQueuePacket(Connection* pConnection_)
 {
-	delete pInCompletePacket_->pBuffer;
-	delete pInCompletePacket_;
-	m_mapTCPPacketRecvQueue.erase(iSockFD_);
+	m_InCompletePacketPool.Release(pConnection_->pRecvPacket);
+	pConnection_->pRecvPacket = NULL;
 }
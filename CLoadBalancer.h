@@ -10,8 +10,10 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <netinet/tcp.h> 
+#include <sys/eventfd.h>
 #include <list>
 #include <map>
+#include <set>
 #include <unordered_map>
 #include <vector>
 #include <string>
@@ -20,7 +22,18 @@
 #include <semaphore.h>
 #include <limits.h>
 #include <deque>
+#include <algorithm>
+#include <atomic>
+#include <time.h>
 #include "Common_Header.h"
+#include "CServerHeap.h"
+#include "CMaglevTable.h"
+#include "CWeightedRoundRobin.h"
+#include "CHashRing.h"
+#include "CServerSnapshot.h"
+#include "CPacketPool.h"
+#include "CUDPResponseQueue.h"
+#include "CIOUring.h"
 
 // The Number of Threads (Including the main thread)
 #define MAX_THREAD_COUNTS 4
@@ -29,6 +42,20 @@
 // Up to MAX_EVENT_COUNTS are returned by epoll_wait()
 #define MAX_EVENT_COUNTS 256
 
+// For io_uring (-i io_uring)
+// Each thread has a ring of IO_URING_QUEUE_DEPTH submission queue entries (A power of two).
+// Client connections receive into IO_URING_RECV_BUFFER_COUNTS buffers of IO_URING_RECV_BUFFER_SIZE bytes provided to the kernel.
+// A buffer is given back as soon as its data has been handled, so the buffers only have to cover the data that arrives between two waits.
+#define IO_URING_QUEUE_DEPTH 256
+#define IO_URING_RECV_BUFFER_COUNTS 1024
+#define IO_URING_RECV_BUFFER_SIZE 256
+
+// The user data of an io_uring request holds the descriptor in the lower 32 bits, the operation (IO_URING_OPERATION) above them,
+// and the lower bits of the generation of the connection at the top (See Connection::uiGeneration)
+#define IO_URING_OPERATION_SHIFT 32
+#define IO_URING_GENERATION_SHIFT 40
+#define IO_URING_GENERATION_MASK 0xFFFFFFULL
+
 // UDP uses a socket to communicate with multiple clients.
 // If the load balancer processes only one packet in the socket bufffer on an EPOLLIN event,
 // the load balancer will unecessarily call epoll_wait too many times.
@@ -38,6 +65,19 @@
 // For testing, the value is set to 1
 #define MAX_UDP_PACKET_LOOPING_COUNT 1
 
+// With batch mode (-b), up to this number of UDP requests are received with one recvmmsg() call, their servers are chosen at once,
+// and their responses are sent with one sendmmsg() call
+// The responses of a batch are built on the stack, so the value must not be too large.
+#define MAX_UDP_BATCH_COUNTS 64
+
+// For a batch of n requests, the n * BATCH_CANDIDATE_FACTOR servers with the smallest keys are scored again from their current information (See AssignServersInBatch())
+// Keys are a little behind the clients assigned by other threads, so a few more servers than requests are considered.
+#define BATCH_CANDIDATE_FACTOR 2
+
+// The key of a server that is not running in the flat key array of its thread (See Server_Shard::pServerKeys)
+// No running server has this key, so the batch scan skips it with one comparison.
+#define SERVER_KEY_NONE 0xFFFFFFFFU
+
 // Same reasoning as UDP packet receive
 // The maximum number of client connections the load balancer accepts in a loop
 // For testing, the value is set to 1
@@ -48,6 +88,17 @@
 // For testing, the value is set to 1
 #define MAX_SERVER_ACCEPT_LOOPING_COUNT 1
 
+// With edge-triggered epoll (-i epoll-et), epoll reports a descriptor only when new data arrives,
+// so a handler keeps reading from its descriptor until nothing is left or the budget of the type of the descriptor runs out.
+// A descriptor that still has data once its budget has run out is read again right after the next epoll_wait(), which does not block then.
+// A budget counts UDP requests, accepted connections, packets from a client, or reads from a server, and is used instead of the looping counts above.
+// It starts at ET_MIN_READ_BUDGET, doubles whenever a descriptor still has data after its whole budget (The backlog is growing),
+// and halves whenever epoll_wait() has blocked for ET_IDLE_WAIT_TIME microseconds or longer (The backlog is gone).
+// It never exceeds ET_MAX_READ_BUDGET, so a server status packet is handled after at most ET_MAX_READ_BUDGET reads of each other ready descriptor.
+#define ET_MIN_READ_BUDGET 4
+#define ET_MAX_READ_BUDGET 256
+#define ET_IDLE_WAIT_TIME 1000
+
 // Server Status
 #define SERVER_NOT_READY		-1
 #define SERVER_DISCONNECTED		-2
@@ -56,11 +107,198 @@
 // Frequent memory allocation could increase overhead, so memory for MAX_SERVER_NUMS_PER_ARRAY (20) servers are allocated at once.
 #define MAX_SERVER_NUMS_PER_ARRAY	20
 
-// Information of the address of a server
-struct Server_Address_Info
+// The chunk directory of each thread starts with this number of chunks, and its size doubles whenever it runs out of space.
+#define SERVER_CHUNK_DIRECTORY_INITIAL_SIZE 16
+
+// A reader gives up reading the address of a server after this number of attempts if the server keeps being replaced (See Server_Chunk::uiSequence)
+// A server is registered only once per connection, so a reader almost never needs a second attempt.
+#define MAX_SERVER_RECORD_READ_ATTEMPTS 4
+
+// The size of a cache line
+// Data written by different threads is kept on different cache lines so that a write by one thread does not invalidate the cache lines that other threads read (False sharing).
+#define CACHE_LINE_SIZE 64
+
+// Each thread publishes a summary of its best server so that other threads do not need to scan all of its servers.
+// The upper 32 bits hold (the number of clients + 1), and the lower 32 bits hold the slot index of the server
+// in the lower BEST_SERVER_SUMMARY_SLOT_BITS bits and the lower bits of the generation of the slot above them (See Server_Chunk::uiGeneration).
+// Zero means that the thread has no running server.
+// A summary is a single atomic word, so a reader always gets either the old summary or the new one.
+#define BEST_SERVER_SUMMARY_NONE 0ULL
+
+// The number of clients larger than this value is stored as this value in a summary
+#define MAX_SUMMARY_CLIENT_COUNTS 0xFFFFFFFEUL
+
+// A thread can manage up to (1 << BEST_SERVER_SUMMARY_SLOT_BITS) servers at a time
+#define BEST_SERVER_SUMMARY_SLOT_BITS 24
+#define BEST_SERVER_SUMMARY_SLOT_MASK ((1U << BEST_SERVER_SUMMARY_SLOT_BITS) - 1)
+#define BEST_SERVER_SUMMARY_GENERATION_MASK (0xFFFFFFFFU >> BEST_SERVER_SUMMARY_SLOT_BITS)
+
+// Other threads assign clients to the best server of a thread without telling that thread.
+// When a thread finds clients assigned to its best server, it checks again after BEST_SERVER_REFRESH_INTERVAL milliseconds
+// so that the next best server gets published even if no packet arrives in the meantime.
+// The interval doubles, up to MAX_BEST_SERVER_REFRESH_INTERVAL, every time a check finds no new client on the best server.
+#define BEST_SERVER_REFRESH_INTERVAL 1
+#define MAX_BEST_SERVER_REFRESH_INTERVAL SERVER_PING_INTERVAL
+
+// The maximum number of servers whose position in the heap is updated at a time
+#define MAX_BEST_SERVER_REFRESH_COUNTS 16
+
+// How busy a server is equals (the number of clients * CAPACITY_SCORE_SCALE / the capacity of the server)
+// The scale keeps the precision of the division without floating point arithmetic.
+#define CAPACITY_SCORE_SCALE 65536
+
+// Each thread sends a Ping packet to each of its servers every SERVER_PING_INTERVAL milliseconds
+// A server that stalls (ex. GC pauses) leaves its Ping packet unanswered, and looks slower as the stall goes on.
+#define SERVER_PING_INTERVAL 100
+
+// The latency of a server is the exponentially weighted moving average of the round trip times of Ping packets (microseconds)
+// New latency = Old latency + (Round trip time - Old latency) / SERVER_LATENCY_EWMA_WEIGHT (The same weight as the smoothed RTT of TCP)
+#define SERVER_LATENCY_EWMA_WEIGHT 8
+
+// With SSP_LEAST_LATENCY, how busy a server is gets multiplied by (1 + latency / SERVER_LATENCY_REFERENCE)
+// A server that takes 100 milliseconds to respond looks 11 times as busy as a server with the same clients that responds instantly.
+#define SERVER_LATENCY_REFERENCE 10000
+
+// Each thread also keeps the keys of its servers in the heap in a flat array indexed by slot (See Server_Shard::pServerKeys)
+// The array starts with this number of elements, and its size doubles whenever it runs out of space.
+#define SERVER_KEY_ARRAY_INITIAL_SIZE 64
+
+// Servers connect to whichever thread the kernel picks (SO_REUSEPORT), so one thread may end up managing most of them.
+// Every SHARD_REBALANCE_INTERVAL milliseconds, a thread that manages more servers than the thread with the fewest servers by more than the rebalance threshold (-r)
+// hands some of its servers off to that thread (Up to MAX_SERVER_HANDOFFS_PER_REBALANCE at a time, 0 disables rebalancing).
+#define SHARD_REBALANCE_INTERVAL 1000
+#define DEFAULT_SHARD_REBALANCE_THRESHOLD 2
+#define MAX_SHARD_REBALANCE_THRESHOLD 1000000
+#define MAX_SERVER_HANDOFFS_PER_REBALANCE 4
+
+// The number of servers that can wait to be taken over by one thread from another thread (See Server_Handoff_Queue)
+// The value must be a power of 2.
+#define SERVER_HANDOFF_QUEUE_SIZE 64
+
+// With the aggregator (-a, microseconds, 0 disables it), a background thread ranks every running server and publishes the least busy ones as a snapshot (See CServerSnapshot).
+// Requests with least-clients or least-latency are then answered from the snapshot, which also holds the addresses of the servers.
+#define DEFAULT_AGGREGATOR_INTERVAL 0
+#define MAX_AGGREGATOR_INTERVAL 1000000
+
+// A snapshot older than this (microseconds) is not used, and requests are answered in the usual way (ex. the aggregator thread is not getting CPU time).
+#define MAX_SERVER_SNAPSHOT_AGE 100000
+
+// The aggregator prints how old the snapshot is and how long it takes to rebuild it every SERVER_SNAPSHOT_REPORT_INTERVAL seconds
+#define SERVER_SNAPSHOT_REPORT_INTERVAL 10
+
+// Each thread prints how many partial and queued packets it keeps every PENDING_PACKET_REPORT_INTERVAL seconds while it has any
+#define PENDING_PACKET_REPORT_INTERVAL 10
+
+// Event engines that wait for sockets to be ready (Chosen at startup)
+enum EVENT_ENGINE
 {
-	in_addr_t uiIP;
-	unsigned short usPort;
+	EE_EPOLL = 0, // Level-triggered epoll_wait(), and a non-blocking recv(), send() or accept() per event
+	EE_EPOLL_EDGE = 1, // Edge-triggered epoll_wait(), and each descriptor read until nothing is left or its budget runs out
+	EE_IO_URING = 2, // io_uring with multishot accept and multishot recv, and requests submitted together when the thread waits (Falls back to EE_EPOLL if not supported)
+	EE_MAX,
+};
+
+// Requests that a thread keeps in flight on a descriptor with io_uring
+enum IO_URING_OPERATION
+{
+	IUO_POLL = 0, // One-shot poll for the events that the thread watches, re-armed after every completion (Like a level-triggered epoll event)
+	IUO_ACCEPT = 1, // Multishot accept on a listening socket
+	IUO_RECV = 2, // Multishot recv into a provided buffer on a client connection
+	IUO_CANCEL = 3, // Cancellations and poll updates, whose own completions are ignored
+	IUO_MAX,
+};
+
+// Server Selection Policies (Chosen at startup)
+enum SERVER_SELECTION_POLICY
+{
+	SSP_LEAST_CLIENTS = 0, // Choose the server with the fewest clients per capacity among all the servers
+	SSP_POWER_OF_D_CHOICES = 1, // Sample d random servers and choose the one with the fewest clients per capacity among them
+	SSP_WEIGHTED_ROUND_ROBIN = 2, // Choose running servers in smooth weighted round-robin order (Weight is capacity), regardless of their numbers of clients
+	SSP_LEAST_LATENCY = 3, // Choose the server with the fewest clients per capacity weighted by its latency among all the servers
+	SSP_BOUNDED_LOAD_HASHING = 4, // Hash the address of the client onto a ring of servers, and skip servers with too many clients (Consistent hashing with bounded loads)
+	SSP_MAX,
+};
+
+// The number of random servers sampled on each request when SSP_POWER_OF_D_CHOICES is used
+// If no value is given on the command line, two servers are sampled (Power of two choices)
+#define DEFAULT_POWER_OF_D_CHOICES 2
+
+// Some of the sampled servers may not be ready or may be disconnected.
+// The load balancer keeps sampling until it finds d running servers, but it gives up after (d * MAX_SAMPLING_ROUNDS_PER_CHOICE) samples
+// and falls back to scanning every server.
+#define MAX_SAMPLING_ROUNDS_PER_CHOICE 4
+
+// With SSP_BOUNDED_LOAD_HASHING, a server is skipped if its clients per capacity would exceed
+// (1 + epsilon) times the average clients per capacity of all the running servers.
+// Epsilon is given in percent. The smaller it is, the more balanced and the less sticky the assignment becomes.
+#define DEFAULT_LOAD_BOUND_PERCENT 25
+#define MAX_LOAD_BOUND_PERCENT 1000
+
+// With SSP_BOUNDED_LOAD_HASHING, the load balancer gives up walking the ring after this number of points
+// and falls back to the least busy server.
+#define MAX_HASH_RING_PROBES 64
+
+// A server that has just become ready (ex. a cold JVM) is given clients gradually during its slow-start window (-w, seconds, 0 disables it)
+// Its share of clients grows linearly from SLOW_START_MIN_PERMILLE to SLOW_START_FULL_PERMILLE of its capacity over the window.
+// An idle server in the window still gets the first client, but then looks busier than idle servers out of the window.
+#define DEFAULT_SLOW_START_WINDOW 0
+#define MAX_SLOW_START_WINDOW 3600
+#define SLOW_START_MIN_PERMILLE 100
+#define SLOW_START_FULL_PERMILLE 1000
+
+// Metrics of how busy a server is (Reported in a Status and Metrics packet)
+// A server that only sends a Status packet reports the number of its clients, and its other metrics stay 0.
+enum SERVER_METRIC
+{
+	SM_CLIENTS = 0, // The number of connected clients
+	SM_REQUESTS = 1, // The number of requests received from clients since the previous status update
+	SM_QUEUE_DEPTH = 2, // The number of connections waiting to be accepted
+	SM_CPU_USAGE = 3, // CPU utilisation in per mille of a core
+	SM_MAX,
+};
+
+// The largest weight of a metric given on the command line
+// Metrics are 32-bit values, so the load of a server never overflows even if every metric has the largest weight.
+#define MAX_METRIC_WEIGHT 1000000
+
+// Servers and clients are grouped into zones by their addresses (ex. a zone per data center)
+// Each zone is a subnet given on the command line, and an address belongs to the first zone that contains it.
+#define MAX_ZONE_COUNTS 8
+
+// The zone index of an address that does not belong to any zone
+#define ZONE_NONE -1
+
+// A client gets the least busy server in its own zone as long as the load per capacity of that server does not exceed the spill threshold.
+// Otherwise, the least busy server among all the zones is chosen.
+// With the default scoring, the load per capacity is the number of clients per capacity.
+#define DEFAULT_ZONE_SPILL_THRESHOLD 100
+
+// The largest spill threshold given on the command line
+#define MAX_ZONE_SPILL_THRESHOLD 1000000
+
+// A subnet that defines a zone (Network byte order)
+struct Zone_Subnet
+{
+	in_addr_t uiNetwork;
+	in_addr_t uiMask;
+};
+
+// Options chosen at startup (Every thread uses the same options)
+struct Load_Balancer_Options
+{
+	int iSelectionPolicy; // One of SERVER_SELECTION_POLICY
+	int iChoiceCounts; // The number of random servers sampled by SSP_POWER_OF_D_CHOICES
+	int iMetricWeights[SM_MAX]; // The load of a server is the weighted sum of its metrics (See GetServerLoad())
+	int iBatchCounts; // The maximum number of UDP requests whose servers are chosen at once (1 disables batch mode)
+	int iZoneCounts; // The number of zones (0 disables zone-aware routing)
+	Zone_Subnet stZones[MAX_ZONE_COUNTS]; // The subnet of each zone
+	int iZoneSpillThreshold; // Load per capacity of the best server in the client's zone above which other zones are considered
+	int iLoadBoundPercent; // Epsilon of SSP_BOUNDED_LOAD_HASHING in percent
+	int iSlowStartWindow; // The slow-start window of a server that becomes ready in seconds (0 disables slow start)
+	int iRebalanceThreshold; // How many more servers a thread may manage than the thread with the fewest servers (0 disables rebalancing)
+	int iAggregatorInterval; // How often the aggregator rebuilds the snapshot of the least busy servers in microseconds (0 disables the aggregator)
+	int iUDPOverflowPolicy; // What to do when the backlog of UDP responses is full (One of UDP_OVERFLOW_POLICY)
+	int iEventEngine; // How each thread waits for its sockets (One of EVENT_ENGINE)
 };
 
 // Information to access data of a server
@@ -70,6 +308,90 @@ struct Server_Data_Access_Info
 	int iListIndex;
 	int iArrayIndex;
 	in_addr_t uiIP;
+	
+	// When the Ping packet that has not been answered yet was sent (0 if every Ping packet has been answered)
+	unsigned long long ulPingTime;
+	
+	// Latency measured with Ping packets (0 until the server answers the first Ping packet)
+	// Only the thread that manages the server uses this value. Other threads read the published value in Server_Chunk::ulLatency.
+	unsigned long ulLatency;
+};
+
+// Location of a server in the arrays shared among all the threads
+struct Server_Location
+{
+	int iThreadIndex; // The thread that manages the server
+	int iSlotIndex; // iListIndex * MAX_SERVER_NUMS_PER_ARRAY + iArrayIndex
+	unsigned int uiGeneration; // The generation of the slot when the location was taken (See Server_Chunk::uiGeneration)
+};
+
+// The key of a running server found while scanning for the candidates of a batch (See AssignServersInBatch())
+struct Batch_Key
+{
+	unsigned int uiKey;
+	int iThreadIndex;
+	int iSlotIndex;
+};
+
+// A running server considered for a batch of requests (See AssignServersInBatch())
+struct Batch_Candidate
+{
+	Server_Location stLocation;
+	long int iClientCounts; // The number of clients reported by the server
+	long int iInFlightCounts; // Clients assigned since its last status update, including the ones assigned in the batch so far
+	unsigned short usCapacity;
+	unsigned long ulLatency;
+	unsigned int uiRampPermille; // See GetServerRampPermille()
+};
+
+// Clients that the load balancer has assigned to a server since the last status update from that server
+// The number of clients reported by a server does not include clients that are on their way to the server.
+// Without this information, every client gets the same server until the next status update.
+struct Server_Assignment_Info
+{
+	// The number of status updates received from the server
+	// Only the thread that manages the server writes on this value
+	std::atomic<unsigned int> uiUpdateEpoch;
+	
+	// Assignments made by each thread: (uiUpdateEpoch << 32) | (The number of assigned clients)
+	// Only thread i writes on ulAssignedCounts[i], so no lock is needed.
+	// The counts are valid only if the epoch matches uiUpdateEpoch, so a status update resets all of them at once.
+	// The counts are only estimates until the next status update, so they are read and written with relaxed ordering.
+	std::atomic<unsigned long long> ulAssignedCounts[MAX_THREAD_COUNTS];
+};
+
+// A consistent copy of the record of a server (See Server_Chunk::uiSequence)
+struct Server_Record
+{
+	in_addr_t uiIP;
+	unsigned short usPort;
+	unsigned short usCapacity;
+	unsigned int uiGeneration;
+};
+
+// Everything that a thread needs to take over a server from another thread (See CLoadBalancer::HandOffServer())
+struct Server_Handoff
+{
+	int iSocketFD;
+	in_addr_t uiIP;
+	unsigned short usPort;
+	unsigned short usCapacity;
+	long int iClientCounts; // The last status of the server (Or SERVER_NOT_READY)
+	unsigned int uiMetrics[SM_MAX]; // See Server_Chunk::uiMetrics
+	unsigned long long ulReadyTime; // See Server_Chunk::ulReadyTime
+	unsigned long long ulPingTime; // See Server_Data_Access_Info::ulPingTime
+	unsigned long ulLatency; // See Server_Data_Access_Info::ulLatency
+};
+
+// Servers handed off from one thread to another
+// Only the source thread pushes and only the target thread pops, so a ring with a head and a tail needs no lock (Single producer, single consumer).
+// The source writes a handoff before it publishes the new tail with release ordering, and the target reads the tail with acquire ordering before the handoff.
+// The target publishes the new head in the same way once it has copied the handoff, so the source never overwrites a handoff that is being read.
+struct Server_Handoff_Queue
+{
+	alignas(CACHE_LINE_SIZE) std::atomic<unsigned long> ulHead; // Only the target thread writes on this value
+	alignas(CACHE_LINE_SIZE) std::atomic<unsigned long> ulTail; // Only the source thread writes on this value
+	alignas(CACHE_LINE_SIZE) Server_Handoff stHandoffs[SERVER_HANDOFF_QUEUE_SIZE];
 };
 
 // Types of packets from servers for internal use
@@ -77,15 +399,106 @@ enum SERVER_PACKET_TYPE
 {
 	SPT_PORT = 0,
 	SPT_STATUS = 1,
+	SPT_PORT_CAPACITY = 2,
+	SPT_PONG = 3,
+	SPT_STATUS_METRICS = 4,
 	SPT_MAX,
 };
 
-// struct for a simple list
-template <typename T>
-struct Simple_List
+// Data of MAX_SERVER_NUMS_PER_ARRAY servers of a thread (Structure of arrays)
+// The server at slot index i is at [i % MAX_SERVER_NUMS_PER_ARRAY] of each array in chunk (i / MAX_SERVER_NUMS_PER_ARRAY).
+// Each array starts on its own cache line, so scanning the number of clients of every server does not load their addresses or metrics.
+// Only the thread that manages the servers writes on a chunk (Except for Server_Assignment_Info::ulAssignedCounts).
+// A chunk is never moved or released, so other threads can read it without a lock.
+// Every element is atomic, so neither the compiler nor the CPU tears or reorders an access across the orderings given below.
+struct Server_Chunk
+{
+	// The number of clients currently connected to each server (Or SERVER_NOT_READY, SERVER_DISCONNECTED)
+	// Written with release ordering after the metrics of the server, and read with acquire ordering,
+	// so a reader that finds a server running also finds the metrics that came with its status.
+	alignas(CACHE_LINE_SIZE) std::atomic<long int> iClientCounts[MAX_SERVER_NUMS_PER_ARRAY];
+	
+	// The sequence number of the record of each server (Its address, its capacity, and the generation of its slot)
+	// A record has several fields, so it is protected by a sequence lock: the thread that manages the server makes the number odd,
+	// writes the fields, and makes the number even again. A reader retries if the number was odd or has changed while it was reading.
+	// Readers never write on the sequence number, so they never wait for each other, and they give up after MAX_SERVER_RECORD_READ_ATTEMPTS.
+	alignas(CACHE_LINE_SIZE) std::atomic<unsigned int> uiSequence[MAX_SERVER_NUMS_PER_ARRAY];
+	
+	// The number of times that a server has taken each slot
+	// The slot of a disconnected server is reused by the next server, so other threads that keep a slot index
+	// (ex. Maglev lookup tables and summaries) keep its generation as well and find out that the server has been replaced.
+	alignas(CACHE_LINE_SIZE) std::atomic<unsigned int> uiGeneration[MAX_SERVER_NUMS_PER_ARRAY];
+	
+	// The address of each server
+	alignas(CACHE_LINE_SIZE) std::atomic<in_addr_t> uiIP[MAX_SERVER_NUMS_PER_ARRAY];
+	alignas(CACHE_LINE_SIZE) std::atomic<unsigned short> usPort[MAX_SERVER_NUMS_PER_ARRAY];
+	
+	// Advertised by each server on registration (DEFAULT_SERVER_CAPACITY if not advertised)
+	// Scoring reads the capacity alone, so it does not need the sequence lock.
+	alignas(CACHE_LINE_SIZE) std::atomic<unsigned short> usCapacity[MAX_SERVER_NUMS_PER_ARRAY];
+	
+	// Other information can be used for load balancing as well.
+	// Each metric other than the number of clients has its own array (Indexed by SERVER_METRIC, uiMetrics[SM_CLIENTS] is not used)
+	// For example, uiMetrics[SM_REQUESTS] holds the number of requests that each server has received from clients since its previous status update.
+	alignas(CACHE_LINE_SIZE) std::atomic<unsigned int> uiMetrics[SM_MAX][MAX_SERVER_NUMS_PER_ARRAY];
+	
+	// Clients assigned to each server since its last status update
+	alignas(CACHE_LINE_SIZE) Server_Assignment_Info stAssignmentInfo[MAX_SERVER_NUMS_PER_ARRAY];
+	
+	// How fast each server responds (microseconds, 0 if unknown)
+	alignas(CACHE_LINE_SIZE) std::atomic<unsigned long> ulLatency[MAX_SERVER_NUMS_PER_ARRAY];
+	
+	// When each server became ready (See GetCurrentTime(), 0 if the server is not in its slow-start window)
+	alignas(CACHE_LINE_SIZE) std::atomic<unsigned long long> ulReadyTime[MAX_SERVER_NUMS_PER_ARRAY];
+};
+
+// Everything that a thread publishes about its servers
+// Only the thread that owns a shard writes on it, and each shard starts on its own cache line
+// so that a thread updating its own shard does not invalidate the cache lines of the shards of other threads.
+// Pointers and counts that tell other threads where to find data are written with release ordering and read with acquire ordering.
+struct alignas(CACHE_LINE_SIZE) Server_Shard
 {
-	T Data;
-	Simple_List* pNext;
+	// The number of slots in use by the thread, from slot 0 to the last slot taken by a connected server
+	// Slots of disconnected servers below the last one stay counted until they are reused (See CLoadBalancer::m_setFreeSlots).
+	std::atomic<long> uiServerCounts;
+	
+	// The chunk directory: pChunks[i] holds the servers at slot indices from (i * MAX_SERVER_NUMS_PER_ARRAY) to ((i + 1) * MAX_SERVER_NUMS_PER_ARRAY - 1)
+	// A new chunk is added to the directory before uiServerCounts counts its first server, so any server counted can be reached in O(1).
+	// When the directory runs out of space, a larger copy is published. An old directory is never released because other threads may still be reading it.
+	std::atomic<Server_Chunk**> pChunks;
+	
+	// The key of each server in the heap of the thread, indexed by slot (SERVER_KEY_NONE if the server is not running)
+	// The keys are contiguous, so the keys of every thread can be scanned in one pass for a batch of requests.
+	// It grows in the same way as the chunk directory.
+	std::atomic<std::atomic<unsigned int>*> pServerKeys;
+	
+	// The number of times that servers of the thread have become ready or stopped running (See CLoadBalancer::RefreshMembership())
+	// Each thread rebuilds its Maglev lookup table and round-robin sequence when the version of any thread changes.
+	std::atomic<unsigned long> uiMembershipVersion;
+	
+	// Summary of the best server of the thread (See BEST_SERVER_SUMMARY_NONE)
+	// The thread updates its summary whenever the status of one of its servers changes.
+	std::atomic<unsigned long long> ulBestServerSummary;
+	
+	// Summary of the best server in each zone of the thread (Only used with zones)
+	std::atomic<unsigned long long> ulZoneBestServerSummary[MAX_ZONE_COUNTS];
+	
+	// The sum of the numbers of clients and the sum of the capacities of the running servers of the thread
+	// The thread updates its sums incrementally whenever the number of clients of one of its servers changes.
+	// The average number of clients per capacity is the sum of the clients of all the threads divided by the sum of their capacities.
+	std::atomic<long int> iRunningClientCounts;
+	std::atomic<long int> iRunningCapacity;
+	
+	// Clients on their way to servers are counted as well
+	// iAssignedClientCounts is the number of clients that the thread has ever assigned, and
+	// iSettledClientCounts is the number of assigned clients that the servers of the thread have included in their status updates (or taken away on disconnection).
+	// The difference of their sums is the number of clients assigned since the last status update of each server.
+	std::atomic<long int> iAssignedClientCounts;
+	std::atomic<long int> iSettledClientCounts;
+	
+	// The number of registered servers that the thread manages
+	// Other threads compare it with their own to decide whether to hand servers off to the thread (See CLoadBalancer::RebalanceServers()).
+	std::atomic<long int> iConnectedServerCounts;
 };
 
 
@@ -104,7 +517,17 @@ struct Simple_List
 // If space is not fully available for a packet to be transmitted, the rest of the packet also needs to be stored until space is availabe.
 // For this load balancer, such situation is not likely to happen because even the largest packet is about 20 bytes long.
 
+// The size of the buffer in a partial packet
+// A partial server packet holds the bytes of a server packet received so far, and the largest server packet is the Status and Metrics packet.
+#define PACKET_BUFFER_SIZE 24
+static_assert(PACKET_TYPE_LENGTH + SERVER_STATUS_METRICS_PACKET_DATA_LENGTH <= PACKET_BUFFER_SIZE && REQUEST_FROM_CLIENT_LENGTH <= PACKET_BUFFER_SIZE && RESPONSE_TO_CLIENT_LENGTH <= PACKET_BUFFER_SIZE, "A packet does not fit in PACKET_BUFFER_SIZE");
+
+// Data from a server is received into a buffer of SERVER_RECV_BUFFER_SIZE bytes on the stack,
+// so one recv() call gets dozens of packets that the server has sent since the last event.
+#define SERVER_RECV_BUFFER_SIZE 1024
+
 // This struct is for resolving partial data transmission issue with TCP
+// It comes from the packet pool of the thread, so the buffer is in the struct itself.
 struct InComplete_Packet
 { 
 	// Buffer Length
@@ -115,34 +538,58 @@ struct InComplete_Packet
 	
 	// If -1, pBuffer contains part of packet header
 	// Otherwise, pBuffer contains part of packet data
-	// This is only for recv
+	// This is only for recv from a client (A partial server packet always starts with its header)
 	int iPacketType;
 	
 	// The buffer that contains a partial packet
-	unsigned char* pBuffer;
+	unsigned char szBuffer[PACKET_BUFFER_SIZE];
 	
 };
 
+// Kinds of file descriptors that a thread watches with its epoll descriptor
+enum CONNECTION_TYPE
+{
+	CT_NONE = 0, // Not watched (The descriptor has been closed or handed off to another thread)
+	CT_CLIENT_LISTEN = 1, // TCP listening socket for clients
+	CT_CLIENT_UDP = 2, // UDP socket for clients
+	CT_SERVER_LISTEN = 3, // TCP listening socket for servers
+	CT_SERVER_HANDOFF = 4, // eventfd for servers handed off by other threads
+	CT_CLIENT = 5, // TCP connection with a client
+	CT_SERVER = 6, // TCP connection with a server
+	CT_MAX = 7,
+};
 
-// For sendto() with UDP,
-// With UDP, the entire message shall be read or written in a single operation, so there's no need to worry about partial packet transmission.
-// Thus, even if recvfrom() fails, the load balancer can simply come back later without storing any data. 
-// However, it is possible that sendto() will fail if space is not available for a packet to be transmitted at the moment of a sendto() call.
-// The packet needs to be stored until space is available.
-// This guarantees that the packet will be sent out, but does not guarantee that the packet will be delivered.
-struct Queued_UDP_Packet
+// Everything that a thread keeps about a file descriptor that it watches
+// The epoll event of the descriptor points to it, so an event is dispatched without looking anything up.
+struct Connection
 {
-	// Destination Address
-	sockaddr_in stSockAddr;
+	int iSockFD;
+	int iType; // CONNECTION_TYPE
 	
-	// Size of Destination Address 
-	socklen_t uiAddrLen;
+	// Partial packets of the connection (NULL if there is none)
+	InComplete_Packet* pRecvPacket;
+	InComplete_Packet* pSendPacket;
 	
-	// Buffer Length
-	size_t uiBufferLen;
+	// The slot and the status of the server (Only for CT_SERVER)
+	Server_Data_Access_Info stServerInfo;
+	
+	// For io_uring
+	// The generation increases whenever the entry is reused, so completions of requests made for an earlier descriptor with the same number are ignored.
+	unsigned int uiGeneration;
+	unsigned int uiWatchedEvents; // The epoll events that the thread watches (Given to Epoll_CTL_Wrapper())
+	unsigned int uiPolledEvents; // The events of the poll in flight
+	unsigned int uiArmedRequests; // Bit mask of the IO_URING_OPERATION requests in flight
 	
-	// The buffer that contains a UDP Packet
-	unsigned char* pBuffer;
+	// Data received by a multishot recv that the handlers have not consumed yet (NULL unless a completion is being handled)
+	// The handlers read it with RecvFromConnection() as if they called recv().
+	unsigned char* pReceivedData;
+	size_t uiReceivedLength;
+	
+	// For edge-triggered epoll
+	// A handler clears bMoreToRead once a read finds nothing left, so the descriptor is not read again until epoll reports it.
+	// bPending is set while the entry is in the list of descriptors to read again, and is kept when the entry is reused, so the entry is never in the list twice.
+	bool bMoreToRead;
+	bool bPending;
 };
 
 
@@ -150,14 +597,23 @@ struct Queued_UDP_Packet
 // Class For the Load Balancer
 class CLoadBalancer
 {
+	// Times the private lookup functions against the plain loads they replaced (Lookup_Benchmark.cpp)
+	friend class CLookupBenchmark;
+
 public:
-	CLoadBalancer(__uint16_t uiPort1_, __uint16_t uiPort2_, int iThreadIndex_); // Constructor
+	CLoadBalancer(__uint16_t uiPort1_, __uint16_t uiPort2_, int iThreadIndex_, const Load_Balancer_Options* pOptions_); // Constructor
 	~CLoadBalancer(); // Destructor
 	
 	int SetUp(); // Set up sockets to accept incoming connections and packets
-	void Run(); // Main loop that handles epoll events and manages communication with servers and clients
+	void Run(); // Main loop that handles epoll events (or io_uring completions) and manages communication with servers and clients
 	void DisplayErrorMessage(const char* szErrorMessage_); // Print out an error message
 	
+	static int SetUpServerHandoff(); // Create the eventfd of each thread for servers handed off to it (Before the threads start)
+	
+	// For the aggregator thread, which manages no server and only reads the shards of the other threads
+	CLoadBalancer(const Load_Balancer_Options* pOptions_); // Constructor
+	void RunAggregator(); // Main loop that rebuilds the snapshot of the least busy servers
+
 private:
 	// For communication with Clients
 	int m_iListenSockForClients; // TCP listening socket to communcate with clients
@@ -170,38 +626,126 @@ private:
 
 	int m_iEPollFD; // File descriptor referring to epoll instance
 	
-	// key is a socket file descriptor, and value is a pointer to information of the corresponding server
-	std::unordered_map<int, Server_Data_Access_Info*> m_mapServerList; // Server list that each thread manages
+	// Ring of this thread when the io_uring engine is used instead of epoll
+	CIOUring m_IOUring;
 	
-	// For handling a situation where only part of a packet is received
-	// Data received later are added to the previously received data so that they become a complete packet.
-	// m_mapTCPPacketRecvQueue is a Queue for TCP Packets that were not received completely at the time of a recv call
-	// Key is a socket file descriptor, and value is a pointer to information about partially received data.
-	std::unordered_map<int, InComplete_Packet*> m_mapTCPPacketRecvQueue; 
+	// Every file descriptor that this thread watches, indexed by the descriptor (NULL if this thread has never watched it)
+	// The servers that this thread manages and the packets partially received or sent on each connection are kept in its entry.
+	// An entry is never released. The entry is reused when the number of a closed descriptor is reused, so epoll events can point to it.
+	std::vector<Connection*> m_vecConnections;
 	
-	// For handling a situation where only part of a packet is sent
-	// Packets in the queue are sent when space becomes available.
-	// m_mapTCPPacketSendQueue is a Queue for TCP Packets that were not sent completely because space was not available at the time of a send call
-	// Key is a socket file descriptor, and value is a pointer to information about pending data.
-	std::unordered_map<int, InComplete_Packet*> m_mapTCPPacketSendQueue; 
+	// For edge-triggered epoll
+	// The read budget of each type of descriptor (Indexed by CONNECTION_TYPE), and the descriptors that still had data once their budget had run out
+	int m_iReadBudgets[CT_MAX];
+	std::vector<Connection*> m_vecPendingConnections;
 	
 	// Queue for UDP Packets that were not transferred because space was not available at the time of a sendto call
-	std::list<Queued_UDP_Packet*> m_listUDPPacketQueue;
+	CUDPResponseQueue m_UDPResponseQueue;
+	
+	// True while the UDP socket is not watched for requests because the backlog is full (Only with UOP_PAUSE_READING)
+	bool m_bUDPReadingPaused;
+	unsigned long long m_ulUDPReadingPauseCounts; // The number of times reading has been paused
+	
+	// Messages of recvmmsg() in batch mode, with the buffers and the addresses they point to
+	// They are set up once instead of for every batch, because most batches are much smaller than MAX_UDP_BATCH_COUNTS.
+	struct mmsghdr m_stUDPRecvMessages[MAX_UDP_BATCH_COUNTS];
+	struct iovec m_stUDPRecvIOVecs[MAX_UDP_BATCH_COUNTS];
+	unsigned char m_szUDPRecvBuffs[MAX_UDP_BATCH_COUNTS][REQUEST_FROM_CLIENT_LENGTH];
+	struct sockaddr_in m_stUDPRecvAddrs[MAX_UDP_BATCH_COUNTS];
+	
+	// Partial TCP packets of this thread come from this pool instead of the heap
+	CPacketPool m_InCompletePacketPool;
+	
+	// When this thread prints how many packets it keeps next time (See GetCurrentTime())
+	unsigned long long m_ulNextPendingPacketReportTime;
+	unsigned long long m_ulReportedPacketAllocationCounts; // The number of packets taken from the pool until the last report
+	unsigned long long m_ulReportedUDPResponseCounts; // The number of UDP responses queued or dropped until the last report
 
 	int m_iThreadIndex; // Each thread is assigned an index to access the corresponing elements of arrays shared among all the threads
 	
 	size_t m_uiPacketDataLength[SPT_MAX]; // The length of the data section of a packet for each packet type
+	
+	Load_Balancer_Options m_stOptions; // Options chosen at startup
+	
+	// State of the random number generator used for sampling servers
+	// Each thread has its own state, so no thread writes on the state of another thread
+	unsigned long long m_ulRandomState;
+	
+	// Every running server of all the threads, ordered by the IDs derived from their addresses
+	// Each thread keeps its own copy and rebuilds it when servers become ready or stop running.
+	// Backend indices in m_MaglevTable and m_WeightedRoundRobin are indices into this vector.
+	std::vector<Server_Location> m_vecMemberServers;
+	
+	// The membership version of each thread that m_vecMemberServers was built from (See Server_Shard::uiMembershipVersion)
+	unsigned long m_uiMembershipVersion[MAX_THREAD_COUNTS];
+	
+	// Maglev lookup table for keyed requests
+	// Every thread builds the same table, so the same key gets the same server on every thread.
+	CMaglevTable m_MaglevTable;
+	
+	// Consistent hashing ring for SSP_BOUNDED_LOAD_HASHING
+	// Every thread builds the same ring, so the same client gets the same server on every thread.
+	CHashRing m_HashRing;
+	
+	// Smooth weighted round-robin sequence for SSP_WEIGHTED_ROUND_ROBIN
+	// Each thread has its own cursor, so no thread writes on shared data to choose a server.
+	CWeightedRoundRobin m_WeightedRoundRobin;
+	
+	// Running servers that this thread manages ordered by how busy they are (See GetServerScore())
+	// The top of the heap is published in Server_Shard::ulBestServerSummary
+	CServerHeap m_ServerHeap;
+	
+	// Running servers of each zone that this thread manages, ordered in the same way as m_ServerHeap (Only used with zones)
+	// The top of each heap is published in Server_Shard::ulZoneBestServerSummary
+	CServerHeap m_ZoneHeaps[MAX_ZONE_COUNTS];
+	
+	// The zone of each server that this thread manages, indexed by slot (ZONE_NONE if the server does not belong to any zone)
+	std::vector<int> m_vecServerZones;
+	
+	// Slots of disconnected servers below Server_Shard::uiServerCounts of this thread
+	// A new server takes the smallest free slot so that connected servers stay at the front of the arrays.
+	std::set<int> m_setFreeSlots;
+	
+	// The smallest keys found so far, the candidates ordered by how busy they are, and their information (Only used while choosing servers for a batch)
+	// They are members so that memory is reused across batches.
+	std::vector<Batch_Key> m_vecBatchKeys;
+	CServerHeap m_BatchHeap;
+	std::vector<Batch_Candidate> m_vecBatchCandidates;
+	
+	// The number of elements in Server_Shard::pServerKeys of this thread
+	size_t m_uiServerKeyCapacity;
+	
+	// The number of chunks that Server_Shard::pChunks of this thread can hold
+	size_t m_uiChunkDirectoryCapacity;
+	
+	// When this thread sends Ping packets to its servers next time (See GetCurrentTime())
+	unsigned long long m_ulNextPingTime;
+	
+	// How long this thread waits before it checks its best server again (milliseconds, See BEST_SERVER_REFRESH_INTERVAL)
+	int m_iBestServerRefreshInterval;
+
+	// When this thread compares the number of its servers with those of other threads next time (See GetCurrentTime())
+	unsigned long long m_ulNextRebalanceTime;
+	
+	// True if requests are answered from the snapshot published by the aggregator (See GetSnapshotServer())
+	bool m_bUseSnapshot;
+	
+	// The number of snapshots that the aggregator thread has built (Only used by the aggregator thread)
+	unsigned long long m_ulSnapshotSequence;
+	
+	// Every running server ranked while building a snapshot (Only used by the aggregator thread)
+	std::vector<Snapshot_Entry> m_vecSnapshotCandidates;
 
 
 private:
 	// Create a TCP listening socket and set it up to accept incomming connections.
-	int SetUpTCPListenSocket(unsigned short usPort_); 
+	int SetUpTCPListenSocket(unsigned short usPort_, int iConnectionType_); 
 	
 	// Create a UDP socket and set it up to communicate with clients
 	int SetUpUDPSocket(unsigned short usPort_);
 	
 	// Set up socket to be ready for communication with clients and servers
-	int SetUpSocket(int iSockFD_, unsigned short uiPort_, uint32_t uiEpollEvents_); 
+	int SetUpSocket(int iSockFD_, unsigned short uiPort_, uint32_t uiEpollEvents_, int iConnectionType_); 
 	
 	// Enable socket options
 	int SetSocketOptions(int iSockFD_); 
@@ -209,26 +753,159 @@ private:
 	// Make the sock use Non-blocking mode
 	int SetNonBlocking( int iSockFD_); 
 	
+	// Main loop with io_uring instead of epoll
+	void RunIOUring();
+	
+	// Handle the events of a descriptor
+	int DispatchEvent(Connection* pConnection_, unsigned int uiEvents_);
+	
+	// Do the periodic work of the thread, and get how long the thread may wait for an event
+	int GetWaitTimeout();
+	
+	// Get how many times a handler may read from a descriptor of a type on an event
+	int GetReadBudget(int iConnectionType_);
+	
+	// With edge-triggered epoll, grow the budget of a descriptor that still has data after an event, and read it again after the next epoll_wait()
+	void KeepReading(Connection* pConnection_);
+	
+	// Read again from the descriptors that still had data once their budget had run out
+	int ReadPendingConnections();
+	
+	// Halve every read budget once the thread has been idle
+	void DecayReadBudgets();
+	
 	// Handle an EPOLLIN event
-	int EpollInEventHandler(int iSockFD_); 
+	int EpollInEventHandler(Connection* pConnection_); 
 	
 	// Handle an EPOLLOUT event
-	int EpollOutEventHanlder(int iSockFD_); 
+	int EpollOutEventHanlder(Connection* pConnection_); 
 	
 	// Handle a disconnected client or server
-	int DisconnectHandler(int iSockFD_); 
+	int DisconnectHandler(Connection* pConnection_);
+	
+	// Get the entry of a file descriptor that this thread is about to watch, and start it over
+	Connection* OpenConnection(int iSockFD_, int iConnectionType_);
+	
+	// Forget a file descriptor that this thread no longer watches
+	void CloseConnection(Connection* pConnection_); 
 	
 	// Remove a server from the list when the server gets disconnected
-	void RemoveServer(int iSockFD_); 
+	void RemoveServer(Connection* pConnection_); 
+	
+	// Take a server out of the arrays shared among all the threads
+	void UnregisterServer(Server_Data_Access_Info* pServerInfo_);
 	
 	// Build a response that will be sent to the Client
-	void BuildResponse(unsigned char* szRecBuff_, unsigned char* szSendBuff__); 
+	void BuildResponse(unsigned char* szRecBuff_, size_t uiRecvLength_, unsigned char* szSendBuff__, const Server_Location* pAssignedServer_, const struct sockaddr_in* pClientAddr_); 
+	
+	// Get the zone that an address belongs to
+	int GetZoneIndex(in_addr_t uiIP_);
+	
+	// Choose servers for a batch of requests at once by water-filling
+	int AssignServersInBatch(int iRequestCounts_, Server_Location* pServers_);
+	
+	// Get how busy a server considered for a batch is
+	long int GetBatchCandidateScore(const Batch_Candidate* pCandidate_);
+	
+	// Get the length of a request from a client from its packet type
+	size_t GetRequestLength(unsigned char* pRecvBuff_);
+	
+	// Choose the server for a key with the Maglev lookup table
+	void GetKeyedServer(unsigned long long ulKey_, int* pThreadIndex_, int* pListIndex_, int* pArrIndex_, unsigned int* pGeneration_);
+	
+	// Rebuild the server membership and the tables built from it if servers have become ready or stopped running since they were built
+	void RefreshMembership();
+	
+	// Choose the next running server in smooth weighted round-robin order
+	void GetRoundRobinServer(int* pThreadIndex_, int* pListIndex_, int* pArrIndex_, unsigned int* pGeneration_);
+	
+	// Get the latency of the server corresponding to the indices
+	unsigned long GetServerLatency(int iThreadIndex_, int iListIndex_, int iArrIndex_);
+	
+	// Get the number of clients of the server corresponding to the indices
+	long int GetClientCounts(int iThreadIndex_, int iListIndex_, int iArrIndex_);
+	
+	// Check if the server at a location is still running and has not been replaced by another server
+	bool IsServerAlive(const Server_Location* pLocation_);
 
-	// Choose the server with the fewest clients among all the servers
-	void GetBestServer(int* pThreadIndex_, int* pListIndex_, int* pArrIndex_); 
+	// Choose the best server according to the selection policy
+	// The generation of the slot read at selection time is given to GetServerAddr(), and the other selectors below return it in the same way.
+	void GetBestServer(const struct sockaddr_in* pClientAddr_, int* pThreadIndex_, int* pListIndex_, int* pArrIndex_, unsigned int* pGeneration_); 
+	
+	// Walk the hash ring from a key and choose the first server whose clients do not exceed the load bound
+	void GetBoundedHashServer(unsigned long long ulKey_, int* pThreadIndex_, int* pListIndex_, int* pArrIndex_, unsigned int* pGeneration_);
+	
+	// Keep the number of clients and the capacity of the running servers of this thread up to date when the number of clients of a server changes
+	void UpdateRunningTotals(long int iOldClientCounts_, long int iNewClientCounts_, unsigned short usCapacity_);
+	
+	// Count clients that the servers of this thread have included in their status updates
+	void AddSettledClientCounts(long int iClientCounts_);
 	
-	// Get IP and Port of the Server corresponding to the indices
-	void GetServerAddr(unsigned char* pBuff_, int iThreadIndex_, int iListIndex_, int iArrIndex_); 
+	// Tell other threads that a server has joined or left this thread
+	void IncreaseMembershipVersion();
+	
+	// Choose the least busy server in a zone, or among all the servers
+	long int GetLeastBusyServer(int iZoneIndex_, int* pThreadIndex_, int* pListIndex_, int* pArrIndex_, unsigned int* pGeneration_); 
+	
+	// Sample d random servers and choose the one with the fewest clients per capacity among them
+	void GetPowerOfDChoicesServer(int* pThreadIndex_, int* pListIndex_, int* pArrIndex_, unsigned int* pGeneration_); 
+	
+	// Get the load of the server corresponding to the indices from its metrics
+	long int GetServerLoad(int iThreadIndex_, int iListIndex_, int iArrIndex_, long int iClientCounts_, long int iInFlightCounts_);
+	
+	// Get how busy a server is from its load, its capacity, its latency, and its slow-start window
+	long int GetServerScore(long int iLoad_, unsigned short usCapacity_, unsigned long ulLatency_, unsigned int uiRampPermille_);
+	
+	// Get how much of its capacity the server corresponding to the indices is given during its slow-start window (per mille)
+	unsigned int GetServerRampPermille(int iThreadIndex_, int iListIndex_, int iArrIndex_);
+	
+	// Get the capacity of the server corresponding to the indices
+	unsigned short GetServerCapacity(int iThreadIndex_, int iListIndex_, int iArrIndex_);
+	
+	// Get a pseudo random number from this thread's own generator
+	unsigned long long GetRandomNumber();
+	
+	// Publish the summary of the best server among the servers that this thread manages
+	void PublishBestServer();
+	
+	// Build the summary of the server at the top of a heap
+	unsigned long long GetBestServerSummary(const CServerHeap* pHeap_);
+	
+	// Set the key of a running server in the heap and in the flat key array
+	void SetServerKey(int iSlotIndex_, long int iKey_);
+	
+	// Remove a server that is not running from the heap and from the flat key array
+	void RemoveServerKey(int iSlotIndex_);
+	
+	// Make room for a new server in the flat key array
+	// Return -1 on Failure (The array stays as it is)
+	// Return 0 on Success
+	int GrowServerKeyArray(size_t uiServerCounts_);
+	
+	// Move the best server down the heap according to the clients that other threads assigned to it
+	// Return the number of servers whose keys have been updated (*pAssigned_ is set to true if a published server has clients assigned since its last status update)
+	int RefreshBestServer(bool* pAssigned_);
+	
+	// Move the top of a heap down according to the clients that other threads assigned to it
+	int RefreshHeapTop(CServerHeap* pHeap_, bool* pAssigned_);
+	
+	// Get the assignment information of the server corresponding to the indices
+	Server_Assignment_Info* GetAssignmentInfo(int iThreadIndex_, int iListIndex_, int iArrIndex_);
+	
+	// Get the number of clients assigned to a server since its last status update
+	long int GetInFlightCounts(Server_Assignment_Info* pAssignmentInfo_);
+	
+	// Count a client assigned to the server corresponding to the indices
+	void RecordAssignment(int iThreadIndex_, int iListIndex_, int iArrIndex_);
+	
+	// Get IP and Port of the Server corresponding to the indices if it is still the running server chosen with the generation
+	int GetServerAddr(unsigned char* pBuff_, int iThreadIndex_, int iListIndex_, int iArrIndex_, unsigned int uiGeneration_); 
+	
+	// Read a consistent copy of the record of the server corresponding to the indices
+	int ReadServerRecord(int iThreadIndex_, int iListIndex_, int iArrIndex_, Server_Record* pRecord_);
+	
+	// Write the record of a new server of this thread
+	void WriteServerRecord(int iListIndex_, int iArrIndex_, in_addr_t uiIP_, unsigned short usPort_, unsigned short usCapacity_);
 	
 	// Get the type of a packet
 	int GetPacketType(unsigned char* pRecvBuff_);
@@ -236,61 +913,157 @@ private:
 	// Get the length of the data section of a packet
 	size_t GetPacketDataLength(int iPacketType_);
 	
-	// Receive data from a server (TCP)
-	int ServerPacketHandler(Server_Data_Access_Info* pServerInfo_);
+	// Receive data from a server, and handle every complete packet in it (TCP)
+	int ServerPacketHandler(Connection* pConnection_);
 	
-	// Receive data from a server when there is no previous data partially received (TCP)
-	int RecvServerPacket(Server_Data_Access_Info* pServerInfo_);
-	
-	// Receive data from a server and add it to the previous data partially received (TCP)
-	int RecvServerPacketWithPreData(Server_Data_Access_Info* pServerInfo_, InComplete_Packet* pInCompletePacket_);
+	// Keep the bytes of a server packet received so far until the rest arrives
+	int KeepServerPacketBytes(Connection* pConnection_, unsigned char* pRecvBuff_, size_t uiLength_);
 	
 	// Receive a UDP packet from a client 
 	int ClientUDPPacketHandler(int iSockFD_);
 	
+	// Receive UDP packets from clients and answer them as a batch
+	int ClientUDPBatchHandler(int iSockFD_);
+	
+	// Point every message for recvmmsg() at its buffer and address once
+	void SetUpUDPRecvMessages();
+	
+	// Send a response to a UDP client, or queue it if space is not available
+	int SendUDPResponse(int iSockFD_, unsigned char* szSendBuff_, struct sockaddr_in* pSockAddr_, socklen_t uiAddrLen_);
+	
+	// Send responses to UDP clients with one sendmmsg() call, and queue the ones that could not be sent
+	int SendUDPResponses(int iSockFD_, int iCounts_, unsigned char (*szSendBuffs_)[RESPONSE_TO_CLIENT_LENGTH], struct sockaddr_in* pSockAddrs_, socklen_t* pAddrLens_);
+	
+	// Queue a response that could not be sent, to be sent when space is available
+	int QueueUDPResponse(int iSockFD_, unsigned char* szSendBuff_, struct sockaddr_in* pSockAddr_, socklen_t uiAddrLen_);
+	
 	// Receive data from a client (TCP)
-	int ClientTCPPacketHandler(int iSockFD_);
+	int ClientTCPPacketHandler(Connection* pConnection_);
 	
 	// Receive data from a client when there is no previous data partially received (TCP)
-	int RecvClientPacket(int iSockFD_);
+	int RecvClientPacket(Connection* pConnection_);
 	
 	// Receive data from a client and add it to the previous data partially received (TCP)
-	int RecvClientPacketWithPreData(int iSockFD_, InComplete_Packet* pInCompletePacket_);
+	int RecvClientPacketWithPreData(Connection* pConnection_);
 	
 	// Send the IP and Port of the least busy server to the client
-	int SendResponseToClient(int iSockFD_, unsigned char* pRecvBuff_);
+	int SendResponseToClient(Connection* pConnection_, unsigned char* pRecvBuff_, size_t uiRecvLength_);
 	
 	// Send a TCP packet in the queue,  which contains TCP packets that were sent out partially
-	int SendTCPQueuePacket(int iSockFD_);
+	int SendTCPQueuePacket(Connection* pConnection_);
 	
 	// Send all of th UDP packets in the queue until space is not available or queue is empty
 	int SendUDPQueuePacket(int iSockFD_);
 	
 	// Add a new server to the server list, which other threads access by read operations
-	void AddNewServer(Server_Data_Access_Info* pServerInfo_, unsigned char* pRecvBuff_);
+	// Return -1 on Failure
+	// Return 0 on Success
+	int AddNewServer(Server_Data_Access_Info* pServerInfo_, unsigned char* pRecvBuff_, int iPacketType_);
+	
+	// Give a server a slot in the arrays shared among all the threads
+	// Return -1 on Failure (The server has no slot)
+	// Return 0 on Success
+	int RegisterServer(Server_Data_Access_Info* pServerInfo_, unsigned short usPort_, unsigned short usCapacity_);
 	
 	// Accept an incoming connection and register the socket to the epoll descriptor
-	int AcceptConnection(int iListenSockFD_, sockaddr_in* pSockAddr_, socklen_t* pAddrLen_);
+	int AcceptConnection(int iListenSockFD_, int iConnectionType_, sockaddr_in* pSockAddr_, socklen_t* pAddrLen_);
 	
 	// Update the status of a server with the new value transferred from that server
-	void UpdateServerStatus(Server_Data_Access_Info* pServerInfo_, unsigned char* pReceivedData_);
+	void UpdateServerStatus(Server_Data_Access_Info* pServerInfo_, unsigned char* pReceivedData_, int iPacketType_);
+	
+	// Handle a packet from a server whose data section has completely been received
+	// Return -1 if the server could not be added
+	// Return 0 on Success
+	int ProcessServerPacket(Server_Data_Access_Info* pServerInfo_, int iPacketType_, unsigned char* pRecvBuff_);
+	
+	// Send a Ping packet to each server that this thread manages if it is time to do so
+	int PingServers();
+	
+	// Hand some servers off to the thread with the fewest servers if this thread has too many of them
+	int RebalanceServers();
+	
+	// Print how many partial and queued packets this thread keeps from time to time while it has any
+	int ReportPendingPackets();
+	
+	// Check if a server can be handed off to another thread
+	bool CanHandOffServer(const Connection* pConnection_);
+	
+	// Hand a server off to another thread
+	int HandOffServer(Connection* pConnection_, int iTargetThreadIndex_);
+	
+	// Take over the servers handed off to this thread
+	int TakeOverServers();
+	
+	// Take over a server handed off to this thread
+	void TakeOverServer(const Server_Handoff* pHandoff_);
+	
+	// Rank every running server and publish the least busy ones as a new snapshot (Aggregator thread)
+	int BuildServerSnapshot(unsigned long long* pBuildCost_);
+	
+	// Choose the least busy server from the snapshot and fill the buffer with its address
+	int GetSnapshotServer(unsigned char* pBuff_, int* pThreadIndex_, int* pListIndex_, int* pArrIndex_);
+	
+	// Choose the least busy server from a snapshot that this thread has acquired
+	int ChooseSnapshotServer(const Server_Snapshot* pSnapshot_, unsigned char* pBuff_, int* pThreadIndex_, int* pListIndex_, int* pArrIndex_);
+	
+	// Send a Ping packet to a server to measure its latency
+	void SendPingPacket(Connection* pConnection_, unsigned long long ulCurrentTime_);
+	
+	// Update the latency of a server with the round trip time of the Ping packet that the server has answered
+	void UpdateServerLatency(Server_Data_Access_Info* pServerInfo_, unsigned char* pRecvBuff_);
+	
+	// Publish the latency of a server so that other threads can read it
+	void PublishServerLatency(int iListIndex_, int iArrIndex_, unsigned long ulLatency_);
+	
+	// Get the current time in microseconds (Monotonic clock)
+	unsigned long long GetCurrentTime();
 
 	// Wrapper for epoll_ctl() 
 	int Epoll_CTL_Wrapper(int iOption_, int iSockFD_, unsigned int uiEvent_);
 	
+	// Stop watching a descriptor before it is closed or handed off
+	int StopWatching(Connection* pConnection_);
+	
+	// Get the user data of an io_uring request on a connection
+	unsigned long long GetIOUringUserData(const Connection* pConnection_, int iOperation_);
+	
+	// Make the io_uring requests that a connection needs for the events that the thread watches
+	int ArmIOUringRequests(Connection* pConnection_);
+	
+	// Cancel every io_uring request in flight on a connection
+	int CancelIOUringRequests(Connection* pConnection_);
+	
+	// Handle an io_uring completion
+	int HandleIOUringCompletion(unsigned long long ulUserData_, int iResult_, unsigned int uiFlags_);
+	
+	// Watch a socket accepted by a multishot accept
+	int AcceptIOUringConnection(Connection* pListenConnection_, int iSockFD_);
+	
+	// Hand the data received by a multishot recv to the client handlers
+	int HandleIOUringRecv(Connection* pConnection_, int iResult_, unsigned int uiFlags_);
+	
+	// Receive data on a connection (From the data received by a multishot recv if there is any)
+	ssize_t RecvFromConnection(Connection* pConnection_, void* pBuffer_, size_t uiLength_);
+	
 	// Add a partial TCP packet to the receive queue in order to receive the rest of the packet later from where it left off
-	void AddTCPPacketToRecvQueue(int iSockFD_, int iPacketType_, size_t uiBufferLength_, size_t uiOffset_, unsigned char* pRecvBuff_);
+	int AddTCPPacketToRecvQueue(Connection* pConnection_, int iPacketType_, size_t uiBufferLength_, size_t uiOffset_, unsigned char* pRecvBuff_);
 	
-	// Erase a TCP packet from the receive queue and release memory
-	void RemoveTCPRecvQueuePacket(int iSockFD_, InComplete_Packet* pInCompletePacket_);
+	// Erase a TCP packet from the receive queue and give it back to the packet pool
+	void RemoveTCPRecvQueuePacket(Connection* pConnection_);
 	
 	// Add a partial TCP packet to the send queue in order to send the rest of the packet when space is availabe
-	void AddTCPPacketToSendQueue(int iSocket_, unsigned char* pSendBuff_, size_t uiRemainBytes_); 
+	int AddTCPPacketToSendQueue(Connection* pConnection_, unsigned char* pSendBuff_, size_t uiRemainBytes_);
 	
-	// Erase a TCP packet from the send queue and release memory
-	void RemoveTCPSendQueuePacket(int iSockFD_, InComplete_Packet* pPacket_); //
+	// Erase a TCP packet from the send queue and give it back to the packet pool
+	void RemoveTCPSendQueuePacket(Connection* pConnection_);
 	
 	// Allocate memory to store information about the new servers
-	void AllocateMemoryForNewServers(); 
+	int AllocateMemoryForNewServers(); 
+	
+	// Take a slot for a new server
+	int AcquireServerSlot();
+	
+	// Give back the slot of a disconnected server
+	void ReleaseServerSlot(int iSlotIndex_);
 };
 
@@ -0,0 +1,73 @@
+#include "CMaglevTable.h"
+
+// Constructor
+CMaglevTable::CMaglevTable()
+{
+}
+
+// Destructor
+CMaglevTable::~CMaglevTable()
+{
+}
+
+// Rebuild the lookup table
+// Each backend has its own permutation of the entries defined by an offset and a skip derived from its ID.
+// Backends take turns claiming the next entry in their permutation that has not been claimed yet until every entry is claimed.
+void CMaglevTable::Build(const std::vector<unsigned long long>& vecBackendIDs_)
+{
+	size_t uiBackendCounts = vecBackendIDs_.size();
+	if (0 == uiBackendCounts)
+	{
+		m_vecLookupTable.clear();
+		return;
+	}
+	
+	// The next entry in the permutation of each backend, and the distance to the entry after it
+	std::vector<unsigned long> vecNextEntry(uiBackendCounts);
+	std::vector<unsigned long> vecSkip(uiBackendCounts);
+	for (size_t i = 0; i < uiBackendCounts; ++i)
+	{
+		vecNextEntry[i] = Hash(vecBackendIDs_[i]) % MAGLEV_TABLE_SIZE;
+		vecSkip[i] = Hash(vecBackendIDs_[i] ^ 0x5851F42D4C957F2DULL) % (MAGLEV_TABLE_SIZE - 1) + 1;
+	}
+	
+	m_vecLookupTable.assign(MAGLEV_TABLE_SIZE, -1);
+	
+	size_t uiFilledCounts = 0;
+	while (1)
+	{
+		for (size_t i = 0; i < uiBackendCounts; ++i)
+		{
+			// Find the next entry that has not been claimed by any backend
+			unsigned long uiEntry = vecNextEntry[i];
+			while (-1 != m_vecLookupTable[uiEntry])
+				uiEntry = (uiEntry + vecSkip[i]) % MAGLEV_TABLE_SIZE;
+			
+			m_vecLookupTable[uiEntry] = (int)i;
+			vecNextEntry[i] = (uiEntry + vecSkip[i]) % MAGLEV_TABLE_SIZE;
+			
+			if (++uiFilledCounts == MAGLEV_TABLE_SIZE)
+				return;
+		}
+	}
+}
+
+// Get the index of the backend (in the vector given to Build()) for a key
+// Return -1 if there is no backend
+int CMaglevTable::Lookup(unsigned long long ulKey_) const
+{
+	if (m_vecLookupTable.empty())
+		return -1;
+	
+	return m_vecLookupTable[Hash(ulKey_) % MAGLEV_TABLE_SIZE];
+}
+
+// Mix the bits of a 64-bit value (splitmix64 finalizer)
+// Keys and IDs chosen by clients and servers are often sequential, so they need to be spread over the table.
+unsigned long long CMaglevTable::Hash(unsigned long long ulValue_)
+{
+	ulValue_ += 0x9E3779B97F4A7C15ULL;
+	ulValue_ = (ulValue_ ^ (ulValue_ >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	ulValue_ = (ulValue_ ^ (ulValue_ >> 27)) * 0x94D049BB133111EBULL;
+	return ulValue_ ^ (ulValue_ >> 31);
+}
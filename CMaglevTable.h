@@ -0,0 +1,35 @@
+#pragma once
+#include <stddef.h>
+#include <vector>
+
+// The number of entries in a Maglev lookup table
+// It must be a prime number, and it should be much larger than the number of servers
+// so that each server gets almost the same number of entries.
+#define MAGLEV_TABLE_SIZE 65537
+
+// Maglev consistent hashing lookup table
+// Each backend fills the table with its own permutation of the entries in turn,
+// so every backend owns almost the same number of entries,
+// and adding or removing a backend changes only a small number of entries owned by other backends.
+// A lookup is a single array access.
+class CMaglevTable
+{
+public:
+	CMaglevTable(); // Constructor
+	~CMaglevTable(); // Destructor
+	
+	// Rebuild the lookup table
+	// Each backend is identified by a 64-bit value that does not change when the table is rebuilt (ex. a hash value of its address).
+	// Backends should be given in the same order whenever the same set of backends is given.
+	void Build(const std::vector<unsigned long long>& vecBackendIDs_);
+	
+	// Get the index of the backend (in the vector given to Build()) for a key
+	// Return -1 if there is no backend
+	int Lookup(unsigned long long ulKey_) const;
+	
+	// Mix the bits of a 64-bit value (splitmix64 finalizer)
+	static unsigned long long Hash(unsigned long long ulValue_);
+	
+private:
+	std::vector<int> m_vecLookupTable; // Backend index of each entry
+};
@@ -0,0 +1,109 @@
+#include "CPacketPool.h"
+#include <stdlib.h>
+
+// Constructor
+// A block has to hold a free list link, and the next block must start on a boundary suitable for any type
+CPacketPool::CPacketPool(size_t uiBlockSize_)
+{
+	const size_t uiAlignment = alignof(max_align_t);
+	if (uiBlockSize_ < sizeof(Free_Block))
+		uiBlockSize_ = sizeof(Free_Block);
+	
+	m_uiBlockSize = (uiBlockSize_ + uiAlignment - 1) / uiAlignment * uiAlignment;
+	m_pFreeList = NULL;
+	
+	m_uiInUseCounts = 0;
+	m_uiPeakInUseCounts = 0;
+	m_ulAllocationCounts = 0;
+}
+
+// Destructor
+CPacketPool::~CPacketPool()
+{
+	for (size_t i = 0; i < m_vecSlabs.size(); ++i)
+		free(m_vecSlabs[i]);
+}
+
+// Get a block of at least the block size
+// Return NULL on Failure
+void* CPacketPool::Allocate()
+{
+	if (NULL == m_pFreeList && -1 == AddSlab())
+		return NULL;
+	
+	Free_Block* pBlock = m_pFreeList;
+	m_pFreeList = pBlock->pNext;
+	
+	++m_ulAllocationCounts;
+	if (++m_uiInUseCounts > m_uiPeakInUseCounts)
+		m_uiPeakInUseCounts = m_uiInUseCounts;
+	
+	return pBlock;
+}
+
+// Give a block back to the pool
+// The block is handed out again before any other free block, while it is still in the cache.
+void CPacketPool::Release(void* pBlock_)
+{
+	if (NULL == pBlock_)
+		return;
+	
+	Free_Block* pBlock = (Free_Block*)pBlock_;
+	pBlock->pNext = m_pFreeList;
+	m_pFreeList = pBlock;
+	
+	--m_uiInUseCounts;
+}
+
+// Get the number of blocks handed out and not released yet
+size_t CPacketPool::GetInUseCounts() const
+{
+	return m_uiInUseCounts;
+}
+
+// Get the largest number of blocks in use at once since ResetPeakInUseCounts()
+size_t CPacketPool::GetPeakInUseCounts() const
+{
+	return m_uiPeakInUseCounts;
+}
+
+// Get the number of slabs allocated so far
+size_t CPacketPool::GetSlabCounts() const
+{
+	return m_vecSlabs.size();
+}
+
+// Get the number of blocks handed out so far
+unsigned long long CPacketPool::GetAllocationCounts() const
+{
+	return m_ulAllocationCounts;
+}
+
+// Start measuring the peak again from the current number of blocks in use
+void CPacketPool::ResetPeakInUseCounts()
+{
+	m_uiPeakInUseCounts = m_uiInUseCounts;
+}
+
+// Allocate a slab and put its blocks on the free list
+// The blocks are linked in address order, so blocks handed out one after another are next to each other.
+// Return -1 on Failure
+// Return 0 on Success
+int CPacketPool::AddSlab()
+{
+	void* pSlab = NULL;
+	if (0 != posix_memalign(&pSlab, PACKET_POOL_ALIGNMENT, m_uiBlockSize * PACKET_POOL_SLAB_SIZE))
+		return -1;
+	
+	m_vecSlabs.push_back(pSlab);
+	
+	unsigned char* pBlocks = (unsigned char*)pSlab;
+	for (int i = PACKET_POOL_SLAB_SIZE - 1; i >= 0; --i)
+	{
+		Free_Block* pBlock = (Free_Block*)(pBlocks + i * m_uiBlockSize);
+		pBlock->pNext = m_pFreeList;
+		m_pFreeList = pBlock;
+	}
+	
+	return 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <stddef.h>
+#include <vector>
+
+// The number of blocks in a slab
+#define PACKET_POOL_SLAB_SIZE 64
+
+// Slabs start on this boundary (A cache line)
+#define PACKET_POOL_ALIGNMENT 64
+
+// Fixed-size blocks for the packets that a thread keeps between epoll events (Partial TCP packets and queued UDP packets)
+// Blocks are carved out of slabs of PACKET_POOL_SLAB_SIZE blocks, and a released block goes on a free list to be handed out again.
+// So a thread allocates memory only when it keeps more packets than it has ever kept before, instead of on every partial packet.
+// Slabs are never released until the pool is destroyed. Only the thread that owns the pool uses it, so the pool needs no lock.
+class CPacketPool
+{
+public:
+	CPacketPool(size_t uiBlockSize_); // Constructor
+	~CPacketPool(); // Destructor
+	
+	// Get a block of at least the block size (NULL on Failure)
+	void* Allocate();
+	
+	// Give a block back to the pool
+	void Release(void* pBlock_);
+	
+	// Occupancy (For statistics)
+	size_t GetInUseCounts() const; // The number of blocks handed out and not released yet
+	size_t GetPeakInUseCounts() const; // The largest number of blocks in use at once since ResetPeakInUseCounts()
+	size_t GetSlabCounts() const; // The number of slabs allocated so far
+	unsigned long long GetAllocationCounts() const; // The number of blocks handed out so far
+	
+	// Start measuring the peak again from the current number of blocks in use
+	void ResetPeakInUseCounts();
+
+private:
+	// A block on the free list stores the next free block in itself
+	struct Free_Block
+	{
+		Free_Block* pNext;
+	};
+	
+	size_t m_uiBlockSize; // Rounded up, so every block stays aligned for any of the packets
+	Free_Block* m_pFreeList;
+	std::vector<void*> m_vecSlabs;
+	
+	size_t m_uiInUseCounts;
+	size_t m_uiPeakInUseCounts;
+	unsigned long long m_ulAllocationCounts;
+
+private:
+	// Allocate a slab and put its blocks on the free list
+	// Return -1 on Failure
+	// Return 0 on Success
+	int AddSlab();
+};
@@ -0,0 +1,151 @@
+#include "CServerHeap.h"
+
+// Constructor
+CServerHeap::CServerHeap()
+{
+}
+
+// Destructor
+CServerHeap::~CServerHeap()
+{
+}
+
+// Insert a server into the heap, or change the key of a server already in the heap
+// O(log n)
+void CServerHeap::Update(int iSlotIndex_, long int iKey_)
+{
+	if ((size_t)iSlotIndex_ >= m_vecPosition.size())
+		m_vecPosition.resize(iSlotIndex_ + 1, -1);
+	
+	int iPosition = m_vecPosition[iSlotIndex_];
+	
+	// A new server
+	if (-1 == iPosition)
+	{
+		m_vecSlotIndex.push_back(iSlotIndex_);
+		m_vecKey.push_back(iKey_);
+		m_vecPosition[iSlotIndex_] = m_vecSlotIndex.size() - 1;
+		SiftUp(m_vecSlotIndex.size() - 1);
+		return;
+	}
+	
+	long int iOldKey = m_vecKey[iPosition];
+	m_vecKey[iPosition] = iKey_;
+	
+	if (iKey_ < iOldKey)
+		SiftUp(iPosition);
+	else if (iKey_ > iOldKey)
+		SiftDown(iPosition);
+}
+
+// Remove a server from the heap if it is in the heap
+// O(log n)
+void CServerHeap::Remove(int iSlotIndex_)
+{
+	if ((size_t)iSlotIndex_ >= m_vecPosition.size())
+		return;
+	
+	int iPosition = m_vecPosition[iSlotIndex_];
+	if (-1 == iPosition)
+		return;
+	
+	// Move the last element into the removed position
+	size_t uiLastPosition = m_vecSlotIndex.size() - 1;
+	Swap(iPosition, uiLastPosition);
+	
+	m_vecSlotIndex.pop_back();
+	m_vecKey.pop_back();
+	m_vecPosition[iSlotIndex_] = -1;
+	
+	if ((size_t)iPosition < uiLastPosition)
+	{
+		SiftUp(iPosition);
+		SiftDown(iPosition);
+	}
+}
+
+// Remove every server from the heap
+// Memory already allocated is kept for reuse.
+void CServerHeap::Clear()
+{
+	for (size_t i = 0; i < m_vecSlotIndex.size(); ++i)
+		m_vecPosition[m_vecSlotIndex[i]] = -1;
+	
+	m_vecSlotIndex.clear();
+	m_vecKey.clear();
+}
+
+// Return true if there is no server in the heap
+bool CServerHeap::IsEmpty() const
+{
+	return m_vecSlotIndex.empty();
+}
+
+// Get the slot index of the server with the smallest key
+// The heap must not be empty
+int CServerHeap::GetTopSlotIndex() const
+{
+	return m_vecSlotIndex[0];
+}
+
+// Get the smallest key
+// The heap must not be empty
+long int CServerHeap::GetTopKey() const
+{
+	return m_vecKey[0];
+}
+
+// Move an element up until its parent has a smaller key
+void CServerHeap::SiftUp(size_t uiPosition_)
+{
+	while (0 < uiPosition_)
+	{
+		size_t uiParent = (uiPosition_ - 1) / 2;
+		if (m_vecKey[uiParent] <= m_vecKey[uiPosition_])
+			break;
+		
+		Swap(uiParent, uiPosition_);
+		uiPosition_ = uiParent;
+	}
+}
+
+// Move an element down until its children have larger keys
+void CServerHeap::SiftDown(size_t uiPosition_)
+{
+	size_t uiSize = m_vecSlotIndex.size();
+	while (1)
+	{
+		size_t uiSmallest = uiPosition_;
+		size_t uiLeft = uiPosition_ * 2 + 1;
+		size_t uiRight = uiLeft + 1;
+		
+		if (uiLeft < uiSize && m_vecKey[uiLeft] < m_vecKey[uiSmallest])
+			uiSmallest = uiLeft;
+		
+		if (uiRight < uiSize && m_vecKey[uiRight] < m_vecKey[uiSmallest])
+			uiSmallest = uiRight;
+		
+		if (uiSmallest == uiPosition_)
+			break;
+		
+		Swap(uiSmallest, uiPosition_);
+		uiPosition_ = uiSmallest;
+	}
+}
+
+// Swap two elements and update their positions
+void CServerHeap::Swap(size_t uiPosition1_, size_t uiPosition2_)
+{
+	int iSlotIndex1 = m_vecSlotIndex[uiPosition1_];
+	int iSlotIndex2 = m_vecSlotIndex[uiPosition2_];
+	
+	m_vecSlotIndex[uiPosition1_] = iSlotIndex2;
+	m_vecSlotIndex[uiPosition2_] = iSlotIndex1;
+	
+	long int iKey = m_vecKey[uiPosition1_];
+	m_vecKey[uiPosition1_] = m_vecKey[uiPosition2_];
+	m_vecKey[uiPosition2_] = iKey;
+	
+	m_vecPosition[iSlotIndex1] = uiPosition2_;
+	m_vecPosition[iSlotIndex2] = uiPosition1_;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <stddef.h>
+#include <vector>
+
+// Indexed binary min-heap of the servers that a thread manages
+// Each server is identified by its slot index (iListIndex * MAX_SERVER_NUMS_PER_ARRAY + iArrayIndex).
+// The key of a server is how busy the server is (The smaller, the better).
+// Only the thread that manages the servers accesses its heap, so the heap needs no lock.
+class CServerHeap
+{
+public:
+	CServerHeap(); // Constructor
+	~CServerHeap(); // Destructor
+	
+	// Insert a server into the heap, or change the key of a server already in the heap
+	void Update(int iSlotIndex_, long int iKey_);
+	
+	// Remove a server from the heap if it is in the heap
+	void Remove(int iSlotIndex_);
+	
+	// Remove every server from the heap
+	void Clear();
+	
+	// Return true if there is no server in the heap
+	bool IsEmpty() const;
+	
+	// Get the slot index of the server with the smallest key
+	int GetTopSlotIndex() const;
+	
+	// Get the smallest key
+	long int GetTopKey() const;
+	
+private:
+	std::vector<int> m_vecSlotIndex; // Slot indices in heap order
+	std::vector<long int> m_vecKey; // Keys in heap order
+	std::vector<int> m_vecPosition; // Position in the heap of each slot index (-1 if the server is not in the heap)
+	
+private:
+	// Move an element up until its parent has a smaller key
+	void SiftUp(size_t uiPosition_);
+	
+	// Move an element down until its children have larger keys
+	void SiftDown(size_t uiPosition_);
+	
+	// Swap two elements and update their positions
+	void Swap(size_t uiPosition1_, size_t uiPosition2_);
+};
@@ -0,0 +1,112 @@
+#include "CServerSnapshot.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Constructor
+CServerSnapshot::CServerSnapshot()
+{
+	m_pCurrent.store(NULL, std::memory_order_relaxed);
+	m_ulEpoch.store(SNAPSHOT_QUIESCENT_EPOCH + 1, std::memory_order_relaxed);
+	for (int i = 0; i < MAX_SNAPSHOT_READER_COUNTS; ++i)
+		m_stReaders[i].ulEpoch.store(SNAPSHOT_QUIESCENT_EPOCH, std::memory_order_relaxed);
+}
+
+// Destructor
+CServerSnapshot::~CServerSnapshot()
+{
+	// Same as CLoadBalancer, the instance lives as long as the load balancer.
+}
+
+// Get the current snapshot and keep it from being reused until Release()
+// The fence keeps the pointer from being loaded before the epoch is announced.
+// If the writer has not seen the announcement, the pointer loaded here is the one that the writer has just published.
+// Return NULL if nothing has been published
+const Server_Snapshot* CServerSnapshot::Acquire(int iReaderIndex_)
+{
+	m_stReaders[iReaderIndex_].ulEpoch.store(m_ulEpoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	
+	return m_pCurrent.load(std::memory_order_acquire);
+}
+
+// Tell the writer that the reader is done with its snapshot
+// Every read of the snapshot happens before the announcement.
+void CServerSnapshot::Release(int iReaderIndex_)
+{
+	m_stReaders[iReaderIndex_].ulEpoch.store(SNAPSHOT_QUIESCENT_EPOCH, std::memory_order_release);
+}
+
+// Get a snapshot that no reader can see, to be filled and published
+// A reclaimed snapshot is reused if there is one, so the memory that readers touch stays the same once the load balancer is running.
+// Return NULL on Failure
+Server_Snapshot* CServerSnapshot::Allocate()
+{
+	if (!m_vecFree.empty())
+	{
+		Server_Snapshot* pSnapshot = m_vecFree.back();
+		m_vecFree.pop_back();
+		
+		return pSnapshot;
+	}
+	
+	void* pMemory = NULL;
+	if (0 != posix_memalign(&pMemory, SERVER_SNAPSHOT_ALIGNMENT, sizeof(Server_Snapshot)))
+		return NULL;
+	
+	memset(pMemory, 0, sizeof(Server_Snapshot));
+	return (Server_Snapshot*)pMemory;
+}
+
+// Replace the current snapshot
+// Everything written on the snapshot before this call is visible to a reader that gets it.
+// The replaced snapshot is retired in the current epoch, and the epoch advances.
+void CServerSnapshot::Publish(Server_Snapshot* pSnapshot_)
+{
+	Server_Snapshot* pOldSnapshot = m_pCurrent.exchange(pSnapshot_, std::memory_order_acq_rel);
+	
+	// Only the writer advances the epoch, so it is read without ordering
+	unsigned long long ulEpoch = m_ulEpoch.load(std::memory_order_relaxed);
+	if (NULL != pOldSnapshot)
+	{
+		pOldSnapshot->ulRetireEpoch = ulEpoch;
+		m_vecRetired.push_back(pOldSnapshot);
+	}
+	
+	m_ulEpoch.store(ulEpoch + 1, std::memory_order_release);
+	
+	// Pairs with the fence in Acquire(), so a reader that is about to load the old pointer has announced its epoch by the time it is checked
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	
+	Reclaim();
+}
+
+// Get the number of replaced snapshots that are still waiting for readers
+size_t CServerSnapshot::GetRetiredCounts() const
+{
+	return m_vecRetired.size();
+}
+
+// Move the retired snapshots that no reader can be reading to the free list
+// A reader in epoch E may be reading a snapshot retired in epoch E or later, but not one retired before E.
+void CServerSnapshot::Reclaim()
+{
+	unsigned long long ulMinEpoch = m_ulEpoch.load(std::memory_order_relaxed);
+	for (int i = 0; i < MAX_SNAPSHOT_READER_COUNTS; ++i)
+	{
+		// Pairs with Release(), so the reader has finished reading before its snapshot is reused
+		unsigned long long ulEpoch = m_stReaders[i].ulEpoch.load(std::memory_order_acquire);
+		if (SNAPSHOT_QUIESCENT_EPOCH != ulEpoch && ulEpoch < ulMinEpoch)
+			ulMinEpoch = ulEpoch;
+	}
+	
+	size_t uiKeptCounts = 0;
+	for (size_t i = 0; i < m_vecRetired.size(); ++i)
+	{
+		if (m_vecRetired[i]->ulRetireEpoch < ulMinEpoch)
+			m_vecFree.push_back(m_vecRetired[i]);
+		else
+			m_vecRetired[uiKeptCounts++] = m_vecRetired[i];
+	}
+	
+	m_vecRetired.resize(uiKeptCounts);
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+// The number of servers in a snapshot (The least busy ones)
+// Readers scan every entry on each request, so the snapshot must stay within a few cache lines.
+#define SERVER_SNAPSHOT_SIZE 16
+
+// The maximum number of threads that read snapshots (Each reader has its own index)
+#define MAX_SNAPSHOT_READER_COUNTS 16
+
+// Snapshots start on this boundary (A cache line)
+#define SERVER_SNAPSHOT_ALIGNMENT 64
+
+// The epoch of a reader that is not reading any snapshot (The global epoch starts right after it)
+#define SNAPSHOT_QUIESCENT_EPOCH 0ULL
+
+// A server in a snapshot
+struct Snapshot_Entry
+{
+	int iThreadIndex; // The thread that manages the server
+	int iSlotIndex; // The slot of the server in the arrays of that thread
+	unsigned int uiGeneration; // The generation of the slot when the snapshot was built
+	unsigned int uiIP; // Network byte order
+	unsigned short usPort; // Network byte order
+	long int iScore; // How busy the server was when the snapshot was built (The smaller, the better)
+	long int iScorePerClient; // How much busier the server gets with each client assigned to it
+	long int iInFlightCounts; // Clients assigned to the server since its last status update when the snapshot was built
+};
+
+// The least busy servers at a point in time, ordered by their scores
+// A snapshot is never modified once it has been published, so readers need no lock.
+struct Server_Snapshot
+{
+	unsigned long long ulSequence; // Increases with each snapshot, so a reader can tell a new snapshot from an old one at the same address
+	unsigned long long ulBuildTime; // When the snapshot was built (Microseconds, monotonic clock)
+	unsigned long long ulBuildCost; // How long it took to build the snapshot (Microseconds)
+	unsigned long long ulMembershipVersion; // The sum of the membership versions of every thread when the snapshot was built
+	int iEntryCounts;
+	Snapshot_Entry stEntries[SERVER_SNAPSHOT_SIZE];
+	
+	unsigned long long ulRetireEpoch; // The epoch in which the snapshot was replaced (Only used by the writer)
+};
+
+// Publishes immutable snapshots from one writer to many readers through an atomic pointer
+// A replaced snapshot is reused only after every reader that could have seen it has finished with it (Epoch-based reclamation).
+// A reader announces the epoch it has entered before it loads the pointer, and announces that it is quiescent when it is done.
+// The writer advances the epoch after each replacement, so a snapshot replaced in epoch E is no longer read once every reader is quiescent or in a later epoch.
+// Readers never wait, and the writer never waits either. It allocates another snapshot while old ones are still being read.
+class CServerSnapshot
+{
+public:
+	CServerSnapshot(); // Constructor
+	~CServerSnapshot(); // Destructor
+	
+	// Get the current snapshot and keep it from being reused until Release() (NULL if nothing has been published)
+	const Server_Snapshot* Acquire(int iReaderIndex_);
+	
+	// Tell the writer that the reader is done with its snapshot
+	void Release(int iReaderIndex_);
+	
+	// Get a snapshot that no reader can see, to be filled and published (Only the writer calls this)
+	Server_Snapshot* Allocate();
+	
+	// Replace the current snapshot (Only the writer calls this)
+	void Publish(Server_Snapshot* pSnapshot_);
+	
+	// Get the number of replaced snapshots that are still waiting for readers (For statistics, only the writer calls this)
+	size_t GetRetiredCounts() const;
+
+private:
+	// The epoch announced by each reader, each on its own cache line
+	struct alignas(SERVER_SNAPSHOT_ALIGNMENT) Reader_Epoch
+	{
+		std::atomic<unsigned long long> ulEpoch;
+	};
+	
+	alignas(SERVER_SNAPSHOT_ALIGNMENT) std::atomic<Server_Snapshot*> m_pCurrent; // The current snapshot
+	alignas(SERVER_SNAPSHOT_ALIGNMENT) std::atomic<unsigned long long> m_ulEpoch; // The global epoch
+	Reader_Epoch m_stReaders[MAX_SNAPSHOT_READER_COUNTS];
+	
+	std::vector<Server_Snapshot*> m_vecRetired; // Replaced snapshots that readers may still be reading
+	std::vector<Server_Snapshot*> m_vecFree; // Snapshots that can be reused
+
+private:
+	// Move the retired snapshots that no reader can be reading to the free list
+	void Reclaim();
+};
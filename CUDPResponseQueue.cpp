@@ -0,0 +1,115 @@
+#include "CUDPResponseQueue.h"
+#include <string.h>
+#include <algorithm>
+
+// Constructor
+CUDPResponseQueue::CUDPResponseQueue(int iOverflowPolicy_)
+{
+	m_ulHead = 0;
+	m_ulTail = 0;
+	
+	m_iOverflowPolicy = iOverflowPolicy_;
+	
+	m_uiPeakCounts = 0;
+	m_ulQueuedCounts = 0;
+	m_ulDroppedCounts = 0;
+}
+
+// Destructor
+CUDPResponseQueue::~CUDPResponseQueue()
+{
+}
+
+// Add a response at the end, or handle it according to the overflow policy if the ring is full
+// With UOP_PAUSE_READING, the caller stops reading requests before the ring is full, so the ring never overflows. If it does, the new response is dropped.
+// Return false if the response has been dropped
+bool CUDPResponseQueue::Push(const unsigned char* szResponse_, const sockaddr_in* pSockAddr_, socklen_t uiAddrLen_)
+{
+	if (IsFull())
+	{
+		++m_ulDroppedCounts;
+		if (UOP_DROP_OLDEST != m_iOverflowPolicy)
+			return false;
+		
+		++m_ulHead;
+	}
+	
+	Queued_UDP_Packet* pPacket = &m_stPackets[m_ulTail & (UDP_RESPONSE_QUEUE_SIZE - 1)];
+	memcpy(&(pPacket->stSockAddr), pSockAddr_, sizeof(pPacket->stSockAddr));
+	pPacket->uiAddrLen = uiAddrLen_;
+	memcpy(pPacket->szBuffer, szResponse_, RESPONSE_TO_CLIENT_LENGTH);
+	++m_ulTail;
+	
+	++m_ulQueuedCounts;
+	if (GetCounts() > m_uiPeakCounts)
+		m_uiPeakCounts = GetCounts();
+	
+	return true;
+}
+
+// Get the oldest response (The ring must not be empty)
+const Queued_UDP_Packet* CUDPResponseQueue::GetFront() const
+{
+	return &m_stPackets[m_ulHead & (UDP_RESPONSE_QUEUE_SIZE - 1)];
+}
+
+// Get the number of responses from the oldest one to the end of the ring or to the newest one, whichever comes first
+size_t CUDPResponseQueue::GetContiguousCounts() const
+{
+	size_t uiToEnd = UDP_RESPONSE_QUEUE_SIZE - (size_t)(m_ulHead & (UDP_RESPONSE_QUEUE_SIZE - 1));
+	return std::min(uiToEnd, GetCounts());
+}
+
+// Remove the oldest responses once they have been sent
+void CUDPResponseQueue::PopFront(size_t uiCounts_)
+{
+	m_ulHead += uiCounts_;
+}
+
+// Return true if there is no response in the ring
+bool CUDPResponseQueue::IsEmpty() const
+{
+	return m_ulHead == m_ulTail;
+}
+
+// Return true if a new response does not fit in the ring
+bool CUDPResponseQueue::IsFull() const
+{
+	return UDP_RESPONSE_QUEUE_SIZE == GetCounts();
+}
+
+// Get the number of responses in the ring
+size_t CUDPResponseQueue::GetCounts() const
+{
+	return (size_t)(m_ulTail - m_ulHead);
+}
+
+// Get the number of responses that can be added without overflowing
+size_t CUDPResponseQueue::GetFreeCounts() const
+{
+	return UDP_RESPONSE_QUEUE_SIZE - GetCounts();
+}
+
+// Get the largest number of responses in the ring at once since ResetPeakCounts()
+size_t CUDPResponseQueue::GetPeakCounts() const
+{
+	return m_uiPeakCounts;
+}
+
+// Get the number of responses added so far
+unsigned long long CUDPResponseQueue::GetQueuedCounts() const
+{
+	return m_ulQueuedCounts;
+}
+
+// Get the number of responses dropped so far because the ring was full
+unsigned long long CUDPResponseQueue::GetDroppedCounts() const
+{
+	return m_ulDroppedCounts;
+}
+
+// Start measuring the peak again from the current number of responses
+void CUDPResponseQueue::ResetPeakCounts()
+{
+	m_uiPeakCounts = GetCounts();
+}
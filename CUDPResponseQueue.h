@@ -0,0 +1,87 @@
+#pragma once
+#include <stddef.h>
+#include <netinet/in.h>
+#include "Common_Header.h"
+
+// The number of responses that a thread keeps while its UDP socket has no space (A power of two)
+#define UDP_RESPONSE_QUEUE_SIZE 1024
+
+// With UOP_PAUSE_READING, a thread reads requests again once the backlog is down to this number of responses
+#define UDP_RESPONSE_QUEUE_RESUME_COUNTS (UDP_RESPONSE_QUEUE_SIZE / 2)
+
+// What to do with a response when the backlog is full (Chosen at startup)
+enum UDP_OVERFLOW_POLICY
+{
+	UOP_DROP_OLDEST = 0, // Drop the response that has waited the longest (Its client is the most likely to have given up)
+	UOP_DROP_NEWEST = 1, // Drop the new response
+	UOP_PAUSE_READING = 2, // Stop reading requests until the backlog shrinks, so requests wait in the socket buffer instead
+	UOP_MAX = 3,
+};
+
+// For sendto() with UDP,
+// With UDP, the entire message shall be read or written in a single operation, so there's no need to worry about partial packet transmission.
+// Thus, even if recvfrom() fails, the load balancer can simply come back later without storing any data.
+// However, it is possible that sendto() will fail if space is not available for a packet to be transmitted at the moment of a sendto() call.
+// The packet needs to be stored until space is available.
+// This guarantees that the packet will be sent out unless the backlog overflows, but does not guarantee that the packet will be delivered.
+struct Queued_UDP_Packet
+{
+	// Destination Address
+	sockaddr_in stSockAddr;
+	
+	// Size of Destination Address
+	socklen_t uiAddrLen;
+	
+	// The response (Every response is RESPONSE_TO_CLIENT_LENGTH bytes long)
+	unsigned char szBuffer[RESPONSE_TO_CLIENT_LENGTH];
+};
+
+// Fixed-capacity ring of the responses that a thread could not send yet, oldest first
+// The responses are stored in the ring itself, so queueing a response allocates no memory however many clients are waiting.
+// Only the thread that owns the UDP socket queues and sends the responses, so the ring needs no lock.
+class CUDPResponseQueue
+{
+public:
+	CUDPResponseQueue(int iOverflowPolicy_); // Constructor
+	~CUDPResponseQueue(); // Destructor
+	
+	// Add a response at the end, or handle it according to the overflow policy if the ring is full
+	// Return false if the response has been dropped
+	bool Push(const unsigned char* szResponse_, const sockaddr_in* pSockAddr_, socklen_t uiAddrLen_);
+	
+	// Get the oldest response (The ring must not be empty)
+	// It is followed in memory by GetContiguousCounts() - 1 responses in order, so they can be sent at once.
+	const Queued_UDP_Packet* GetFront() const;
+	
+	// Get the number of responses from the oldest one to the end of the ring or to the newest one, whichever comes first
+	size_t GetContiguousCounts() const;
+	
+	// Remove the oldest responses once they have been sent
+	void PopFront(size_t uiCounts_);
+	
+	bool IsEmpty() const;
+	bool IsFull() const;
+	size_t GetCounts() const; // The number of responses in the ring
+	size_t GetFreeCounts() const; // The number of responses that can be added without overflowing
+	
+	// Statistics
+	size_t GetPeakCounts() const; // The largest number of responses in the ring at once since ResetPeakCounts()
+	unsigned long long GetQueuedCounts() const; // The number of responses added so far
+	unsigned long long GetDroppedCounts() const; // The number of responses dropped so far because the ring was full
+	
+	// Start measuring the peak again from the current number of responses
+	void ResetPeakCounts();
+
+private:
+	Queued_UDP_Packet m_stPackets[UDP_RESPONSE_QUEUE_SIZE];
+	
+	// Positions of the oldest response and of the next response to be added (They only increase, and wrap around the ring with a mask)
+	unsigned long long m_ulHead;
+	unsigned long long m_ulTail;
+	
+	int m_iOverflowPolicy; // One of UDP_OVERFLOW_POLICY
+	
+	size_t m_uiPeakCounts;
+	unsigned long long m_ulQueuedCounts;
+	unsigned long long m_ulDroppedCounts;
+};
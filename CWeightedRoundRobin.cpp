@@ -0,0 +1,119 @@
+#include "CWeightedRoundRobin.h"
+
+// Constructor
+CWeightedRoundRobin::CWeightedRoundRobin()
+{
+	m_uiCursor = 0;
+}
+
+// Destructor
+CWeightedRoundRobin::~CWeightedRoundRobin()
+{
+}
+
+// Rebuild one period of the sequence
+// On each step, every backend adds its weight to its current value,
+// and the backend with the largest current value is chosen and subtracts the sum of the weights from its current value.
+// After (the sum of the weights) steps, every current value is back to zero, so the sequence repeats.
+void CWeightedRoundRobin::Build(const std::vector<unsigned short>& vecWeights_, size_t uiStartPart_, size_t uiPartCounts_)
+{
+	m_vecSequence.clear();
+	m_uiCursor = 0;
+	
+	size_t uiBackendCounts = vecWeights_.size();
+	if (0 == uiBackendCounts)
+		return;
+	
+	// Divide the weights by their greatest common divisor to keep the period short
+	long iDivisor = 0;
+	for (size_t i = 0; i < uiBackendCounts; ++i)
+		iDivisor = GetGCD(iDivisor, vecWeights_[i]);
+	
+	std::vector<long> vecWeights(uiBackendCounts);
+	long iTotalWeight = 0;
+	for (size_t i = 0; i < uiBackendCounts; ++i)
+	{
+		vecWeights[i] = vecWeights_[i] / iDivisor;
+		iTotalWeight += vecWeights[i];
+	}
+	
+	// Scale the weights down if the period is still too long
+	// Every backend keeps at least weight 1, so the period may still be as long as the number of backends
+	if (iTotalWeight > MAX_WEIGHTED_ROUND_ROBIN_LENGTH)
+	{
+		long iOldTotalWeight = iTotalWeight;
+		iTotalWeight = 0;
+		for (size_t i = 0; i < uiBackendCounts; ++i)
+		{
+			vecWeights[i] = vecWeights[i] * MAX_WEIGHTED_ROUND_ROBIN_LENGTH / iOldTotalWeight;
+			if (0 == vecWeights[i])
+				vecWeights[i] = 1;
+			
+			iTotalWeight += vecWeights[i];
+		}
+	}
+	
+	// Every backend has the same weight, so the sequence is plain round-robin
+	if ((long)uiBackendCounts == iTotalWeight)
+	{
+		m_vecSequence.resize(uiBackendCounts);
+		for (size_t i = 0; i < uiBackendCounts; ++i)
+			m_vecSequence[i] = (int)i;
+		
+		m_uiCursor = m_vecSequence.size() * uiStartPart_ / uiPartCounts_;
+		return;
+	}
+	
+	m_vecSequence.reserve(iTotalWeight);
+	std::vector<long> vecCurrent(uiBackendCounts, 0);
+	
+	for (long iStep = 0; iStep < iTotalWeight; ++iStep)
+	{
+		size_t uiBest = 0;
+		for (size_t i = 0; i < uiBackendCounts; ++i)
+		{
+			vecCurrent[i] += vecWeights[i];
+			if (vecCurrent[i] > vecCurrent[uiBest])
+				uiBest = i;
+		}
+		
+		vecCurrent[uiBest] -= iTotalWeight;
+		m_vecSequence.push_back((int)uiBest);
+	}
+	
+	m_uiCursor = m_vecSequence.size() * uiStartPart_ / uiPartCounts_;
+}
+
+// Get the index of the next backend (in the vector given to Build())
+// Return -1 if there is no backend
+int CWeightedRoundRobin::Next()
+{
+	if (m_vecSequence.empty())
+		return -1;
+	
+	int iBackendIndex = m_vecSequence[m_uiCursor];
+	if (++m_uiCursor >= m_vecSequence.size())
+		m_uiCursor = 0;
+	
+	return iBackendIndex;
+}
+
+// Get the length of one period of the sequence
+size_t CWeightedRoundRobin::GetLength() const
+{
+	return m_vecSequence.size();
+}
+
+// Get the greatest common divisor of two weights
+// GetGCD(0, n) is n, so the GCD of all the weights can be computed by starting from 0
+long CWeightedRoundRobin::GetGCD(long iValue1_, long iValue2_)
+{
+	while (0 != iValue2_)
+	{
+		long iRemainder = iValue1_ % iValue2_;
+		iValue1_ = iValue2_;
+		iValue2_ = iRemainder;
+	}
+	
+	return iValue1_;
+}
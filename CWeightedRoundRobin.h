@@ -0,0 +1,38 @@
+#pragma once
+#include <stddef.h>
+#include <vector>
+
+// The maximum length of one period of a weighted round-robin sequence
+// If the sum of the weights is larger than this value, the weights are scaled down.
+#define MAX_WEIGHTED_ROUND_ROBIN_LENGTH 4096
+
+// Smooth weighted round-robin (The same algorithm as nginx)
+// One period of the sequence is computed when the set of backends changes,
+// so choosing the next backend is a single array access.
+// A backend with weight 2 appears twice as often as a backend with weight 1,
+// and its appearances are spread across the period instead of being next to each other.
+class CWeightedRoundRobin
+{
+public:
+	CWeightedRoundRobin(); // Constructor
+	~CWeightedRoundRobin(); // Destructor
+	
+	// Rebuild one period of the sequence
+	// The period is divided into uiPartCounts_ parts, and the sequence starts at the beginning of part uiStartPart_.
+	void Build(const std::vector<unsigned short>& vecWeights_, size_t uiStartPart_, size_t uiPartCounts_);
+	
+	// Get the index of the next backend (in the vector given to Build())
+	// Return -1 if there is no backend
+	int Next();
+	
+	// Get the length of one period of the sequence
+	size_t GetLength() const;
+	
+private:
+	std::vector<int> m_vecSequence; // Backend indices of one period
+	size_t m_uiCursor; // Position of the next backend in m_vecSequence
+	
+private:
+	// Get the greatest common divisor of two weights
+	static long GetGCD(long iValue1_, long iValue2_);
+};
@@ -4,9 +4,24 @@
 // from Server to Load Balancer
 // 1. Port packet: packet type (unsigned short) + port number(unsigned short) 
 // 2. Status packet: packet type (unsigned short) + the number of connected clients (long int)
+// 3. Port and capacity packet: packet type (unsigned short) + port number(unsigned short) + capacity(unsigned short)
+//    A server with capacity 4 is expected to handle four times as many clients as a server with capacity 1
+//    A server that sends a Port packet instead is considered to have capacity 1
+// 4. Pong packet: packet type (unsigned short) + the timestamp of the Ping packet being answered (unsigned long long)
+// 5. Status and metrics packet: packet type (unsigned short) + the number of connected clients (long int)
+//    + the number of requests received since the previous status update (unsigned int)
+//    + the number of connections waiting to be accepted (unsigned int) + CPU utilisation in per mille of a core (unsigned int)
+//    The load balancer combines these metrics into the load of the server according to its scoring option
+
+// from Load Balancer to Server
+// 1. Ping packet: packet type (unsigned short) + timestamp (unsigned long long)
+//    The server sends the same timestamp back in a Pong packet as soon as possible, so the load balancer can measure how fast the server responds
+//    A server that never answers is treated as if it responded instantly
 
 // from Client to Load Balancer
 // 1. Server Address Request Packet: packet type (unsigned short)
+// 2. Keyed Server Address Request Packet: packet type (unsigned short) + key (unsigned long long)
+//    Requests with the same key get the same server as long as the set of servers does not change (Maglev consistent hashing)
 
 // from Load Balancer to Client
 // 1. Server Address Response Packet: packet type (unsigned short) + error code(unsigned short) + server port(unsigned short) + server IP(in_addr_t)
@@ -31,15 +46,35 @@
 #define SERVER_PORT_NUM_PACKET_TYPE 10000 /// an arbirary value to indicate that the packet is Server Port Number type
 #define SERVER_PORT_NUM_PACKET_DATA_LENGTH 2 // The length of the data section of Server Port Number Packet
 
+// Server Port Number and Capacity Packet
+#define SERVER_PORT_CAPACITY_PACKET_TYPE 30000 // an arbirary value to indicate that the packet is Server Port Number and Capacity type
+#define SERVER_PORT_CAPACITY_PACKET_DATA_LENGTH 4 // The length of the data section of Server Port Number and Capacity Packet
+
+// The capacity of a server that does not advertise its capacity
+#define DEFAULT_SERVER_CAPACITY 1
+
 // Server Status Update Packet
 #define SERVER_STATUS_UPDATE_PACKET_TYPE 20000 // an arbirary value to indicate that the packet is Server Status Update type
 #define SERVER_STATUS_UPDATE_PACKET_DATA_LENGTH 8 // The length of the data section of Server U Packet
 
+// Server Status and Metrics Packet
+#define SERVER_STATUS_METRICS_PACKET_TYPE 60000 // an arbirary value to indicate that the packet is Server Status and Metrics type
+#define SERVER_STATUS_METRICS_PACKET_DATA_LENGTH 20 // The length of the data section of Server Status and Metrics Packet
+
+// Ping Packet (from Load Balancer to Server)
+#define SERVER_PING_PACKET_TYPE 40000 // an arbirary value to indicate that the packet is Ping type
+#define SERVER_PING_PACKET_DATA_LENGTH 8 // The length of the data section of Ping Packet
+
+// Pong Packet (from Server to Load Balancer)
+#define SERVER_PONG_PACKET_TYPE 50000 // an arbirary value to indicate that the packet is Pong type
+#define SERVER_PONG_PACKET_DATA_LENGTH 8 // The length of the data section of Pong Packet
+
 
 // Between Clients and Load Balancer
 // This length should be the length of the largest packet because a fixed sized buffer is used
-// Now, there is only one type of packet from client to load balancer.
-#define REQUEST_FROM_CLIENT_LENGTH	2
+// Now, there are two types of packet from client to load balancer.
+// The largest one is 10 bytes long
+#define REQUEST_FROM_CLIENT_LENGTH	10
 
 // This length should be the length of the largest packet because a fixed sized buffer is used
 // Now, there are three types of packet from load balancer to client.
@@ -48,6 +83,11 @@
 
 // Server Address Request Packet
 #define SERVER_ADDR_REQUEST_TYPE 10000 // an arbirary value
+#define SERVER_ADDR_REQUEST_LENGTH 2 // The length of Server Address Request Packet
+
+// Keyed Server Address Request Packet
+#define SERVER_ADDR_KEYED_REQUEST_TYPE 10001 // an arbirary value
+#define SERVER_ADDR_KEYED_REQUEST_LENGTH 10 // The length of Keyed Server Address Request Packet
 
 // Response Type for Sever Address Request Packet
 #define SERVER_ADDR_RESPONSE_SUCCESS 0
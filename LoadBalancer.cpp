@@ -6,25 +6,98 @@ struct ThreadData
 	unsigned short usPortForClient; // Port number open to clients
 	unsigned short usPortForServer; // Port number open to servers
 	int iThreadIndex; // Each thread's index used to perform write operations on its own area of global data
+	const Load_Balancer_Options* pOptions; // Options chosen at startup
 };
 
+// Names of the server selection policies used on the command line (Indexed by SERVER_SELECTION_POLICY)
+const char* g_szPolicyNames[SSP_MAX] = { "least-clients", "power-of-d", "weighted-round-robin", "least-latency", "bounded-hash" };
+
+// Names of the metrics used on the command line (Indexed by SERVER_METRIC)
+// The load of a server is that metric alone when its name is given as a scoring option.
+const char* g_szMetricNames[SM_MAX] = { "clients", "requests", "queue", "cpu" };
+
+// Names of the overflow policies of the UDP response backlog used on the command line (Indexed by UDP_OVERFLOW_POLICY)
+const char* g_szOverflowPolicyNames[UOP_MAX] = { "drop-oldest", "drop-newest", "pause" };
+
+// Names of the event engines used on the command line (Indexed by EVENT_ENGINE)
+const char* g_szEventEngineNames[EE_MAX] = { "epoll", "epoll-et", "io_uring" };
+
 // Use the values provided as command line arguments if any
-// load balancer port for clients, load balancer port for servers 
-int ParseArguments(int argc, char* argv[], unsigned short* pLBPortForClient_, unsigned short* pLBPortForServer_);
+// Options (-p policy, -d choices, -s scoring, -b batch, -z zones, -t threshold, -e epsilon, -w window, -r rebalance, -a aggregator, -o overflow, -i engine), load balancer port for clients, load balancer port for servers 
+int ParseArguments(int argc, char* argv[], unsigned short* pLBPortForClient_, unsigned short* pLBPortForServer_, Load_Balancer_Options* pOptions_);
+
+// Get the weight of each metric from a scoring option (a metric name, or weights separated by commas)
+int ParseMetricWeights(const char* szOption_, int* pWeights_);
+
+// Get the subnet of each zone from a zone option (subnets in CIDR notation separated by commas)
+int ParseZones(const char* szOption_, Load_Balancer_Options* pOptions_);
 
 // This is the function invoked on creation of a thread (pthread_create)
 void *ThreadMain(void *pArg_);
 
+// This is the function invoked on creation of the aggregator thread (pthread_create)
+void *AggregatorMain(void *pArg_);
+
 // Main Function
 int main(int argc, char *argv[])
 {
 	unsigned short usPortForClient = LB_PORT_FOR_CLIENT;
 	unsigned short usPortForServer = LB_PORT_FOR_SERVER;
 	
+	Load_Balancer_Options stOptions;
+	stOptions.iSelectionPolicy = SSP_LEAST_CLIENTS;
+	stOptions.iChoiceCounts = DEFAULT_POWER_OF_D_CHOICES;
+	
+	// The load of a server is the number of its clients by default
+	memset(stOptions.iMetricWeights, 0, sizeof(stOptions.iMetricWeights));
+	stOptions.iMetricWeights[SM_CLIENTS] = 1;
+	
+	// Batch mode is disabled by default
+	stOptions.iBatchCounts = 1;
+	
+	// Zone-aware routing is disabled by default
+	stOptions.iZoneCounts = 0;
+	memset(stOptions.stZones, 0, sizeof(stOptions.stZones));
+	stOptions.iZoneSpillThreshold = DEFAULT_ZONE_SPILL_THRESHOLD;
+	
+	stOptions.iLoadBoundPercent = DEFAULT_LOAD_BOUND_PERCENT;
+	
+	// Slow start is disabled by default
+	stOptions.iSlowStartWindow = DEFAULT_SLOW_START_WINDOW;
+	
+	stOptions.iRebalanceThreshold = DEFAULT_SHARD_REBALANCE_THRESHOLD;
+	
+	// The aggregator is disabled by default
+	stOptions.iAggregatorInterval = DEFAULT_AGGREGATOR_INTERVAL;
+	
+	// Responses that have waited the longest are dropped first by default
+	stOptions.iUDPOverflowPolicy = UOP_DROP_OLDEST;
+	
+	// Every thread waits with epoll by default
+	stOptions.iEventEngine = EE_EPOLL;
+	
 	// Use the values provided as command line arguments if any
-	if (-1 == ParseArguments(argc, argv, &usPortForClient, &usPortForServer))
+	if (-1 == ParseArguments(argc, argv, &usPortForClient, &usPortForServer, &stOptions))
+		exit(EXIT_FAILURE);
+	
+	// Every thread must use the same engine, so the kernel is checked once before the threads start
+	if (EE_IO_URING == stOptions.iEventEngine && !CIOUring::IsSupported())
+	{
+		printf("Load balancer io_uring is not supported by the kernel, epoll is used instead\n");
+		stOptions.iEventEngine = EE_EPOLL;
+	}
+	
+	// Every thread must be able to hand servers off to every other thread as soon as it starts
+	if (-1 == CLoadBalancer::SetUpServerHandoff())
 		exit(EXIT_FAILURE);
 	
+	// The aggregator thread only reads what the other threads publish, so it can start first
+	if (0 < stOptions.iAggregatorInterval)
+	{
+		pthread_t uiAggregatorThread;
+		pthread_create(&uiAggregatorThread, NULL, &AggregatorMain, (void*)&stOptions);
+	}
+	
 
 	// Create Threads
 	pthread_t uiThread[MAX_THREAD_COUNTS];
@@ -35,6 +108,7 @@ int main(int argc, char *argv[])
 		stThreadInfo[i].usPortForClient = usPortForClient;
 		stThreadInfo[i].usPortForServer = usPortForServer;
 		stThreadInfo[i].iThreadIndex = i;
+		stThreadInfo[i].pOptions = &stOptions;
 	
 		pthread_create(&uiThread[i], NULL, &ThreadMain, (void*)&stThreadInfo[i]);
 	}
@@ -44,6 +118,7 @@ int main(int argc, char *argv[])
 	stThreadInfo[iLastIndex].usPortForClient = usPortForClient;
 	stThreadInfo[iLastIndex].usPortForServer = usPortForServer;
 	stThreadInfo[iLastIndex].iThreadIndex = iLastIndex;
+	stThreadInfo[iLastIndex].pOptions = &stOptions;
 	ThreadMain((void*)&stThreadInfo[iLastIndex]);
 
 	return 0;
@@ -55,7 +130,7 @@ void *ThreadMain(void *pArg_)
 	struct ThreadData* pData = (ThreadData*)pArg_;
 	
 	// Create an Load Balancer Instance
-	CLoadBalancer* pLoadBalancer =  new CLoadBalancer(pData->usPortForClient, pData->usPortForServer, pData->iThreadIndex);
+	CLoadBalancer* pLoadBalancer =  new CLoadBalancer(pData->usPortForClient, pData->usPortForServer, pData->iThreadIndex, pData->pOptions);
 	
 	//  Set Up the Load Balancer
 	if (-1 == pLoadBalancer->SetUp())
@@ -70,12 +145,170 @@ void *ThreadMain(void *pArg_)
 	return NULL;
 }
 
+// This is the function invoked on creation of the aggregator thread (pthread_create)
+void *AggregatorMain(void *pArg_)
+{
+	// Create an instance that manages no server
+	CLoadBalancer* pAggregator = new CLoadBalancer((const Load_Balancer_Options*)pArg_);
+	
+	// Rebuild the snapshot of the least busy servers
+	pAggregator->RunAggregator();
+	
+	return NULL;
+}
+
 // Use the values provided as command line arguments if any
-// load balancer port for clients, load balancer port for servers 
+// Options (-p policy, -d choices, -s scoring, -b batch, -z zones, -t threshold, -e epsilon, -w window, -r rebalance, -a aggregator, -o overflow, -i engine), load balancer port for clients, load balancer port for servers 
 // Return -1 on Failure
 // Return 0 on Success
-int ParseArguments(int argc, char* argv[], unsigned short* pLBPortForClient_, unsigned short* pLBPortForServer_)
+int ParseArguments(int argc, char* argv[], unsigned short* pLBPortForClient_, unsigned short* pLBPortForServer_, Load_Balancer_Options* pOptions_)
 {
+	int iOption = 0;
+	while (-1 != (iOption = getopt(argc, argv, "p:d:s:b:z:t:e:w:r:a:o:i:")))
+	{
+		if ('p' == iOption)
+		{
+			int iPolicy = 0;
+			while (iPolicy < SSP_MAX && 0 != strcmp(optarg, g_szPolicyNames[iPolicy]))
+				++iPolicy;
+			
+			if (SSP_MAX == iPolicy)
+			{
+				printf("Load balancer Invalid Selection Policy\n");
+				return -1;
+			}
+			
+			pOptions_->iSelectionPolicy = iPolicy;
+		}
+		else if ('d' == iOption)
+		{
+			int iChoiceCounts = atoi(optarg);
+			if (iChoiceCounts < 1)
+			{
+				printf("Load balancer Invalid Number of Choices\n");
+				return -1;
+			}
+			
+			pOptions_->iChoiceCounts = iChoiceCounts;
+		}
+		else if ('b' == iOption)
+		{
+			int iBatchCounts = atoi(optarg);
+			if (iBatchCounts < 1 || MAX_UDP_BATCH_COUNTS < iBatchCounts)
+			{
+				printf("Load balancer Invalid Batch Size\n");
+				return -1;
+			}
+			
+			pOptions_->iBatchCounts = iBatchCounts;
+		}
+		else if ('s' == iOption)
+		{
+			if (-1 == ParseMetricWeights(optarg, pOptions_->iMetricWeights))
+			{
+				printf("Load balancer Invalid Scoring Option\n");
+				return -1;
+			}
+		}
+		else if ('z' == iOption)
+		{
+			if (-1 == ParseZones(optarg, pOptions_))
+			{
+				printf("Load balancer Invalid Zones\n");
+				return -1;
+			}
+		}
+		else if ('t' == iOption)
+		{
+			int iThreshold = atoi(optarg);
+			if (iThreshold < 0 || MAX_ZONE_SPILL_THRESHOLD < iThreshold)
+			{
+				printf("Load balancer Invalid Spill Threshold\n");
+				return -1;
+			}
+			
+			pOptions_->iZoneSpillThreshold = iThreshold;
+		}
+		else if ('e' == iOption)
+		{
+			int iLoadBoundPercent = atoi(optarg);
+			if (iLoadBoundPercent < 0 || MAX_LOAD_BOUND_PERCENT < iLoadBoundPercent)
+			{
+				printf("Load balancer Invalid Load Bound\n");
+				return -1;
+			}
+			
+			pOptions_->iLoadBoundPercent = iLoadBoundPercent;
+		}
+		else if ('w' == iOption)
+		{
+			int iSlowStartWindow = atoi(optarg);
+			if (iSlowStartWindow < 0 || MAX_SLOW_START_WINDOW < iSlowStartWindow)
+			{
+				printf("Load balancer Invalid Slow Start Window\n");
+				return -1;
+			}
+			
+			pOptions_->iSlowStartWindow = iSlowStartWindow;
+		}
+		else if ('r' == iOption)
+		{
+			int iRebalanceThreshold = atoi(optarg);
+			if (iRebalanceThreshold < 0 || MAX_SHARD_REBALANCE_THRESHOLD < iRebalanceThreshold)
+			{
+				printf("Load balancer Invalid Rebalance Threshold\n");
+				return -1;
+			}
+			
+			pOptions_->iRebalanceThreshold = iRebalanceThreshold;
+		}
+		else if ('a' == iOption)
+		{
+			int iAggregatorInterval = atoi(optarg);
+			if (iAggregatorInterval < 0 || MAX_AGGREGATOR_INTERVAL < iAggregatorInterval)
+			{
+				printf("Load balancer Invalid Aggregator Interval\n");
+				return -1;
+			}
+			
+			pOptions_->iAggregatorInterval = iAggregatorInterval;
+		}
+		else if ('o' == iOption)
+		{
+			int iPolicy = 0;
+			while (iPolicy < UOP_MAX && 0 != strcmp(optarg, g_szOverflowPolicyNames[iPolicy]))
+				++iPolicy;
+			
+			if (UOP_MAX == iPolicy)
+			{
+				printf("Load balancer Invalid Overflow Policy\n");
+				return -1;
+			}
+			
+			pOptions_->iUDPOverflowPolicy = iPolicy;
+		}
+		else if ('i' == iOption)
+		{
+			int iEngine = 0;
+			while (iEngine < EE_MAX && 0 != strcmp(optarg, g_szEventEngineNames[iEngine]))
+				++iEngine;
+			
+			if (EE_MAX == iEngine)
+			{
+				printf("Load balancer Invalid Event Engine\n");
+				return -1;
+			}
+			
+			pOptions_->iEventEngine = iEngine;
+		}
+		else
+			return -1;
+	}
+	
+	// Ports are given after the options
+	argc -= optind - 1;
+	argv += optind - 1;
+	
 	if (2 <= argc)
 	{
 		int iLBPortForClient = atoi(argv[1]);
@@ -102,3 +335,100 @@ int ParseArguments(int argc, char* argv[], unsigned short* pLBPortForClient_, un
 	
 	return 0;
 }
+
+// Get the weight of each metric from a scoring option
+// The option is either the name of a metric (ex. requests) or the weights of all the metrics in order (ex. 1,0,10,0 for clients,requests,queue,cpu)
+// Return -1 on Failure
+// Return 0 on Success
+int ParseMetricWeights(const char* szOption_, int* pWeights_)
+{
+	int iWeights[SM_MAX];
+	memset(iWeights, 0, sizeof(iWeights));
+	
+	int iMetric = 0;
+	while (iMetric < SM_MAX && 0 != strcmp(szOption_, g_szMetricNames[iMetric]))
+		++iMetric;
+	
+	if (SM_MAX != iMetric)
+		iWeights[iMetric] = 1;
+	else
+	{
+		const char* pOption = szOption_;
+		for (int i = 0; i < SM_MAX; ++i)
+		{
+			char* pEnd = NULL;
+			long iWeight = strtol(pOption, &pEnd, 10);
+			if (pEnd == pOption || iWeight < 0 || MAX_METRIC_WEIGHT < iWeight)
+				return -1;
+			
+			// Every weight but the last one is followed by a comma
+			if ((SM_MAX - 1 != i && ',' != *pEnd) || (SM_MAX - 1 == i && '\0' != *pEnd))
+				return -1;
+			
+			iWeights[i] = (int)iWeight;
+			pOption = pEnd + 1;
+		}
+	}
+	
+	// At least one metric must be used
+	int iWeightSum = 0;
+	for (int i = 0; i < SM_MAX; ++i)
+		iWeightSum += iWeights[i];
+	
+	if (0 == iWeightSum)
+		return -1;
+	
+	memcpy(pWeights_, iWeights, sizeof(iWeights));
+	
+	return 0;
+}
+
+// Get the subnet of each zone from a zone option
+// Each subnet is in CIDR notation, and its position is the index of the zone (ex. 10.0.1.0/24,10.0.2.0/24 for two zones)
+// Return -1 on Failure
+// Return 0 on Success
+int ParseZones(const char* szOption_, Load_Balancer_Options* pOptions_)
+{
+	Zone_Subnet stZones[MAX_ZONE_COUNTS];
+	int iZoneCounts = 0;
+	
+	const char* pOption = szOption_;
+	while (true)
+	{
+		if (MAX_ZONE_COUNTS == iZoneCounts)
+			return -1;
+		
+		// The address is followed by a slash
+		const char* pSlash = strchr(pOption, '/');
+		if (NULL == pSlash || INET_ADDRSTRLEN <= pSlash - pOption)
+			return -1;
+		
+		char szAddress[INET_ADDRSTRLEN] = { 0, };
+		memcpy(szAddress, pOption, pSlash - pOption);
+		
+		struct in_addr stAddress;
+		if (1 != inet_pton(AF_INET, szAddress, &stAddress))
+			return -1;
+		
+		char* pEnd = NULL;
+		long iPrefixLength = strtol(pSlash + 1, &pEnd, 10);
+		if (pEnd == pSlash + 1 || iPrefixLength < 0 || 32 < iPrefixLength || (',' != *pEnd && '\0' != *pEnd))
+			return -1;
+		
+		// Shifting a 32-bit value by 32 is undefined, so /0 is handled separately
+		uint32_t uiMask = (0 == iPrefixLength) ? 0 : (0xFFFFFFFFU << (32 - iPrefixLength));
+		stZones[iZoneCounts].uiMask = htonl(uiMask);
+		stZones[iZoneCounts].uiNetwork = stAddress.s_addr & stZones[iZoneCounts].uiMask;
+		++iZoneCounts;
+		
+		if ('\0' == *pEnd)
+			break;
+		
+		pOption = pEnd + 1;
+	}
+	
+	memcpy(pOptions_->stZones, stZones, sizeof(stZones[0]) * iZoneCounts);
+	pOptions_->iZoneCounts = iZoneCounts;
+	
+	return 0;
+}
@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "CLoadBalancer.h"
+
+// Microbenchmark of the server address lookup that answers every client request
+// It times GetServerAddr() and ReadServerRecord() of the registry against the plain loads that the lookup used before the registry was published with atomics.
+// Every version is compiled with the same flags as the load balancer, so the numbers compare the code that actually runs.
+//
+// Usage: ./lookup_benchmark [servers] [lookups]
+
+// The number of servers registered by default (The lookups go through them in turn)
+#define DEFAULT_BENCHMARK_SERVER_COUNTS 1000
+
+// The number of lookups timed for each version by default
+#define DEFAULT_BENCHMARK_LOOKUP_COUNTS 50000000
+
+// The servers are registered on this port and above, from this address
+#define BENCHMARK_SERVER_PORT 20000
+#define BENCHMARK_SERVER_IP 0x0100007F
+
+// Defined in CLoadBalancer.cpp
+extern Server_Shard g_stServerShards[MAX_THREAD_COUNTS];
+
+// The part of a chunk that the lookup read before the registry was published with atomics
+// The arrays are plain, and their elements are read with plain loads.
+struct Plain_Server_Chunk
+{
+	alignas(CACHE_LINE_SIZE) long int iClientCounts[MAX_SERVER_NUMS_PER_ARRAY];
+	alignas(CACHE_LINE_SIZE) unsigned int uiGeneration[MAX_SERVER_NUMS_PER_ARRAY];
+	alignas(CACHE_LINE_SIZE) in_addr_t uiIP[MAX_SERVER_NUMS_PER_ARRAY];
+	alignas(CACHE_LINE_SIZE) unsigned short usPort[MAX_SERVER_NUMS_PER_ARRAY];
+};
+
+// Registers servers in the shard of thread 0 in the same way as the load balancer, and times the lookups of their addresses
+// It is a friend of CLoadBalancer, so the private lookup functions are called as they are.
+class CLookupBenchmark
+{
+public:
+	CLookupBenchmark(int iServerCounts_); // Constructor
+	~CLookupBenchmark(); // Destructor
+	
+	// Register the servers and copy them into the plain chunks
+	// Return -1 on Failure
+	// Return 0 on Success
+	int SetUp();
+	
+	// Time a version of the lookup, and print the time per lookup in nanoseconds
+	void TimeServerAddr(unsigned long ulLookupCounts_);
+	void TimeServerRecord(unsigned long ulLookupCounts_);
+	void TimePlainServerAddr(unsigned long ulLookupCounts_);
+
+private:
+	CLoadBalancer* m_pLoadBalancer;
+	Load_Balancer_Options m_stOptions;
+	int m_iServerCounts;
+	
+	// The plain chunk directory of the servers (The copy of the chunks of thread 0)
+	Plain_Server_Chunk** m_pPlainChunks;
+	size_t m_uiPlainChunkCounts;
+
+private:
+	// The lookup before the registry was published with atomics
+	int GetPlainServerAddr(unsigned char* pBuff_, int iListIndex_, int iArrIndex_);
+	
+	// Print the result of a version (The checksum keeps the compiler from dropping the lookups)
+	void PrintResult(const char* szName_, unsigned long ulLookupCounts_, unsigned long long ulElapsedTime_, unsigned long ulChecksum_);
+};
+
+// Constructor
+CLookupBenchmark::CLookupBenchmark(int iServerCounts_)
+{
+	// Same defaults as the load balancer
+	memset(&m_stOptions, 0, sizeof(m_stOptions));
+	m_stOptions.iSelectionPolicy = SSP_LEAST_CLIENTS;
+	m_stOptions.iChoiceCounts = DEFAULT_POWER_OF_D_CHOICES;
+	m_stOptions.iMetricWeights[SM_CLIENTS] = 1;
+	m_stOptions.iBatchCounts = 1;
+	m_stOptions.iZoneSpillThreshold = DEFAULT_ZONE_SPILL_THRESHOLD;
+	m_stOptions.iLoadBoundPercent = DEFAULT_LOAD_BOUND_PERCENT;
+	m_stOptions.iSlowStartWindow = DEFAULT_SLOW_START_WINDOW;
+	m_stOptions.iRebalanceThreshold = DEFAULT_SHARD_REBALANCE_THRESHOLD;
+	m_stOptions.iAggregatorInterval = DEFAULT_AGGREGATOR_INTERVAL;
+	m_stOptions.iUDPOverflowPolicy = UOP_DROP_OLDEST;
+	m_stOptions.iEventEngine = EE_EPOLL;
+	
+	// No socket is set up, so the ports are never used
+	m_pLoadBalancer = new CLoadBalancer(LB_PORT_FOR_CLIENT, LB_PORT_FOR_SERVER, 0, &m_stOptions);
+	m_iServerCounts = iServerCounts_;
+	
+	m_uiPlainChunkCounts = (iServerCounts_ + MAX_SERVER_NUMS_PER_ARRAY - 1) / MAX_SERVER_NUMS_PER_ARRAY;
+	m_pPlainChunks = new Plain_Server_Chunk*[m_uiPlainChunkCounts]();
+}
+
+// Destructor
+CLookupBenchmark::~CLookupBenchmark()
+{
+	for (size_t i = 0; i < m_uiPlainChunkCounts; ++i)
+		free(m_pPlainChunks[i]);
+	
+	delete[] m_pPlainChunks;
+	delete m_pLoadBalancer;
+}
+
+// Register the servers and copy them into the plain chunks
+// Every server is running with no client, so the lookup never fails.
+// Return -1 on Failure
+// Return 0 on Success
+int CLookupBenchmark::SetUp()
+{
+	for (int i = 0; i < m_iServerCounts; ++i)
+	{
+		Server_Data_Access_Info stServerInfo;
+		memset(&stServerInfo, 0, sizeof(stServerInfo));
+		stServerInfo.iSocketFD = -1;
+		stServerInfo.iListIndex = -1;
+		stServerInfo.iArrayIndex = -1;
+		stServerInfo.uiIP = BENCHMARK_SERVER_IP;
+		
+		unsigned short usPort = (unsigned short)(BENCHMARK_SERVER_PORT + i);
+		if (-1 == m_pLoadBalancer->RegisterServer(&stServerInfo, usPort, DEFAULT_SERVER_CAPACITY))
+			return -1;
+		
+		int iListIndex = stServerInfo.iListIndex;
+		int iArrIndex = stServerInfo.iArrayIndex;
+		g_stServerShards[0].pChunks.load(std::memory_order_acquire)[iListIndex]->iClientCounts[iArrIndex].store(0, std::memory_order_release);
+		
+		// Allocated in the same way as the chunks were before they held atomics
+		if (NULL == m_pPlainChunks[iListIndex])
+		{
+			void* pMemory = NULL;
+			if (0 != posix_memalign(&pMemory, CACHE_LINE_SIZE, sizeof(Plain_Server_Chunk)))
+				return -1;
+			
+			memset(pMemory, 0, sizeof(Plain_Server_Chunk));
+			m_pPlainChunks[iListIndex] = (Plain_Server_Chunk*)pMemory;
+		}
+		
+		Plain_Server_Chunk* pPlainChunk = m_pPlainChunks[iListIndex];
+		pPlainChunk->iClientCounts[iArrIndex] = 0;
+		pPlainChunk->uiGeneration[iArrIndex] = g_stServerShards[0].pChunks.load(std::memory_order_acquire)[iListIndex]->uiGeneration[iArrIndex].load(std::memory_order_relaxed);
+		pPlainChunk->uiIP[iArrIndex] = BENCHMARK_SERVER_IP;
+		pPlainChunk->usPort[iArrIndex] = usPort;
+	}
+	
+	return 0;
+}
+
+// Time GetServerAddr(), which reads the status together with the record of the server under one sequence number check
+// The generation that a selector would have read is taken from the plain chunks.
+void CLookupBenchmark::TimeServerAddr(unsigned long ulLookupCounts_)
+{
+	unsigned char szBuff[RESPONSE_TO_CLIENT_LENGTH];
+	unsigned long ulChecksum = 0;
+	
+	unsigned long long ulStartTime = m_pLoadBalancer->GetCurrentTime();
+	for (unsigned long i = 0; i < ulLookupCounts_; ++i)
+	{
+		int iSlotIndex = (int)(i % m_iServerCounts);
+		int iListIndex = iSlotIndex / MAX_SERVER_NUMS_PER_ARRAY;
+		int iArrIndex = iSlotIndex % MAX_SERVER_NUMS_PER_ARRAY;
+		if (0 == m_pLoadBalancer->GetServerAddr(szBuff, 0, iListIndex, iArrIndex, m_pPlainChunks[iListIndex]->uiGeneration[iArrIndex]))
+			ulChecksum += *((unsigned short*)szBuff);
+	}
+	
+	PrintResult("GetServerAddr()", ulLookupCounts_, m_pLoadBalancer->GetCurrentTime() - ulStartTime, ulChecksum);
+}
+
+// Time ReadServerRecord() alone
+void CLookupBenchmark::TimeServerRecord(unsigned long ulLookupCounts_)
+{
+	Server_Record stRecord;
+	unsigned long ulChecksum = 0;
+	
+	unsigned long long ulStartTime = m_pLoadBalancer->GetCurrentTime();
+	for (unsigned long i = 0; i < ulLookupCounts_; ++i)
+	{
+		int iSlotIndex = (int)(i % m_iServerCounts);
+		if (0 == m_pLoadBalancer->ReadServerRecord(0, iSlotIndex / MAX_SERVER_NUMS_PER_ARRAY, iSlotIndex % MAX_SERVER_NUMS_PER_ARRAY, &stRecord))
+			ulChecksum += stRecord.usPort;
+	}
+	
+	PrintResult("ReadServerRecord()", ulLookupCounts_, m_pLoadBalancer->GetCurrentTime() - ulStartTime, ulChecksum);
+}
+
+// Time the lookup before the registry was published with atomics
+void CLookupBenchmark::TimePlainServerAddr(unsigned long ulLookupCounts_)
+{
+	unsigned char szBuff[RESPONSE_TO_CLIENT_LENGTH];
+	unsigned long ulChecksum = 0;
+	
+	unsigned long long ulStartTime = m_pLoadBalancer->GetCurrentTime();
+	for (unsigned long i = 0; i < ulLookupCounts_; ++i)
+	{
+		int iSlotIndex = (int)(i % m_iServerCounts);
+		if (0 == GetPlainServerAddr(szBuff, iSlotIndex / MAX_SERVER_NUMS_PER_ARRAY, iSlotIndex % MAX_SERVER_NUMS_PER_ARRAY))
+			ulChecksum += *((unsigned short*)szBuff);
+	}
+	
+	PrintResult("Plain loads", ulLookupCounts_, m_pLoadBalancer->GetCurrentTime() - ulStartTime, ulChecksum);
+}
+
+// The lookup before the registry was published with atomics
+// The status is checked as the callers did, and the port and the IP are read with plain loads.
+// It is not inlined, in the same way as the member function it stands for.
+__attribute__((noinline)) int CLookupBenchmark::GetPlainServerAddr(unsigned char* pBuff_, int iListIndex_, int iArrIndex_)
+{
+	const Plain_Server_Chunk* pChunk = m_pPlainChunks[iListIndex_];
+	if (SERVER_DISCONNECTED == pChunk->iClientCounts[iArrIndex_])
+		return -1;
+	
+	unsigned short* pPort = (unsigned short*)pBuff_;
+	*pPort = pChunk->usPort[iArrIndex_];
+	
+	in_addr_t* pIP = (in_addr_t*)(pPort + 1);
+	*pIP = pChunk->uiIP[iArrIndex_];
+	
+	return 0;
+}
+
+// Print the result of a version
+void CLookupBenchmark::PrintResult(const char* szName_, unsigned long ulLookupCounts_, unsigned long long ulElapsedTime_, unsigned long ulChecksum_)
+{
+	double dNanoSeconds = (double)ulElapsedTime_ * 1000.0 / (double)ulLookupCounts_;
+	printf("%-20s %8.2f ns per lookup (checksum %lu)\n", szName_, dNanoSeconds, ulChecksum_);
+}
+
+// Main Function
+int main(int argc, char *argv[])
+{
+	int iServerCounts = DEFAULT_BENCHMARK_SERVER_COUNTS;
+	unsigned long ulLookupCounts = DEFAULT_BENCHMARK_LOOKUP_COUNTS;
+	
+	if (1 < argc)
+		iServerCounts = atoi(argv[1]);
+	
+	if (2 < argc)
+		ulLookupCounts = strtoul(argv[2], NULL, 10);
+	
+	if (iServerCounts < 1 || 65535 - BENCHMARK_SERVER_PORT < iServerCounts || 0 == ulLookupCounts)
+	{
+		printf("Usage: %s [servers (1 to %d)] [lookups]\n", argv[0], 65535 - BENCHMARK_SERVER_PORT);
+		return -1;
+	}
+	
+	CLookupBenchmark Benchmark(iServerCounts);
+	if (-1 == Benchmark.SetUp())
+	{
+		printf("SetUp() Failed\n");
+		return -1;
+	}
+	
+	printf("%d servers, %lu lookups\n", iServerCounts, ulLookupCounts);
+	
+	// The plain version goes first and last, so a change of the CPU clock during the run shows up as a difference between its two results
+	Benchmark.TimePlainServerAddr(ulLookupCounts);
+	Benchmark.TimeServerAddr(ulLookupCounts);
+	Benchmark.TimeServerRecord(ulLookupCounts);
+	Benchmark.TimePlainServerAddr(ulLookupCounts);
+	
+	return 0;
+}
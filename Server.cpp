@@ -10,6 +10,10 @@
 #include <pthread.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/resource.h>
 #include "Common_Header.h"
 
 // Thread arguments
@@ -41,9 +45,13 @@ ThreadData g_stArg;
 // The number of clients currently connected to the server
 long int g_iClientCounts = 0;
 
+// The number of requests received from clients so far
+// Only the thread communicating with clients writes on this value, and the main thread only reads it.
+unsigned long g_ulRequestCounts = 0;
+
 // Get Command Line Arguments if provided
-// Server port, load balancer IP, load balancer port 
-int ParseArguments(int argc, char* argv[], unsigned short* pServerPort_, struct in_addr* pLB_IP_, unsigned short* pLBPort_);
+// Server port, load balancer IP, load balancer port, server capacity
+int ParseArguments(int argc, char* argv[], unsigned short* pServerPort_, struct in_addr* pLB_IP_, unsigned short* pLBPort_, unsigned short* pCapacity_);
 
 // Set up epoll and lisening socket to accept incoming connections or packets
 // Run the server in another thread
@@ -76,13 +84,24 @@ int AcceptConnection(int iEpollFD_, int iListenSockFD_);
 // Initiate Connection with the load balancer
 int ConnectToLoadBalancer(in_addr_t uiIP_, unsigned short usPort_);
 
-// Send the Load Balancer the port number on which the server is listening 
-int SendServerPort(int iLBSockFD_, unsigned short usServerPort_);
+// Send the Load Balancer the port number on which the server is listening and the capacity of the server
+int SendServerPort(int iLBSockFD_, unsigned short usServerPort_, unsigned short usCapacity_);
 
-// Send the load balancer the number of clients currently connected to the server
-// The number of connected clients repsents how busy the server is 
+// Send the load balancer the number of clients currently connected to the server and other metrics of how busy the server is
 int SendServerStatus(int iLBSockFD_);
 
+// Wait until it is time to send the next status update, answering Ping packets from the load balancer in the meantime
+int WaitForNextUpdate(int iLBSockFD_);
+
+// Send a Ping packet from the load balancer back as a Pong packet
+int EchoPingPacket(int iLBSockFD_);
+
+// Get the number of connections waiting to be accepted
+unsigned int GetQueueDepth(int iListenSockFD_);
+
+// Get CPU utilisation of this server since the previous call (per mille of a core)
+unsigned int GetCPUUsage();
+
 // Handling SIGPIPE signal (For testing)
 void SignalHandler(int iSignal_);
 
@@ -99,9 +118,10 @@ int main(int argc, char *argv[])
 	unsigned short usServerPort = DEFAULT_PORT_FOR_CLIENT; // Port on which clients connect to the servver
 	unsigned short usLBPort = LB_PORT_FOR_SERVER; // Load Balancer Port
 	struct in_addr stLB_IP; // Load Balancer IP
+	unsigned short usCapacity = DEFAULT_SERVER_CAPACITY; // How many clients this server can handle relative to other servers
 
 	// Get Command Line Arguments
-	if (-1 == ParseArguments(argc, argv, &usServerPort, &stLB_IP, &usLBPort))
+	if (-1 == ParseArguments(argc, argv, &usServerPort, &stLB_IP, &usLBPort, &usCapacity))
 		exit(EXIT_FAILURE);
 	
 	// Set up the Server and run it in another thread
@@ -113,8 +133,8 @@ int main(int argc, char *argv[])
 	if (-1 == iLBSockFD)
 		exit(EXIT_FAILURE);
 		
-	// Send the Load Balancer the port number on which the server is listening 
-	if (-1 == SendServerPort(iLBSockFD, usServerPort))
+	// Send the Load Balancer the port number on which the server is listening and the capacity of the server
+	if (-1 == SendServerPort(iLBSockFD, usServerPort, usCapacity))
 		exit(EXIT_FAILURE);
 
 	// Repeatedly send status information to the load balaner on a regular time basis
@@ -123,17 +143,18 @@ int main(int argc, char *argv[])
 		if (-1 == SendServerStatus(iLBSockFD))
 			exit(EXIT_FAILURE);
 		
-		sleep(UPDATE_TIME_INTERVAL);
+		if (-1 == WaitForNextUpdate(iLBSockFD))
+			exit(EXIT_FAILURE);
 	}
 
 	return 0;
 }
 
 // Get Command Line Arguments if provided
-// Server port, load balancer IP, load balancer port 
+// Server port, load balancer IP, load balancer port, server capacity
 // Return -1 on Failure
 // Return 0 on Success
-int ParseArguments(int argc, char* argv[], unsigned short* pServerPort_, struct in_addr* pLB_IP_, unsigned short* pLBPort_)
+int ParseArguments(int argc, char* argv[], unsigned short* pServerPort_, struct in_addr* pLB_IP_, unsigned short* pLBPort_, unsigned short* pCapacity_)
 {
 	if (2 <= argc)
 	{
@@ -178,6 +199,18 @@ int ParseArguments(int argc, char* argv[], unsigned short* pServerPort_, struct
 		*pLBPort_ = (unsigned short)iLBPort;
 	}
 	
+	if (5 <= argc)
+	{
+		int iCapacity = atoi(argv[4]);
+		if (iCapacity < 1 || 65535 < iCapacity)
+		{
+			printf("Server Invalid Capacity\n");
+			return -1;
+		}
+		
+		*pCapacity_ = (unsigned short)iCapacity;
+	}
+	
 	return 0;
 }
 
@@ -310,6 +343,10 @@ void* ThreadMain(void* pArg_)
 		int iEventCounts = epoll_wait(iEpollFD, stEPollEvents, MAX_EVENT_COUNTS, -1);
 		if (-1 == iEventCounts)
 		{
+			// Interrupted by a signal (ex. The server was stopped and continued)
+			if (EINTR == errno)
+				continue;
+			
 			perror("epoll_wait");
 			exit(EXIT_FAILURE);
 		}
@@ -375,6 +412,9 @@ int RecvClientPacket(int iSockFD_)
 		return -1;
 	}
 	
+	if (0 < iResult)
+		++g_ulRequestCounts;
+	
 	return 0;
 }
 
@@ -475,17 +515,18 @@ int ConnectToLoadBalancer(in_addr_t uiIP_, unsigned short usPort_)
 }
 
 
-// Send the Load Balancer the port number on which the server is listening 
+// Send the Load Balancer the port number on which the server is listening and the capacity of the server
 // Return -1 on Failure 
 // Return a non negative integer on Success
-int SendServerPort(int iLBSockFD_, unsigned short usServerPort_)
+int SendServerPort(int iLBSockFD_, unsigned short usServerPort_, unsigned short usCapacity_)
 {
-	const size_t uiSendBuffLength = PACKET_TYPE_LENGTH * SERVER_PORT_NUM_PACKET_DATA_LENGTH;
+	const size_t uiSendBuffLength = PACKET_TYPE_LENGTH + SERVER_PORT_CAPACITY_PACKET_DATA_LENGTH;
 	unsigned char szSendBuff[uiSendBuffLength];
 	unsigned short* pSendPacket = (unsigned short*)szSendBuff;
 	
-	*pSendPacket = SERVER_PORT_NUM_PACKET_TYPE;
+	*pSendPacket = SERVER_PORT_CAPACITY_PACKET_TYPE;
 	*(pSendPacket + 1) = usServerPort_;
+	*(pSendPacket + 2) = usCapacity_;
 		
 	ssize_t iResult = send(iLBSockFD_, szSendBuff, uiSendBuffLength, 0);
 	if (-1 == iResult)
@@ -497,19 +538,30 @@ int SendServerPort(int iLBSockFD_, unsigned short usServerPort_)
 	return iResult;
 }
 
-// Send the load balancer the number of clients currently connected to the server
-// The number of connected clients repsents how busy the server is 
+// Send the load balancer the number of clients currently connected to the server and other metrics of how busy the server is
 // Return -1 on Failure (Terminate)
 // Return a non negative integer on Success
 int SendServerStatus(int iLBSockFD_)
 {
-	const size_t uiSendBuffLength = PACKET_TYPE_LENGTH + SERVER_STATUS_UPDATE_PACKET_DATA_LENGTH;
+	// The requests received before the previous status update have already been reported
+	static unsigned long ulReportedRequestCounts = 0;
+	
+	const size_t uiSendBuffLength = PACKET_TYPE_LENGTH + SERVER_STATUS_METRICS_PACKET_DATA_LENGTH;
 	unsigned char szSendBuff[uiSendBuffLength];
 	unsigned short* pPacketType = (unsigned short*)szSendBuff;
 	
-	*pPacketType = SERVER_STATUS_UPDATE_PACKET_TYPE;
+	*pPacketType = SERVER_STATUS_METRICS_PACKET_TYPE;
 	long int* pClientCount = (long int*)(pPacketType + 1);
 	*pClientCount = g_iClientCounts;
+	
+	unsigned long ulRequestCounts = g_ulRequestCounts;
+	unsigned int uiMetrics[3];
+	uiMetrics[0] = (unsigned int)(ulRequestCounts - ulReportedRequestCounts);
+	uiMetrics[1] = GetQueueDepth(g_stArg.iListenSockFD);
+	uiMetrics[2] = GetCPUUsage();
+	memcpy(pClientCount + 1, uiMetrics, sizeof(uiMetrics));
+	
+	ulReportedRequestCounts = ulRequestCounts;
 		
 	ssize_t iResult = send(iLBSockFD_, szSendBuff, uiSendBuffLength, 0);
 	/*
@@ -523,6 +575,124 @@ int SendServerStatus(int iLBSockFD_)
 	return iResult;
 }
 
+// Wait until it is time to send the next status update, answering Ping packets from the load balancer in the meantime
+// The load balancer measures how fast this server responds with Ping packets, so they are answered right away instead of after sleeping.
+// Return -1 on Failure (Terminate)
+// Return 0 on Success
+int WaitForNextUpdate(int iLBSockFD_)
+{
+	struct timespec stNow;
+	clock_gettime(CLOCK_MONOTONIC, &stNow);
+	long long llDeadline = stNow.tv_sec * 1000LL + stNow.tv_nsec / 1000000 + UPDATE_TIME_INTERVAL * 1000LL;
+	
+	while (1)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &stNow);
+		long long llRemainTime = llDeadline - (stNow.tv_sec * 1000LL + stNow.tv_nsec / 1000000);
+		if (0 >= llRemainTime)
+			return 0;
+		
+		struct pollfd stPollFD;
+		stPollFD.fd = iLBSockFD_;
+		stPollFD.events = POLLIN;
+		stPollFD.revents = 0;
+		
+		int iResult = poll(&stPollFD, 1, (int)llRemainTime);
+		if (-1 == iResult)
+		{
+			if (EINTR == errno)
+				continue;
+			
+			perror("poll()");
+			return -1;
+		}
+		else if (0 == iResult)
+			return 0;
+		
+		iResult = EchoPingPacket(iLBSockFD_);
+		if (-1 == iResult)
+			return -1;
+		
+		// The load balancer has closed the connection
+		// Wait as before, and the next status update finds out that the connection is closed
+		if (0 == iResult)
+		{
+			usleep(llRemainTime * 1000);
+			return 0;
+		}
+	}
+}
+
+// Send a Ping packet from the load balancer back as a Pong packet
+// Return -1 on Failure (Terminate)
+// Return 0 if the load balancer has closed the connection
+// Return 1 on Success
+int EchoPingPacket(int iLBSockFD_)
+{
+	const size_t uiBuffLength = PACKET_TYPE_LENGTH + SERVER_PING_PACKET_DATA_LENGTH;
+	unsigned char szBuff[uiBuffLength];
+	
+	// The socket is in blocking mode, and the rest of a Ping packet arrives right after its header
+	ssize_t iResult = recv(iLBSockFD_, szBuff, uiBuffLength, MSG_WAITALL);
+	if (-1 == iResult)
+	{
+		perror("recv() from load balancer");
+		return -1;
+	}
+	else if ((size_t)iResult < uiBuffLength)
+		return 0;
+	
+	unsigned short* pPacketType = (unsigned short*)szBuff;
+	if (SERVER_PING_PACKET_TYPE != *pPacketType)
+		return 1;
+	
+	// The timestamp is sent back as it is
+	*pPacketType = SERVER_PONG_PACKET_TYPE;
+	send(iLBSockFD_, szBuff, uiBuffLength, 0);
+	
+	return 1;
+}
+// Get the number of connections waiting to be accepted
+// For a listening socket, TCP_INFO reports the length of its accept queue as the number of unacknowledged segments.
+unsigned int GetQueueDepth(int iListenSockFD_)
+{
+	struct tcp_info stTCPInfo;
+	socklen_t uiLength = sizeof(stTCPInfo);
+	memset(&stTCPInfo, 0, sizeof(stTCPInfo));
+	
+	if (-1 == getsockopt(iListenSockFD_, IPPROTO_TCP, TCP_INFO, &stTCPInfo, &uiLength))
+		return 0;
+	
+	return stTCPInfo.tcpi_unacked;
+}
+
+// Get CPU utilisation of this server since the previous call (per mille of a core)
+// The first call reports 0.
+unsigned int GetCPUUsage()
+{
+	static long long llPrevCPUTime = 0;
+	static long long llPrevWallTime = 0;
+	
+	struct rusage stUsage;
+	if (-1 == getrusage(RUSAGE_SELF, &stUsage))
+		return 0;
+	
+	struct timespec stNow;
+	clock_gettime(CLOCK_MONOTONIC, &stNow);
+	
+	// Microseconds
+	long long llCPUTime = (stUsage.ru_utime.tv_sec + stUsage.ru_stime.tv_sec) * 1000000LL + stUsage.ru_utime.tv_usec + stUsage.ru_stime.tv_usec;
+	long long llWallTime = stNow.tv_sec * 1000000LL + stNow.tv_nsec / 1000;
+	
+	unsigned int uiUsage = 0;
+	if (0 != llPrevWallTime && llWallTime > llPrevWallTime)
+		uiUsage = (unsigned int)((llCPUTime - llPrevCPUTime) * 1000 / (llWallTime - llPrevWallTime));
+	
+	llPrevCPUTime = llCPUTime;
+	llPrevWallTime = llWallTime;
+	
+	return uiUsage;
+}
 
 // Handling SIGPIPE signal (for testing)
 void SignalHandler(int iSignal_)
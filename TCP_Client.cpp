@@ -13,8 +13,8 @@
 #define DEFAULT_LB_IP "127.0.0.1"
 
 // Get Command Line Arguments if provided
-// load balancer IP, load balancer port 
-int ParseArguments(int argc, char* argv[], struct in_addr* pLB_IP_, unsigned short* pLBPort_);
+// load balancer IP, load balancer port, key
+int ParseArguments(int argc, char* argv[], struct in_addr* pLB_IP_, unsigned short* pLBPort_, bool* pKeyed_, unsigned long long* pKey_);
 
 // Initiate Connection to the server
 int ConnectToServer(in_addr_t uiIP_, unsigned short usPort_);
@@ -23,10 +23,10 @@ int ConnectToServer(in_addr_t uiIP_, unsigned short usPort_);
 int ConnectToLoadBalancer(in_addr_t uiIP_, unsigned short usPort_);
 
 // Get the IP and port of a server from the load balancer
-int GetServerAddr(int iLBSockFD_, in_addr_t* pIP_, unsigned short* pPort_);
+int GetServerAddr(int iLBSockFD_, bool bKeyed_, unsigned long long ulKey_, in_addr_t* pIP_, unsigned short* pPort_);
 
 // Send Server Addr Request to the load balancer
-int SendServerAddrReq(int iLBSockFD_);
+int SendServerAddrReq(int iLBSockFD_, bool bKeyed_, unsigned long long ulKey_);
 
 // Receive Server Addr Response from the load balancer
 int RecvServerAddrResponse(int iLBSockFD_,  in_addr_t* pIP_, unsigned short* pPort_);
@@ -50,9 +50,11 @@ int main(int argc, char *argv[])
 
 	unsigned short usLBPort = LB_PORT_FOR_CLIENT; // Load Balancer Port
 	struct in_addr stLB_IP; // Load Balancer IP
+	bool bKeyed = false; // Send a Keyed Server Address Request if a key is given
+	unsigned long long ulKey = 0; // Requests with the same key get the same server
 	
 	// Get Command Line Arguments
-	if (-1 == ParseArguments(argc, argv, &stLB_IP, &usLBPort))
+	if (-1 == ParseArguments(argc, argv, &stLB_IP, &usLBPort, &bKeyed, &ulKey))
 		exit(EXIT_FAILURE);
 	
 	// TCP Socket to communicate with the load balancer
@@ -66,7 +68,7 @@ int main(int argc, char *argv[])
 	in_addr_t uiServerIP;
 	unsigned short usServerPort;
 	// Get the IP and Port of a server from the Load balaner
-	if (-1 == GetServerAddr(iLBSockFD, &uiServerIP, &usServerPort))
+	if (-1 == GetServerAddr(iLBSockFD, bKeyed, ulKey, &uiServerIP, &usServerPort))
 	{
 		printf("Error in GetServerAddr()\n");
 		exit(EXIT_FAILURE);
@@ -98,10 +100,10 @@ int main(int argc, char *argv[])
 
 
 // Get Command Line Arguments if provided
-// load balancer IP, load balancer port
+// load balancer IP, load balancer port, key
 // Return -1 on Failure
 // Return 0 on Success
-int ParseArguments(int argc, char* argv[], struct in_addr* pLB_IP_, unsigned short* pLBPort_)
+int ParseArguments(int argc, char* argv[], struct in_addr* pLB_IP_, unsigned short* pLBPort_, bool* pKeyed_, unsigned long long* pKey_)
 {
 	if (2 <= argc)
 	{
@@ -132,6 +134,12 @@ int ParseArguments(int argc, char* argv[], struct in_addr* pLB_IP_, unsigned sho
 		*pLBPort_ = (unsigned short)iLBPort;
 	}
 	
+	if (4 <= argc)
+	{
+		*pKeyed_ = true;
+		*pKey_ = strtoull(argv[3], NULL, 0);
+	}
+	
 	return 0;
 }
 
@@ -182,10 +190,10 @@ int ConnectToLoadBalancer(in_addr_t uiIP_, unsigned short usPort_)
 // Get the IP and port of a server from the load balancer
 // Return -1 on Failure
 // Return 0 on Success
-int GetServerAddr(int iLBSockFD_, in_addr_t* pIP_, unsigned short* pPort_)
+int GetServerAddr(int iLBSockFD_, bool bKeyed_, unsigned long long ulKey_, in_addr_t* pIP_, unsigned short* pPort_)
 {
 	// Send Server Addr Request to the load balancer
-	if (-1 == SendServerAddrReq(iLBSockFD_))
+	if (-1 == SendServerAddrReq(iLBSockFD_, bKeyed_, ulKey_))
 		return -1;
 	
 	// Receive Server Addr Response from the load balancer
@@ -201,11 +209,20 @@ int GetServerAddr(int iLBSockFD_, in_addr_t* pIP_, unsigned short* pPort_)
 // Send Server Addr Request to the load balancer
 // Return -1 on Failure
 // Return 0 on Success
-int SendServerAddrReq(int iLBSockFD_)
+int SendServerAddrReq(int iLBSockFD_, bool bKeyed_, unsigned long long ulKey_)
 {
 	unsigned char szSendBuff[REQUEST_FROM_CLIENT_LENGTH];
+	size_t uiSendBuffLength = SERVER_ADDR_REQUEST_LENGTH;
 	*(unsigned short*)szSendBuff = SERVER_ADDR_REQUEST_TYPE;
-	ssize_t iResult = send(iLBSockFD_, szSendBuff, REQUEST_FROM_CLIENT_LENGTH, 0);
+	
+	if (bKeyed_)
+	{
+		*(unsigned short*)szSendBuff = SERVER_ADDR_KEYED_REQUEST_TYPE;
+		memcpy(szSendBuff + sizeof(unsigned short), &ulKey_, sizeof(ulKey_));
+		uiSendBuffLength = SERVER_ADDR_KEYED_REQUEST_LENGTH;
+	}
+	
+	ssize_t iResult = send(iLBSockFD_, szSendBuff, uiSendBuffLength, 0);
 	if (-1 == iResult)
 	{
 		perror("send() to load balaner");
@@ -230,7 +247,7 @@ int RecvServerAddrResponse(int iLBSockFD_, in_addr_t* pIP_, unsigned short* pPor
 
 	unsigned short* pPacket = (unsigned short*)szRecvBuff;
 	unsigned short usType = *pPacket;
-	if (SERVER_ADDR_REQUEST_TYPE != usType)
+	if (SERVER_ADDR_REQUEST_TYPE != usType && SERVER_ADDR_KEYED_REQUEST_TYPE != usType)
 	{
 		printf("Unexpected Response\n");
 		return -1;
@@ -13,8 +13,8 @@
 #define DEFAULT_LB_IP "127.0.0.1"
 
 // Get Command Line Arguments if provided
-// load balancer IP, load balancer port 
-int ParseArguments(int argc, char* argv[], struct in_addr* pLB_IP_, unsigned short* pLBPort_);
+// load balancer IP, load balancer port, key
+int ParseArguments(int argc, char* argv[], struct in_addr* pLB_IP_, unsigned short* pLBPort_, bool* pKeyed_, unsigned long long* pKey_);
 
 // Create a UDP socket and make it non-blocking
 int SetUpUDPsocket();
@@ -23,10 +23,10 @@ int SetUpUDPsocket();
 int ConnectToServer(in_addr_t uiIP_, unsigned short usPort_);
 
 // Get the IP and port of a server from the load balancer
-int GetServerAddr(int iUDPSockFD_, in_addr_t uiLBIP_, unsigned short usLBPort_, in_addr_t* pServerIP_, unsigned short* pServerPort_);
+int GetServerAddr(int iUDPSockFD_, in_addr_t uiLBIP_, unsigned short usLBPort_, bool bKeyed_, unsigned long long ulKey_, in_addr_t* pServerIP_, unsigned short* pServerPort_);
 
 // Send Server Addr Request to the load balancer
-ssize_t SendServerAddrReq(int iLBSockFD_, in_addr_t uiLBIP_, unsigned short usLBPort_);
+ssize_t SendServerAddrReq(int iLBSockFD_, in_addr_t uiLBIP_, unsigned short usLBPort_, bool bKeyed_, unsigned long long ulKey_);
 
 // Receive Server Addr Response from the load balancer
 ssize_t RecvServerAddrResponse(int iLBSockFD_, in_addr_t* pIP_, unsigned short* pPort_);
@@ -50,9 +50,11 @@ int main(int argc, char *argv[])
 
 	unsigned short usLBPort = LB_PORT_FOR_CLIENT; // Load Balancer Port
 	struct in_addr stLB_IP; // Load Balancer IP
+	bool bKeyed = false; // Send a Keyed Server Address Request if a key is given
+	unsigned long long ulKey = 0; // Requests with the same key get the same server
 	
 	// Get Command Line Arguments
-	if (-1 == ParseArguments(argc, argv, &stLB_IP, &usLBPort))
+	if (-1 == ParseArguments(argc, argv, &stLB_IP, &usLBPort, &bKeyed, &ulKey))
 		exit(EXIT_FAILURE);
 	
 	// Set up UDP socket to communicate with the load balancer
@@ -64,7 +66,7 @@ int main(int argc, char *argv[])
 	in_addr_t uiServerIP;
 	unsigned short usServerPort;
 	// Get the IP and Port of a server from the Load balaner
-	if (-1 == GetServerAddr(iLBSockFD, stLB_IP.s_addr, usLBPort, &uiServerIP, &usServerPort))
+	if (-1 == GetServerAddr(iLBSockFD, stLB_IP.s_addr, usLBPort, bKeyed, ulKey, &uiServerIP, &usServerPort))
 	{
 		printf("Error in GetServerAddr()\n");
 		exit(EXIT_FAILURE);
@@ -95,10 +97,10 @@ int main(int argc, char *argv[])
 
 
 // Get Command Line Arguments if provided
-// load balancer IP, load balancer port 
+// load balancer IP, load balancer port, key
 // Return -1 on Failure
 // Return 0 on Success
-int ParseArguments(int argc, char* argv[], struct in_addr* pLB_IP_, unsigned short* pLBPort_)
+int ParseArguments(int argc, char* argv[], struct in_addr* pLB_IP_, unsigned short* pLBPort_, bool* pKeyed_, unsigned long long* pKey_)
 {
 	if (2 <= argc)
 	{
@@ -129,6 +131,12 @@ int ParseArguments(int argc, char* argv[], struct in_addr* pLB_IP_, unsigned sho
 		*pLBPort_ = (unsigned short)iLBPort;
 	}
 	
+	if (4 <= argc)
+	{
+		*pKeyed_ = true;
+		*pKey_ = strtoull(argv[3], NULL, 0);
+	}
+	
 	return 0;
 }
 
@@ -165,14 +173,14 @@ int SetUpUDPsocket()
 // Get the IP and port of a server from the load balancer
 // Return -1 on Failure
 // Return 0 on Success
-int GetServerAddr(int iLBSockFD_, in_addr_t uiLBIP_, unsigned short usLBPort_, in_addr_t* pServerIP_, unsigned short* pServerPort_)
+int GetServerAddr(int iLBSockFD_, in_addr_t uiLBIP_, unsigned short usLBPort_, bool bKeyed_, unsigned long long ulKey_, in_addr_t* pServerIP_, unsigned short* pServerPort_)
 {
 	// UDP does not provide delivery guarantee, so there needs retransmission.
 	// This is just a test client example, so the client simply sends, sleeps, and receives in a loop until it gets a response from the load balancer
 	while (1)
 	{
 		// Send Server Addr Request to the load balancer
-		ssize_t iResult = SendServerAddrReq(iLBSockFD_, uiLBIP_, usLBPort_);
+		ssize_t iResult = SendServerAddrReq(iLBSockFD_, uiLBIP_, usLBPort_, bKeyed_, ulKey_);
 		if (-1 == iResult)
 			return -1;
 		else if (0 == iResult)
@@ -197,7 +205,7 @@ int GetServerAddr(int iLBSockFD_, in_addr_t uiLBIP_, unsigned short usLBPort_, i
 // Return -1 on Failure
 // Return 0 if space is not available
 // Return an non-negative integer on Success
-ssize_t SendServerAddrReq(int iLBSockFD_, in_addr_t uiLBIP_, unsigned short usLBPort_)
+ssize_t SendServerAddrReq(int iLBSockFD_, in_addr_t uiLBIP_, unsigned short usLBPort_, bool bKeyed_, unsigned long long ulKey_)
 {
 	struct sockaddr_in stSockAddr;
 	stSockAddr.sin_family = AF_INET;
@@ -206,8 +214,17 @@ ssize_t SendServerAddrReq(int iLBSockFD_, in_addr_t uiLBIP_, unsigned short usLB
 	socklen_t uiAddrLen = sizeof(stSockAddr);
 	
 	unsigned char szSendBuff[REQUEST_FROM_CLIENT_LENGTH];
+	size_t uiSendBuffLength = SERVER_ADDR_REQUEST_LENGTH;
 	*(unsigned short*)szSendBuff = SERVER_ADDR_REQUEST_TYPE;
-	ssize_t iResult = sendto(iLBSockFD_, szSendBuff, REQUEST_FROM_CLIENT_LENGTH, 0, (struct sockaddr*)&stSockAddr, uiAddrLen);
+	
+	if (bKeyed_)
+	{
+		*(unsigned short*)szSendBuff = SERVER_ADDR_KEYED_REQUEST_TYPE;
+		memcpy(szSendBuff + sizeof(unsigned short), &ulKey_, sizeof(ulKey_));
+		uiSendBuffLength = SERVER_ADDR_KEYED_REQUEST_LENGTH;
+	}
+	
+	ssize_t iResult = sendto(iLBSockFD_, szSendBuff, uiSendBuffLength, 0, (struct sockaddr*)&stSockAddr, uiAddrLen);
 	if (-1 == iResult)
 	{
 		if (EAGAIN == errno || EWOULDBLOCK == errno)
@@ -247,7 +264,7 @@ ssize_t RecvServerAddrResponse(int iLBSockFD_, in_addr_t* pIP_, unsigned short*
 
 	unsigned short* pPacket = (unsigned short*)szRecvBuff;
 	unsigned short usType = *pPacket;
-	if (SERVER_ADDR_REQUEST_TYPE != usType)
+	if (SERVER_ADDR_REQUEST_TYPE != usType && SERVER_ADDR_KEYED_REQUEST_TYPE != usType)
 	{
 		printf("Unexpected Response\n");
 		return -1;